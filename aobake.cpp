@@ -0,0 +1,163 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "aobake.h"
+#include "bvh.h"
+#include "jobs.h"
+#include "model.h"
+#include "tgaimage.h"
+#include "trace.h"
+
+static const int DILATE_PASSES = 4;
+
+struct BakeTexel {
+    int face;  // -1: no face covers the texel centre
+    Vec3f bar;
+};
+
+// xorshift32 seeded from a hash of the texel index
+struct TexelRng {
+    uint32_t s;
+    explicit TexelRng(uint32_t seed) {
+        seed ^= seed>>16; seed *= 0x7feb352d;
+        seed ^= seed>>15; seed *= 0x846ca68b;
+        seed ^= seed>>16;
+        s = seed ? seed : 1;
+    }
+    float next() {
+        s ^= s<<13; s ^= s>>17; s ^= s<<5;
+        return (s>>8)*(1.f/16777216.f);
+    }
+};
+
+bool ao_bake(const char *obj_filename, const char *tga_filename, int size, int rays, float distance) {
+    TRACE_SCOPE("ao_bake");
+    if (size<1 || rays<1) {
+        std::cerr << "ao bake: bad size or ray count" << std::endl;
+        return false;
+    }
+    Model model(obj_filename);
+    if (!model.nfaces()) {
+        std::cerr << "no faces in " << obj_filename << std::endl;
+        return false;
+    }
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    Bvh bvh;
+    bvh.build(model);
+    double build_s = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+    Vec3f lo, hi;
+    model.bounds(lo, hi);
+    const float diagonal = (hi-lo).norm(), tmax = distance*diagonal, offset = 1e-4f*diagonal;
+
+    // which face, and where on it, each texel centre is
+    std::vector<BakeTexel> texels(size*size);
+    for (size_t i=0; i<texels.size(); i++) texels[i].face = -1;
+    for (int f=0; f<model.nfaces(); f++) {
+        Vec2f t[3];
+        for (int j=0; j<3; j++) t[j] = Vec2f(model.uv(f, j).x*size, model.uv(f, j).y*size);
+        float area = (t[1].x-t[0].x)*(t[2].y-t[0].y) - (t[2].x-t[0].x)*(t[1].y-t[0].y);
+        if (std::abs(area)<1e-12f) continue;
+        int x0 = std::max(0, (int)std::floor(std::min(t[0].x, std::min(t[1].x, t[2].x))));
+        int y0 = std::max(0, (int)std::floor(std::min(t[0].y, std::min(t[1].y, t[2].y))));
+        int x1 = std::min(size-1, (int)std::ceil(std::max(t[0].x, std::max(t[1].x, t[2].x))));
+        int y1 = std::min(size-1, (int)std::ceil(std::max(t[0].y, std::max(t[1].y, t[2].y))));
+        for (int y=y0; y<=y1; y++) {
+            for (int x=x0; x<=x1; x++) {
+                float px = x+.5f, py = y+.5f;
+                float b1 = ((px-t[0].x)*(t[2].y-t[0].y) - (t[2].x-t[0].x)*(py-t[0].y))/area;
+                float b2 = ((t[1].x-t[0].x)*(py-t[0].y) - (px-t[0].x)*(t[1].y-t[0].y))/area;
+                if (b1<0 || b2<0 || b1+b2>1) continue;
+                texels[x+y*size].face = f;
+                texels[x+y*size].bar = Vec3f(1-b1-b2, b1, b2);
+            }
+        }
+    }
+
+    std::vector<float> ao(size*size, -1.f);
+    std::atomic<uint64_t> cast(0);
+    std::atomic<int> covered(0);
+    start = std::chrono::steady_clock::now();
+    JobSystem::instance().parallel_for(0, size, 4, [&](int row0, int row1) {
+        uint64_t nrays = 0;
+        int ntexels = 0;
+        for (int y=row0; y<row1; y++) {
+            for (int x=0; x<size; x++) {
+                const BakeTexel &texel = texels[x+y*size];
+                if (texel.face<0) continue;
+                Vec3f v[3], p(0,0,0), n(0,0,0);
+                for (int j=0; j<3; j++) {
+                    v[j] = model.vert(texel.face, j);
+                    p = p + v[j]*texel.bar[j];
+                    n = n + model.normal(texel.face, j)*texel.bar[j];
+                }
+                n.normalize();
+                Vec3f ng = cross(v[1]-v[0], v[2]-v[0]).normalize();
+                if (ng*n<0) ng = ng*-1.f;
+                Vec3f origin = p + ng*offset; // off the face, or it would hit itself
+                Vec3f a = std::abs(n.x)>.9f ? Vec3f(0,1,0) : Vec3f(1,0,0);
+                Vec3f tangent = cross(a, n).normalize(), bitangent = cross(n, tangent);
+                TexelRng rng(x+y*size);
+                int open = 0;
+                for (int r=0; r<rays; r++) {
+                    float phi = 2*M_PI*rng.next(), u = rng.next(), radius = std::sqrt(u);
+                    Vec3f dir = tangent*(radius*std::cos(phi)) + bitangent*(radius*std::sin(phi)) + n*std::sqrt(1-u);
+                    float below = dir*ng;
+                    if (below<0) dir = dir - ng*(2*below); // under the face the shading normal leans away from: mirror it back
+                    if (!bvh.occluded(origin, dir, 0, tmax)) open++;
+                }
+                ao[x+y*size] = open/(float)rays;
+                nrays += rays;
+                ntexels++;
+            }
+        }
+        cast += nrays;
+        covered += ntexels;
+    });
+    double bake_s = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+
+    // grow the islands a few texels into the background
+    std::vector<float> grown(ao);
+    for (int pass=0; pass<DILATE_PASSES; pass++) {
+        for (int y=0; y<size; y++) {
+            for (int x=0; x<size; x++) {
+                if (ao[x+y*size]>=0) continue;
+                float sum = 0;
+                int n = 0;
+                for (int dy=-1; dy<=1; dy++) {
+                    for (int dx=-1; dx<=1; dx++) {
+                        int nx = x+dx, ny = y+dy;
+                        if (nx<0 || ny<0 || nx>=size || ny>=size || ao[nx+ny*size]<0) continue;
+                        sum += ao[nx+ny*size];
+                        n++;
+                    }
+                }
+                if (n) grown[x+y*size] = sum/n;
+            }
+        }
+        ao = grown;
+    }
+
+    TGAImage image(size, size, TGAImage::GRAYSCALE);
+    for (int y=0; y<size; y++) {
+        for (int x=0; x<size; x++) {
+            float a = ao[x+y*size]<0 ? 1.f : ao[x+y*size];
+            image.set(x, y, TGAColor((unsigned char)(a*255+.5f)));
+        }
+    }
+    image.flip_vertically(); // Model::load_texture flips it back
+    std::string out = tga_filename ? tga_filename : std::string(obj_filename).substr(0, std::string(obj_filename).find_last_of(".")) + "_ao.tga";
+    if (!image.write_tga_file(out.c_str())) {
+        std::cerr << "can't write " << out << std::endl;
+        return false;
+    }
+    std::cerr << "ao: bvh of " << bvh.nodes() << " nodes, depth " << bvh.depth() << ", built in " << build_s*1e3 << " ms" << std::endl;
+    std::cerr << "ao: " << covered.load() << " texels, " << cast.load() << " rays in " << bake_s << " s on "
+              << JobSystem::instance().threads() << " threads, " << (bake_s>0 ? cast.load()/bake_s*1e-6 : 0) << " Mrays/s" << std::endl;
+    std::cerr << "ao " << out << " written" << std::endl;
+    return true;
+}
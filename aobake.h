@@ -0,0 +1,17 @@
+#ifndef __AOBAKE_H__
+#define __AOBAKE_H__
+
+// Offline ambient occlusion bake (./main --bake-ao model.obj [size] [rays]).
+// Every texel the model's uv layout covers casts rays cosine-distributed over
+// the hemisphere of its interpolated normal against a Bvh of the model; the
+// texel keeps the fraction that get further than distance (relative to the
+// bounding box diagonal) without hitting a face. Rows of texels are jobs,
+// each texel seeds its own random sequence, so the map does not depend on
+// the thread count. Texels next to the uv islands are filled from their
+// neighbours so that sampling at seams does not pick up the background.
+// The map is written grayscale to tga_filename, by default the model's name
+// with _ao.tga, where Model picks it up: the shader then scales its lighting
+// by one more texture fetch.
+bool ao_bake(const char *obj_filename, const char *tga_filename, int size=1024, int rays=64, float distance=.25f);
+
+#endif //__AOBAKE_H__
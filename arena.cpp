@@ -0,0 +1,59 @@
+#include <algorithm>
+#include <cstdint>
+#include "arena.h"
+
+FrameArena::FrameArena(size_t initial_bytes) : blocks_(), used_(0), frame_bytes_(0), high_water_(0) {
+    blocks_.reserve(8);
+    Block b = {new unsigned char[initial_bytes], initial_bytes};
+    blocks_.push_back(b);
+}
+
+FrameArena::~FrameArena() {
+    for (size_t i=0; i<blocks_.size(); i++) delete [] blocks_[i].data;
+}
+
+void *FrameArena::alloc(size_t bytes, size_t align) {
+    Block *b = &blocks_.back();
+    uintptr_t p = (uintptr_t)(b->data + used_);
+    size_t pad = (align - p%align) % align;
+    if (used_+pad+bytes > b->size) { // overflow, until the next reset()
+        size_t size = std::max(b->size*2, bytes+align);
+        Block nb = {new unsigned char[size], size};
+        blocks_.push_back(nb);
+        b = &blocks_.back();
+        used_ = 0;
+        p = (uintptr_t)b->data;
+        pad = (align - p%align) % align;
+    }
+    void *ret = b->data + used_ + pad;
+    used_ += pad+bytes;
+    frame_bytes_ += pad+bytes;
+    high_water_ = std::max(high_water_, frame_bytes_);
+    return ret;
+}
+
+void FrameArena::reset() {
+    if (blocks_.size()>1) {
+        size_t size = 0;
+        for (size_t i=0; i<blocks_.size(); i++) {
+            size += blocks_[i].size;
+            delete [] blocks_[i].data;
+        }
+        blocks_.clear();
+        size = std::max(size, high_water_ + 64);
+        Block b = {new unsigned char[size], size};
+        blocks_.push_back(b);
+    }
+    used_ = 0;
+    frame_bytes_ = 0;
+}
+
+size_t FrameArena::capacity() const {
+    size_t size = 0;
+    for (size_t i=0; i<blocks_.size(); i++) size += blocks_[i].size;
+    return size;
+}
+
+size_t FrameArena::high_water() const {
+    return high_water_;
+}
@@ -0,0 +1,35 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+#include <cstddef>
+#include <vector>
+
+// Linear allocator for data that only lives until the end of a frame (tile
+// lists, dirty regions, ...). alloc() bumps a pointer and reset() drops
+// everything at once. A frame that overflows the block gets extra blocks, and
+// the next reset() folds them into one block big enough for that frame, so a
+// steady stream of similar frames stops touching the heap after the first.
+class FrameArena {
+public:
+    explicit FrameArena(size_t initial_bytes=1<<16);
+    ~FrameArena();
+    FrameArena(const FrameArena &) = delete;
+    FrameArena &operator=(const FrameArena &) = delete;
+
+    void *alloc(size_t bytes, size_t align=16);
+    // uninitialized room for n T's; nothing is destroyed on reset, so T must be trivially destructible
+    template <typename T> T *alloc(size_t n) { return static_cast<T *>(alloc(n*sizeof(T), alignof(T))); }
+    void reset();
+    size_t capacity() const;   // bytes, over all blocks
+    size_t high_water() const; // most bytes a frame used so far
+private:
+    struct Block {
+        unsigned char *data;
+        size_t size;
+    };
+    std::vector<Block> blocks_; // the last one is being filled
+    size_t used_;               // of the last block
+    size_t frame_bytes_;        // handed out since reset, padding included
+    size_t high_water_;
+};
+
+#endif //__ARENA_H__
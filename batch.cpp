@@ -0,0 +1,374 @@
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <thread>
+#include "batch.h"
+#include "trace.h"
+
+static double ms_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now()-start).count();
+}
+
+static std::string trim(const std::string &s) {
+    size_t a = 0, b = s.size();
+    while (a<b && isspace((unsigned char)s[a])) a++;
+    while (b>a && isspace((unsigned char)s[b-1])) b--;
+    return s.substr(a, b-a);
+}
+
+typedef std::vector<std::pair<std::string, std::string> > Fields; // key, value of one job
+
+// the fields as a request line for parse_request(), output aside
+static bool make_job(const Fields &fields, int line, int index, BatchJob &job, std::string &error) {
+    std::string request = "render";
+    bool has_format = false;
+    job.line = line;
+    job.output.clear();
+    for (size_t i=0; i<fields.size(); i++) {
+        const std::string &key = fields[i].first;
+        std::string value = trim(fields[i].second);
+        if (key.empty()) continue;
+        if (key=="model" || key=="output") {
+            if (value.find_first_of(" \t")!=std::string::npos) {
+                error = "spaces in '" + key + "' are not supported";
+                return false;
+            }
+        } else {
+            value.erase(std::remove_if(value.begin(), value.end(), isspace), value.end()); // "1, 1, 3"
+        }
+        if (key=="output") {
+            job.output = value;
+            continue;
+        }
+        if (value.empty()) continue; // an empty CSV cell keeps the default
+        if (key=="format") has_format = true;
+        request += " " + key + "=" + value;
+    }
+    if (!has_format && !job.output.empty()) { // the output's extension
+        size_t dot = job.output.rfind('.');
+        ImageFormat format;
+        if (dot!=std::string::npos && parse_image_format(job.output.c_str()+dot+1, format)) request += " format=" + job.output.substr(dot+1);
+    }
+    job.request = RenderRequest();
+    if (!parse_request(request, job.request, error)) return false;
+    if (job.output.empty()) {
+        char name[64];
+        snprintf(name, sizeof(name), "batch_%d.%s", index, image_format_extension(job.request.format));
+        job.output = name;
+    }
+    return true;
+}
+
+// one CSV line, fields in double quotes may hold commas and "" for a quote
+static bool split_csv(const std::string &line, std::vector<std::string> &cells) {
+    cells.assign(1, "");
+    bool quoted = false;
+    for (size_t i=0; i<line.size(); i++) {
+        char c = line[i];
+        if (quoted) {
+            if (c=='"' && i+1<line.size() && line[i+1]=='"') cells.back() += line[++i];
+            else if (c=='"') quoted = false;
+            else cells.back() += c;
+        } else if (c=='"') {
+            quoted = true;
+        } else if (c==',') {
+            cells.push_back("");
+        } else if (c!='\r') {
+            cells.back() += c;
+        }
+    }
+    return !quoted;
+}
+
+// a bad line skips its job, only a bad header stops the load
+static bool load_csv(std::istream &in, const char *filename, std::vector<BatchJob> &jobs, int &skipped) {
+    std::vector<std::string> header, cells;
+    std::string line, error;
+    int n = 0;
+    while (std::getline(in, line)) {
+        n++;
+        if (trim(line).empty() || trim(line)[0]=='#') continue;
+        if (!split_csv(line, cells)) {
+            std::cerr << filename << ":" << n << ": unterminated quote" << std::endl;
+            if (header.empty()) return false;
+            skipped++;
+            continue;
+        }
+        if (header.empty()) {
+            header = cells;
+            for (size_t i=0; i<header.size(); i++) header[i] = trim(header[i]);
+            continue;
+        }
+        if (cells.size()>header.size()) {
+            std::cerr << filename << ":" << n << ": " << cells.size() << " fields, the header names " << header.size() << std::endl;
+            skipped++;
+            continue;
+        }
+        Fields fields;
+        for (size_t i=0; i<cells.size(); i++) fields.push_back(std::make_pair(header[i], cells[i]));
+        BatchJob job;
+        if (!make_job(fields, n, (int)jobs.size()+skipped, job, error)) {
+            std::cerr << filename << ":" << n << ": " << error << std::endl;
+            skipped++;
+            continue;
+        }
+        jobs.push_back(job);
+    }
+    return true;
+}
+
+// The JSON of manifests: an array of objects whose values are strings, numbers
+// or arrays of numbers, the last joined with commas.
+class JsonReader {
+public:
+    JsonReader(const std::string &text) : s_(text), pos_(0), line_(1) {}
+    int line() const { return line_; }
+    bool at_end() { skip(); return pos_>=s_.size(); }
+    bool accept(char c) {
+        skip();
+        if (pos_<s_.size() && s_[pos_]==c) {
+            pos_++;
+            return true;
+        }
+        return false;
+    }
+    bool string(std::string &out) {
+        if (!accept('"')) return false;
+        out.clear();
+        while (pos_<s_.size() && s_[pos_]!='"') {
+            char c = s_[pos_++];
+            if (c=='\\' && pos_<s_.size()) {
+                c = s_[pos_++];
+                if (c=='n') c = '\n';
+                else if (c=='t') c = '\t';
+                else if (c!='"' && c!='\\' && c!='/') return false; // no \u, paths and numbers don't need it
+            }
+            out += c;
+        }
+        return accept('"');
+    }
+    bool number(std::string &out) {
+        skip();
+        size_t start = pos_;
+        while (pos_<s_.size() && (isdigit((unsigned char)s_[pos_]) || (s_[pos_] && strchr("+-.eE", s_[pos_])))) pos_++;
+        out = s_.substr(start, pos_-start);
+        return pos_>start;
+    }
+    bool value(std::string &out) {
+        skip();
+        if (pos_<s_.size() && s_[pos_]=='"') return string(out);
+        if (!accept('[')) return number(out);
+        out.clear();
+        std::string item;
+        if (accept(']')) return true;
+        do {
+            if (!number(item)) return false;
+            out += (out.empty() ? "" : ",") + item;
+        } while (accept(','));
+        return accept(']');
+    }
+private:
+    void skip() {
+        while (pos_<s_.size() && isspace((unsigned char)s_[pos_])) {
+            if (s_[pos_]=='\n') line_++;
+            pos_++;
+        }
+    }
+    const std::string &s_;
+    size_t pos_;
+    int line_;
+};
+
+// a job whose values don't make a request is skipped, bad JSON stops the load
+static bool load_json(const std::string &text, const char *filename, std::vector<BatchJob> &jobs, int &skipped) {
+    JsonReader json(text);
+    std::string key, value, error;
+    if (!json.accept('[')) {
+        std::cerr << filename << ":" << json.line() << ": expected an array of jobs" << std::endl;
+        return false;
+    }
+    if (json.accept(']')) return json.at_end();
+    do {
+        Fields fields;
+        if (!json.accept('{')) {
+            std::cerr << filename << ":" << json.line() << ": expected a job object" << std::endl;
+            return false;
+        }
+        int line = json.line();
+        if (!json.accept('}')) {
+            do {
+                if (!json.string(key) || !json.accept(':') || !json.value(value)) {
+                    std::cerr << filename << ":" << json.line() << ": expected \"key\": string, number or array of numbers" << std::endl;
+                    return false;
+                }
+                fields.push_back(std::make_pair(key, value));
+            } while (json.accept(','));
+            if (!json.accept('}')) {
+                std::cerr << filename << ":" << json.line() << ": expected '}'" << std::endl;
+                return false;
+            }
+        }
+        BatchJob job;
+        if (!make_job(fields, line, (int)jobs.size()+skipped, job, error)) {
+            std::cerr << filename << ":" << line << ": " << error << std::endl;
+            skipped++;
+            continue;
+        }
+        jobs.push_back(job);
+    } while (json.accept(','));
+    if (!json.accept(']') || !json.at_end()) {
+        std::cerr << filename << ":" << json.line() << ": expected ']' at the end of the jobs" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool load_manifest(const char *filename, std::vector<BatchJob> &jobs, int &skipped) {
+    std::ifstream in(filename, std::ios::binary);
+    if (!in) {
+        std::cerr << "can't open " << filename << std::endl;
+        return false;
+    }
+    std::stringstream text;
+    text << in.rdbuf();
+    const std::string s = text.str();
+    size_t first = s.find_first_not_of(" \t\r\n");
+    jobs.clear();
+    skipped = 0;
+    bool ok = first!=std::string::npos && s[first]=='[' ? load_json(s, filename, jobs, skipped) : load_csv(text, filename, jobs, skipped);
+    if (ok && skipped) std::cerr << filename << ": " << skipped << " bad jobs skipped" << std::endl;
+    if (ok && jobs.empty()) {
+        std::cerr << "no jobs in " << filename << std::endl;
+        return false;
+    }
+    return ok;
+}
+
+// the buffers a job allocates: frame, zbuffer, shadow map with its pass image and
+// msaa samples (float depth and color); the pool keeps them but they count while it runs
+static size_t job_bytes(const RenderParams &p) {
+    size_t pixels = (size_t)p.width*p.height;
+    size_t bytes = pixels*(3 + depth_format_bytes(p.depth_format)) + pixels*(3 + depth_format_bytes(p.shadow_format));
+    if (p.msaa) bytes += pixels*p.msaa*(sizeof(float)+3);
+    return bytes;
+}
+
+// grouped so that a model's jobs run back to back, and those sharing a shadow map next to each other
+static bool batch_order(const BatchJob &a, const BatchJob &b) {
+    const RenderParams &p = a.request.params, &q = b.request.params;
+    if (a.request.model!=b.request.model) return a.request.model<b.request.model;
+    for (int k=0; k<3; k++) if (p.light_dir[k]!=q.light_dir[k]) return p.light_dir[k]<q.light_dir[k];
+    if (p.width!=q.width) return p.width<q.width;
+    return p.height<q.height;
+}
+
+namespace {
+struct BatchAsset {
+    int remaining;    // jobs still to run
+    size_t bytes;     // counted while loaded
+    bool failed;
+    BatchAsset() : remaining(0), bytes(0), failed(false) {}
+};
+}
+
+int run_batch(const std::vector<BatchJob> &jobs, int nthreads, size_t memory_budget) {
+    TRACE_SCOPE("batch");
+    if (nthreads<=0) nthreads = std::max(1u, std::thread::hardware_concurrency());
+    nthreads = std::min(nthreads, (int)jobs.size());
+    std::vector<const BatchJob *> order(jobs.size());
+    for (size_t i=0; i<jobs.size(); i++) order[i] = &jobs[i];
+    std::stable_sort(order.begin(), order.end(), [](const BatchJob *a, const BatchJob *b) { return batch_order(*a, *b); });
+    std::map<std::string, BatchAsset> models;
+    for (size_t i=0; i<jobs.size(); i++) models[jobs[i].request.model].remaining++;
+    RenderTargetPool::instance().set_capacity(nthreads); // a target per thread, reused by its next job
+
+    AssetCache assets;
+    std::mutex mutex;
+    std::condition_variable cv;
+    size_t next = 0, used = 0, peak = 0;
+    int running = 0, failed = 0, loaded = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::cerr << "batch: " << jobs.size() << " jobs, " << models.size() << " models on " << nthreads << " threads";
+    if (memory_budget) std::cerr << " within " << (memory_budget>>20) << " MB";
+    std::cerr << std::endl;
+
+    std::vector<std::thread> threads;
+    for (int t=0; t<nthreads; t++) threads.push_back(std::thread([&]() {
+        trace_thread_name("batch_worker");
+        std::unique_lock<std::mutex> lock(mutex);
+        while (next<order.size()) {
+            const BatchJob &job = *order[next++];
+            BatchAsset &asset = models[job.request.model];
+            const size_t bytes = job_bytes(job.request.params);
+            std::chrono::steady_clock::time_point queued = std::chrono::steady_clock::now();
+            cv.wait(lock, [&]() { return !running || !memory_budget || used+bytes<=memory_budget; }); // one always runs
+            double wait_ms = ms_since(queued);
+            running++;
+            used += bytes;
+            peak = std::max(peak, used);
+            bool skip = asset.failed;
+            lock.unlock();
+
+            double load_ms = 0, render_ms = 0, write_ms = 0;
+            bool ok = false;
+            std::shared_ptr<Model> model;
+            if (!skip) {
+                std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+                model = assets.get(job.request.model); // loads it the first time, waits for a load under way
+                load_ms = ms_since(t0);
+            }
+            if (model) {
+                std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+                RenderTarget *target = RenderTargetPool::instance().acquire(job.request.params.width, job.request.params.height);
+                render(*model, job.request.params, *target);
+                target->frame.flip_vertically();
+                render_ms = ms_since(t0);
+                t0 = std::chrono::steady_clock::now();
+                ok = write_image_file(target->frame.view(), job.output.c_str(), job.request.format);
+                write_ms = ms_since(t0);
+                RenderTargetPool::instance().release(target);
+            }
+
+            lock.lock();
+            if (model && !asset.bytes) {
+                asset.bytes = model->bytes();
+                used += asset.bytes;
+                peak = std::max(peak, used);
+                loaded++;
+            }
+            if (!model && !skip) {
+                asset.failed = true; // the model's other jobs fail without trying again
+                std::cerr << "can't load " << job.request.model << std::endl;
+            }
+            model.reset();
+            if (!--asset.remaining) { // its last job: nothing holds it after the cache
+                assets.evict(job.request.model);
+                used -= asset.bytes;
+            }
+            used -= bytes;
+            running--;
+            if (!ok) failed++;
+            char line[256];
+            snprintf(line, sizeof(line), "  line %d %s %dx%d -> %s: %.1f ms waiting, %.1f ms loading, %.1f ms rendering, %.1f ms writing%s",
+                     job.line, job.request.model.c_str(), job.request.params.width, job.request.params.height, job.output.c_str(),
+                     wait_ms, load_ms, render_ms, write_ms, ok ? "" : ", failed");
+            std::cerr << line << std::endl;
+            cv.notify_all();
+        }
+    }));
+    for (size_t t=0; t<threads.size(); t++) threads[t].join();
+
+    double total_ms = ms_since(start);
+    char summary[256];
+    snprintf(summary, sizeof(summary), "batch: %d jobs, %d failed, %d models loaded, %.2f s, %.0f jobs/hour, peak %.1f MB of frames and models",
+             (int)jobs.size(), failed, loaded, total_ms*1e-3, jobs.size()*3600e3/std::max(total_ms, 1e-3), peak/1048576.);
+    std::cerr << summary << std::endl;
+    return failed;
+}
@@ -0,0 +1,38 @@
+#ifndef __BATCH_H__
+#define __BATCH_H__
+#include <cstddef>
+#include <string>
+#include <vector>
+#include "server.h"
+
+// Batch mode, ./main --batch manifest.csv|manifest.json: every job of the
+// manifest renders one image. A job takes the keys of a server request
+// (model, eye, center, up, light, size, msaa, rate, format) plus output, the
+// file to write (batch_<n>.<format> by default; the format follows its
+// extension when not given). CSV has a header line naming the columns, one
+// job per line after it, values with commas in double quotes; JSON is an
+// array of flat objects whose values are strings, numbers or arrays of
+// numbers:
+//   model,eye,size,output
+//   obj/african_head.obj,"1,1,3",800x800,head.png
+//   [{"model": "obj/african_head.obj", "eye": [1,1,3], "size": "800x800", "output": "head.png"}]
+struct BatchJob {
+    int line;             // in the manifest, for messages
+    RenderRequest request;
+    std::string output;
+};
+
+// A job that doesn't parse is reported with its line and counted in skipped,
+// the others load; false when the manifest can't be read past an error or
+// holds no job.
+bool load_manifest(const char *filename, std::vector<BatchJob> &jobs, int &skipped);
+
+// Renders the jobs on nthreads threads (0: one per core) and prints the time
+// of each and the jobs per hour. Jobs run grouped by model, then light and
+// size, so that each model is loaded once, its shadow maps are shared, and it
+// is dropped after its last job. A job starts only while the estimated memory
+// of the running jobs and loaded models stays within memory_budget bytes
+// (0: no limit), one job always runs. Returns the number of failed jobs.
+int run_batch(const std::vector<BatchJob> &jobs, int nthreads, size_t memory_budget);
+
+#endif //__BATCH_H__
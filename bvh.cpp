@@ -0,0 +1,197 @@
+#include <algorithm>
+#include <limits>
+#include "bvh.h"
+
+static const int LEAF_FACES = 4;
+static const int MAX_DEPTH = 64; // median splits halve the faces, 2^64 of them are a long way off
+
+Bvh::Bvh() : nodes_(), packets_(), depth_(0) {
+}
+
+void Bvh::build(Model &model) {
+    nodes_.clear();
+    packets_.clear();
+    depth_ = 0;
+    std::vector<int> faces(model.nfaces());
+    std::vector<Vec3f> centroid(model.nfaces());
+    for (int i=0; i<model.nfaces(); i++) {
+        faces[i] = i;
+        centroid[i] = (model.vert(i, 0) + model.vert(i, 1) + model.vert(i, 2))*(1/3.f);
+    }
+    if (faces.empty()) return;
+    std::vector<BuildNode> tree;
+    tree.reserve(2*model.nfaces()/LEAF_FACES+1);
+    tree.push_back(BuildNode());
+    build(tree, 0, faces, 0, (int)faces.size(), centroid, model, 1);
+    if (tree[0].leaf) { // a single packet still goes under a node
+        BuildNode root = tree[0];
+        root.leaf = false;
+        root.index = 1;
+        tree.push_back(tree[0]);
+        tree.push_back(tree[0]);
+        tree[2].lo[0] = std::numeric_limits<float>::max(); // empty, never hit
+        tree[2].hi[0] = -std::numeric_limits<float>::max();
+        tree[0] = root;
+    }
+    collapse(tree, 0);
+}
+
+// node of the 4-wide tree for binary node, whose children get replaced by
+// theirs, biggest first, while there are fewer than 4
+int Bvh::collapse(const std::vector<BuildNode> &tree, int node) {
+    int children[4] = {tree[node].index, tree[node].index+1, 0, 0}, count = 2;
+    while (count<4) {
+        int best = -1;
+        float best_area = -1;
+        for (int i=0; i<count; i++) {
+            const BuildNode &c = tree[children[i]];
+            if (c.leaf) continue;
+            float dx = c.hi[0]-c.lo[0], dy = c.hi[1]-c.lo[1], dz = c.hi[2]-c.lo[2];
+            float area = dx*dy + dy*dz + dz*dx;
+            if (area>best_area) {
+                best_area = area;
+                best = i;
+            }
+        }
+        if (best<0) break;
+        int split = children[best];
+        children[best] = tree[split].index;
+        children[count++] = tree[split].index+1;
+    }
+    int index = (int)nodes_.size();
+    nodes_.push_back(Node());
+    Node n;
+    n.count = count;
+    for (int lane=0; lane<4; lane++) {
+        for (int k=0; k<3; k++) { // unused lanes: an empty box
+            n.lo[k][lane] = lane<count ? tree[children[lane]].lo[k] : std::numeric_limits<float>::max();
+            n.hi[k][lane] = lane<count ? tree[children[lane]].hi[k] : -std::numeric_limits<float>::max();
+        }
+        n.child[lane] = 0;
+        if (lane<count) n.child[lane] = tree[children[lane]].leaf ? ~tree[children[lane]].index : collapse(tree, children[lane]);
+    }
+    nodes_[index] = n;
+    return index;
+}
+
+void Bvh::build(std::vector<BuildNode> &tree, int node, std::vector<int> &faces, int begin, int end, const std::vector<Vec3f> &centroid, Model &model, int level) {
+    depth_ = std::max(depth_, level);
+    BuildNode n;
+    float clo[3], chi[3]; // of the centroids
+    for (int k=0; k<3; k++) {
+        n.lo[k] = clo[k] = std::numeric_limits<float>::max();
+        n.hi[k] = chi[k] = -std::numeric_limits<float>::max();
+    }
+    for (int i=begin; i<end; i++) {
+        for (int j=0; j<3; j++) {
+            Vec3f v = model.vert(faces[i], j);
+            for (int k=0; k<3; k++) {
+                n.lo[k] = std::min(n.lo[k], v[k]);
+                n.hi[k] = std::max(n.hi[k], v[k]);
+            }
+        }
+        for (int k=0; k<3; k++) {
+            clo[k] = std::min(clo[k], centroid[faces[i]][k]);
+            chi[k] = std::max(chi[k], centroid[faces[i]][k]);
+        }
+    }
+    if (end-begin<=LEAF_FACES) {
+        TriPacket p;
+        for (int lane=0; lane<4; lane++) {
+            bool used = begin+lane<end;
+            Vec3f v0 = used ? model.vert(faces[begin+lane], 0) : Vec3f(0,0,0);
+            Vec3f e1 = used ? model.vert(faces[begin+lane], 1)-v0 : Vec3f(0,0,0);
+            Vec3f e2 = used ? model.vert(faces[begin+lane], 2)-v0 : Vec3f(0,0,0);
+            for (int k=0; k<3; k++) {
+                p.v0[k][lane] = v0[k];
+                p.e1[k][lane] = e1[k];
+                p.e2[k][lane] = e2[k];
+            }
+        }
+        n.leaf = true;
+        n.index = (int)packets_.size();
+        packets_.push_back(p);
+        tree[node] = n;
+        return;
+    }
+    int axis = 0;
+    for (int k=1; k<3; k++) if (chi[k]-clo[k] > chi[axis]-clo[axis]) axis = k;
+    int mid = (begin+end)/2;
+    std::nth_element(faces.begin()+begin, faces.begin()+mid, faces.begin()+end,
+                     [&centroid, axis](int a, int b) { return centroid[a][axis]<centroid[b][axis]; });
+    n.leaf = false;
+    n.index = (int)tree.size();
+    tree[node] = n;
+    tree.push_back(BuildNode());
+    tree.push_back(BuildNode());
+    build(tree, n.index, faces, begin, mid, centroid, model, level+1);
+    build(tree, n.index+1, faces, mid, end, centroid, model, level+1);
+}
+
+static inline __m128 dot4(const __m128 a[3], const __m128 b[3]) {
+    return _mm_add_ps(_mm_add_ps(_mm_mul_ps(a[0], b[0]), _mm_mul_ps(a[1], b[1])), _mm_mul_ps(a[2], b[2]));
+}
+
+static inline void cross4(const __m128 a[3], const __m128 b[3], __m128 out[3]) {
+    out[0] = _mm_sub_ps(_mm_mul_ps(a[1], b[2]), _mm_mul_ps(a[2], b[1]));
+    out[1] = _mm_sub_ps(_mm_mul_ps(a[2], b[0]), _mm_mul_ps(a[0], b[2]));
+    out[2] = _mm_sub_ps(_mm_mul_ps(a[0], b[1]), _mm_mul_ps(a[1], b[0]));
+}
+
+bool Bvh::occluded(const Vec3f &origin, const Vec3f &dir, float tmin, float tmax) const {
+    if (nodes_.empty()) return false;
+    __m128 o[3], d[3], inv[3];
+    for (int k=0; k<3; k++) {
+        o[k] = _mm_set1_ps(origin[k]);
+        d[k] = _mm_set1_ps(dir[k]);
+        inv[k] = _mm_set1_ps(1.f/dir[k]); // infinite along an axis the ray is parallel to, the slab test copes
+    }
+    const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.f), eps = _mm_set1_ps(1e-12f);
+    const __m128 t0 = _mm_set1_ps(tmin), t1 = _mm_set1_ps(tmax);
+    const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+
+    int stack[3*MAX_DEPTH+1], top = 0;
+    stack[top++] = 0;
+    while (top) {
+        int index = stack[--top];
+        if (index>=0) {
+            // the four child boxes at once
+            const Node &n = nodes_[index];
+            __m128 near = t0, far = t1;
+            for (int k=0; k<3; k++) {
+                __m128 a = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(n.lo[k]), o[k]), inv[k]);
+                __m128 b = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(n.hi[k]), o[k]), inv[k]);
+                near = _mm_max_ps(near, _mm_min_ps(a, b));
+                far = _mm_min_ps(far, _mm_max_ps(a, b));
+            }
+            int hit = _mm_movemask_ps(_mm_cmple_ps(near, far));
+            for (int lane=0; lane<n.count; lane++) if (hit & (1<<lane)) stack[top++] = n.child[lane];
+            continue;
+        }
+        // the four triangles of a leaf at once
+        const TriPacket &p = packets_[~index];
+        __m128 v0[3], e1[3], e2[3];
+        for (int k=0; k<3; k++) {
+            v0[k] = _mm_loadu_ps(p.v0[k]);
+            e1[k] = _mm_loadu_ps(p.e1[k]);
+            e2[k] = _mm_loadu_ps(p.e2[k]);
+        }
+        __m128 pvec[3], tvec[3], qvec[3];
+        cross4(d, e2, pvec);
+        __m128 det = dot4(e1, pvec);
+        __m128 valid = _mm_cmpgt_ps(_mm_and_ps(det, abs_mask), eps);
+        __m128 inv_det = _mm_div_ps(one, det);
+        for (int k=0; k<3; k++) tvec[k] = _mm_sub_ps(o[k], v0[k]);
+        __m128 u = _mm_mul_ps(dot4(tvec, pvec), inv_det);
+        cross4(tvec, e1, qvec);
+        __m128 v = _mm_mul_ps(dot4(d, qvec), inv_det);
+        __m128 t = _mm_mul_ps(dot4(e2, qvec), inv_det);
+        valid = _mm_and_ps(valid, _mm_cmpge_ps(u, zero));
+        valid = _mm_and_ps(valid, _mm_cmpge_ps(v, zero));
+        valid = _mm_and_ps(valid, _mm_cmple_ps(_mm_add_ps(u, v), one));
+        valid = _mm_and_ps(valid, _mm_cmpgt_ps(t, t0));
+        valid = _mm_and_ps(valid, _mm_cmplt_ps(t, t1));
+        if (_mm_movemask_ps(valid)) return true;
+    }
+    return false;
+}
@@ -0,0 +1,41 @@
+#ifndef __BVH_H__
+#define __BVH_H__
+#include <vector>
+#include "geometry.h"
+#include "model.h"
+
+// Bounding volume hierarchy over the faces of a model, in object space, for
+// ray casting (the ambient occlusion bake). Built binary, splitting at the
+// median centroid along the widest axis, then collapsed to 4 children per
+// node whose boxes a ray tests at once with SSE; each leaf is one packet of
+// up to 4 triangles, tested at once as well.
+class Bvh {
+public:
+    Bvh();
+    void build(Model &model);
+    // whether a face is hit at origin+t*dir for some tmin < t < tmax
+    bool occluded(const Vec3f &origin, const Vec3f &dir, float tmin, float tmax) const;
+    int nodes() const { return (int)nodes_.size(); }
+    int depth() const { return depth_; }
+private:
+    struct BuildNode {
+        float lo[3], hi[3];
+        int index;  // inner: first of the two children, leaf: its packet
+        bool leaf;
+    };
+    struct Node {   // child boxes, a lane per child
+        float lo[3][4], hi[3][4];
+        int child[4]; // >=0: a node, <0: ~packet
+        int count;
+    };
+    struct TriPacket { // Moller-Trumbore form, a lane per triangle; unused lanes have zero edges and never hit
+        float v0[3][4], e1[3][4], e2[3][4];
+    };
+    void build(std::vector<BuildNode> &tree, int node, std::vector<int> &faces, int begin, int end, const std::vector<Vec3f> &centroid, Model &model, int level);
+    int collapse(const std::vector<BuildNode> &tree, int node);
+    std::vector<Node> nodes_;
+    std::vector<TriPacket> packets_;
+    int depth_;
+};
+
+#endif //__BVH_H__
@@ -0,0 +1,260 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "distributed.h"
+#include "jobs.h"
+#include "trace.h"
+
+static double ms_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now()-start).count();
+}
+
+static double cpu_ms() {
+    timespec t;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &t);
+    return t.tv_sec*1e3 + t.tv_nsec*1e-6;
+}
+
+// the cpus of every NUMA node that has some, from sysfs; a single node with
+// the cpus this process may run on where there is no NUMA information
+static const std::vector<std::vector<int> > &cpu_nodes() {
+    static std::vector<std::vector<int> > nodes;
+    if (!nodes.empty()) return nodes;
+    for (int n=0; ; n++) {
+        char path[64];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", n);
+        std::ifstream in(path);
+        if (!in) break;
+        std::string list, range;
+        std::getline(in, list);
+        std::stringstream ranges(list);
+        std::vector<int> cpus;
+        while (std::getline(ranges, range, ',')) { // "0-3,8-11"
+            int a, b, k = sscanf(range.c_str(), "%d-%d", &a, &b);
+            if (k<1) continue;
+            if (k==1) b = a;
+            for (int c=a; c<=b; c++) cpus.push_back(c);
+        }
+        if (!cpus.empty()) nodes.push_back(cpus); // memory only nodes have none
+    }
+    if (nodes.empty()) {
+        cpu_set_t set;
+        std::vector<int> cpus;
+        if (!sched_getaffinity(0, sizeof(set), &set)) {
+            for (int c=0; c<CPU_SETSIZE; c++) if (CPU_ISSET(c, &set)) cpus.push_back(c);
+        }
+        if (cpus.empty()) cpus.push_back(0);
+        nodes.push_back(cpus);
+    }
+    return nodes;
+}
+
+int DistributedRenderer::numa_nodes() {
+    return (int)cpu_nodes().size();
+}
+
+DistributedRenderer::DistributedRenderer() : shared_(NULL), shared_size_(0), prepass_(), row_cost_(), band_(), worker_ms_(), worker_cpu_ms_(),
+    wall_ms_(0), prepass_ms_(0), fork_ms_(0), composite_ms_(0) {
+}
+
+DistributedRenderer::~DistributedRenderer() {
+    if (shared_) munmap(shared_, shared_size_);
+}
+
+bool DistributedRenderer::map(size_t bytes) {
+    if (bytes<=shared_size_) return true;
+    if (shared_) munmap(shared_, shared_size_);
+    void *p = mmap(NULL, bytes, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0); // pages come with the first touch
+    if (p==MAP_FAILED) {
+        std::cerr << "can't map a " << (bytes>>20) << " MB shared frame buffer" << std::endl;
+        shared_ = NULL;
+        shared_size_ = 0;
+        return false;
+    }
+    shared_ = (unsigned char *)p;
+    shared_size_ = bytes;
+    return true;
+}
+
+// Bands of equal cost by the last frame's row costs, in whole shading rate
+// tiles so that the blocks triangle_vrs() shades are those of a single render.
+// Fewer bands than workers when the frame has fewer tile rows.
+void DistributedRenderer::split(int height, int nworkers) {
+    const int ROWS = ShadingRateMap::TILE;
+    const int nblocks = (height+ROWS-1)/ROWS;
+    nworkers = std::min(nworkers, nblocks);
+    if ((int)row_cost_.size()!=height) row_cost_.assign(height, 1.);
+    double total = 0;
+    for (int y=0; y<height; y++) total += row_cost_[y];
+    band_.resize(nworkers+1);
+    band_[0] = 0;
+    double sum = 0;
+    for (int i=1, b=0; i<nworkers; i++) {
+        double goal = total*i/nworkers;
+        for (;;) { // the block goes where most of it is
+            double block = 0;
+            for (int y=b*ROWS; y<std::min(height, (b+1)*ROWS); y++) block += row_cost_[y];
+            if (b>=nblocks-(nworkers-i) || (b>band_[i-1]/ROWS && sum+block*.5>=goal)) break;
+            sum += block;
+            b++;
+        }
+        band_[i] = b*ROWS;
+    }
+    band_[nworkers] = height;
+}
+
+bool DistributedRenderer::render(const RenderParams &params, int nworkers, const DrawFunc &draw, RenderTarget &target) {
+    TRACE_SCOPE("render_distributed");
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    const int width = params.width, height = params.height;
+    // the shadow map, built once here instead of in every worker
+    RenderParams pixel = params;
+    pixel.window = ScreenRect(0, 0, 0, 0);
+    pixel.adaptive_rate = false;
+    draw(pixel, prepass_);
+    prepass_ms_ = ms_since(start);
+    split(height, std::max(1, nworkers));
+    nworkers = (int)band_.size()-1;
+    const int bpp = prepass_.frame.get_bytespp();
+    const size_t header = (nworkers*sizeof(WorkerSlot)+63) & ~(size_t)63;
+    if (!map(header + (size_t)width*height*bpp)) return false;
+    WorkerSlot *slots = (WorkerSlot *)shared_;
+    unsigned char *pixels = shared_+header;
+
+    JobSystem &jobs = JobSystem::instance();
+    const int nthreads = jobs.threads();
+    const bool pinned = jobs.pinned();
+    jobs.start(1); // fork() only copies the calling thread, the workers must not be running
+    const std::vector<std::vector<int> > &nodes = cpu_nodes();
+    const int nnodes = (int)nodes.size();
+    std::vector<pid_t> pids(nworkers, -1);
+    std::chrono::steady_clock::time_point forking = std::chrono::steady_clock::now();
+    for (int i=0; i<nworkers; i++) {
+        slots[i].ms = slots[i].cpu_ms = 0;
+        slots[i].done = 0;
+        pid_t pid = fork();
+        if (pid<0) {
+            std::cerr << "can't fork worker " << i << std::endl;
+            break;
+        }
+        if (pid) {
+            pids[i] = pid;
+            continue;
+        }
+        // the worker: its node's cpus, shared with the other workers on that node
+        std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+        double cpu_begin = cpu_ms();
+        const std::vector<int> &cpus = nodes[i%nnodes];
+        int sharing = (nworkers-i%nnodes+nnodes-1)/nnodes;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (size_t c=0; c<cpus.size(); c++) CPU_SET(cpus[c], &set);
+        if (nnodes>1 && sched_setaffinity(0, sizeof(set), &set)) std::cerr << "can't pin worker " << i << " to node " << i%nnodes << std::endl;
+        JobSystem::instance().start(std::max(1, (int)cpus.size()/sharing));
+        RenderParams band = params;
+        band.window = ScreenRect(0, band_[i], width-1, band_[i+1]-1);
+        band.adaptive_rate = false; // the target is new, there is no frame before
+        RenderTarget part; // drawn straight into its rows of the shared frame, resize() finds it the right size
+        part.width = width;
+        part.height = band_[i+1]-band_[i];
+        part.frame = TGAImage(part.width, part.height, bpp, pixels+(size_t)band_[i]*width*bpp);
+        draw(band, part);
+        slots[i].ms = ms_since(begin);
+        slots[i].cpu_ms = cpu_ms()-cpu_begin;
+        slots[i].done = 1;
+        _exit(0); // no destructors, the coordinator's threads and files are not this process's
+    }
+    fork_ms_ = ms_since(forking);
+    bool ok = true;
+    for (int i=0; i<nworkers; i++) {
+        int status = 0;
+        if (pids[i]<0 || waitpid(pids[i], &status, 0)!=pids[i] || !WIFEXITED(status) || WEXITSTATUS(status) || !slots[i].done) {
+            if (pids[i]>=0) std::cerr << "worker " << i << " failed" << std::endl;
+            ok = false;
+        }
+    }
+    jobs.start(nthreads, pinned);
+    if (!ok) return false;
+
+    std::chrono::steady_clock::time_point composite = std::chrono::steady_clock::now();
+    if (target.frame.get_width()!=width || target.frame.get_height()!=height || target.frame.get_bytespp()!=bpp) {
+        target.frame = TGAImage(width, height, bpp);
+    }
+    memcpy(target.frame.buffer(), pixels, (size_t)width*height*bpp);
+    target.width = width;
+    target.height = height;
+    target.shadow = prepass_.shadow;
+    composite_ms_ = ms_since(composite);
+
+    worker_ms_.resize(nworkers);
+    worker_cpu_ms_.resize(nworkers);
+    for (int i=0; i<nworkers; i++) {
+        worker_ms_[i] = slots[i].ms;
+        worker_cpu_ms_[i] = slots[i].cpu_ms;
+        double per_row = std::max(slots[i].cpu_ms, 1e-3)/(band_[i+1]-band_[i]);
+        for (int y=band_[i]; y<band_[i+1]; y++) row_cost_[y] = per_row;
+    }
+    wall_ms_ = ms_since(start);
+    return true;
+}
+
+double DistributedRenderer::imbalance() const {
+    if (worker_cpu_ms_.empty()) return 1;
+    double sum = 0, slowest = 0;
+    for (size_t i=0; i<worker_cpu_ms_.size(); i++) {
+        sum += worker_cpu_ms_[i];
+        slowest = std::max(slowest, worker_cpu_ms_[i]);
+    }
+    return sum>0 ? slowest*worker_cpu_ms_.size()/sum : 1;
+}
+
+void DistributedRenderer::report(std::ostream &out) {
+    out << "distributed: " << worker_ms_.size() << " workers on " << numa_nodes() << " NUMA nodes, " << wall_ms_ << " ms ("
+        << prepass_ms_ << " ms shadow pre-pass, " << fork_ms_ << " ms to fork, " << composite_ms_ << " ms to composite), slowest band " << imbalance() << "x the mean" << std::endl;
+    for (size_t i=0; i<worker_ms_.size(); i++) {
+        out << "  worker " << i << ": rows " << band_[i] << "-" << band_[i+1]-1 << ", " << worker_ms_[i] << " ms, "
+            << worker_cpu_ms_[i] << " ms cpu" << std::endl;
+    }
+}
+
+bool distributed_scaling(const RenderParams &params, int nworkers, const DistributedRenderer::DrawFunc &draw,
+                         RenderTarget &target, std::ostream &out) {
+    const int REPEAT = 3; // the first frame balances the bands, the best of the rest counts
+    double in_process = std::numeric_limits<double>::max();
+    for (int r=0; r<REPEAT; r++) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        draw(params, target);
+        in_process = std::min(in_process, ms_since(start));
+    }
+    out << "scaling " << params.width << "x" << params.height << ", " << DistributedRenderer::numa_nodes() << " NUMA nodes, "
+        << JobSystem::instance().threads() << " threads in one process: " << in_process << " ms" << std::endl;
+    out << "  workers        ms  speedup  efficiency  slowest band (cpu)" << std::endl;
+    double one = 0;
+    for (int n=1; n<=nworkers; n++) {
+        DistributedRenderer renderer;
+        double best = std::numeric_limits<double>::max(), imbalance = 1;
+        for (int r=0; r<REPEAT; r++) {
+            if (!renderer.render(params, n, draw, target)) return false;
+            if (r && renderer.wall_ms()<best) {
+                best = renderer.wall_ms();
+                imbalance = renderer.imbalance();
+            }
+        }
+        if (n==1) one = best;
+        char line[128];
+        snprintf(line, sizeof(line), "  %7d %9.1f %7.2fx %10.0f%% %12.2fx", n, best, one/best, 100*one/best/n, imbalance);
+        out << line << std::endl;
+    }
+    return true;
+}
@@ -0,0 +1,57 @@
+#ifndef __DISTRIBUTED_H__
+#define __DISTRIBUTED_H__
+#include <functional>
+#include <ostream>
+#include <vector>
+#include "renderer.h"
+
+// Sort-first rendering across processes on one machine (./main --workers N).
+// The coordinator cuts the frame into N bands of rows and forks a worker per
+// band, pinned to the cpus of NUMA node i % nodes. Workers inherit the
+// coordinator's meshes, decoded textures and shadow map copy on write and only
+// read them; each renders its band (RenderParams::window) with its own
+// JobSystem straight into its rows of a frame buffer in shared memory, whose
+// pages are first touched by the worker drawing them and so sit on its node. The
+// coordinator waits for all of them and composites the bands into the frame.
+// Band heights follow the per-row cpu time the workers measured in the frame
+// before, equal bands for the first frame. The viewport of a band is shifted,
+// so its pixels may differ from a single process render's by float rounding.
+class DistributedRenderer {
+public:
+    typedef std::function<void(const RenderParams &, RenderTarget &)> DrawFunc; // render() and friends
+
+    DistributedRenderer();
+    ~DistributedRenderer();
+    // the frame into target.frame and its shadow map into target.shadow; false
+    // if a worker failed. Call with the JobSystem started, it is restarted
+    // around the fork with as many threads as before.
+    bool render(const RenderParams &params, int nworkers, const DrawFunc &draw, RenderTarget &target);
+    void report(std::ostream &out); // bands and times of the last frame
+    double wall_ms() const { return wall_ms_; } // of the last frame
+    double imbalance() const;      // slowest worker of the last frame over the mean in cpu time, 1 is even
+    static int numa_nodes();
+private:
+    struct WorkerSlot {   // in the shared mapping, written by worker i
+        double ms;        // render and copy of its band
+        double cpu_ms;    // of all its threads, what the band cost whoever else ran on its cpus
+        int done;
+    };
+    void split(int height, int nworkers);
+    bool map(size_t bytes);
+    DistributedRenderer(const DistributedRenderer &);
+    DistributedRenderer &operator=(const DistributedRenderer &);
+
+    unsigned char *shared_;
+    size_t shared_size_;
+    RenderTarget prepass_;           // the one pixel render that leaves the shadow map in the cache
+    std::vector<double> row_cost_;   // cpu ms per row, from the last frame
+    std::vector<int> band_;          // worker i draws rows [band_[i], band_[i+1])
+    std::vector<double> worker_ms_, worker_cpu_ms_;
+    double wall_ms_, prepass_ms_, fork_ms_, composite_ms_;
+};
+
+// ./main --workers N --scaling: frames with 1 to N workers, ms and speedup of each
+bool distributed_scaling(const RenderParams &params, int nworkers, const DistributedRenderer::DrawFunc &draw,
+                         RenderTarget &target, std::ostream &out);
+
+#endif //__DISTRIBUTED_H__
@@ -4,6 +4,12 @@
 #include <vector>
 #include <cassert>
 #include <iostream>
+#include <cstdint>
+#include <xmmintrin.h>
+#include <emmintrin.h>
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
 
 template<size_t DimCols,size_t DimRows,typename T> class mat;
 
@@ -217,6 +223,179 @@ typedef vec<3,  float> Vec3f;
 typedef vec<3,  int>   Vec3i;
 typedef vec<4,  float> Vec4f;
 typedef mat<4,4,float> Matrix;
+
+/////////////////////////////////////////////////////////////////////////////////
+// Specialized 4x4 float kernels. mat<DimRows,DimCols,T> stays the general type;
+// Mat4f is an aligned column-major copy of a Matrix for the per-vertex and
+// per-fragment transforms: SSE products, a closed-form inverse, and batch point
+// transforms over SoA arrays (8 lanes with AVX, 4 with SSE).
+
+struct alignas(32) Mat4f {
+    float c[4][4]; // c[col][row]
+
+    Mat4f() { for (int j=4; j--; ) for (int i=4; i--; c[j][i]=(i==j)); }
+    Mat4f(const Matrix &m) { for (int j=4; j--; ) for (int i=4; i--; c[j][i]=m[i][j]); }
+
+    operator Matrix() const {
+        Matrix m;
+        for (int j=4; j--; ) for (int i=4; i--; m[i][j]=c[j][i]);
+        return m;
+    }
+
+    float at(int row, int col) const { return c[col][row]; }
+
+    Vec4f operator*(const Vec4f &v) const {
+        __m128 r = _mm_mul_ps(_mm_load_ps(c[0]), _mm_set1_ps(v[0]));
+        r = _mm_add_ps(r, _mm_mul_ps(_mm_load_ps(c[1]), _mm_set1_ps(v[1])));
+        r = _mm_add_ps(r, _mm_mul_ps(_mm_load_ps(c[2]), _mm_set1_ps(v[2])));
+        r = _mm_add_ps(r, _mm_mul_ps(_mm_load_ps(c[3]), _mm_set1_ps(v[3])));
+        alignas(16) float out[4];
+        _mm_store_ps(out, r);
+        Vec4f ret;
+        for (int i=4; i--; ret[i]=out[i]);
+        return ret;
+    }
+
+    Mat4f operator*(const Mat4f &rhs) const {
+        Mat4f ret;
+        __m128 c0 = _mm_load_ps(c[0]), c1 = _mm_load_ps(c[1]), c2 = _mm_load_ps(c[2]), c3 = _mm_load_ps(c[3]);
+        for (int j=0; j<4; j++) {
+            const float *b = rhs.c[j];
+            __m128 r = _mm_mul_ps(c0, _mm_set1_ps(b[0]));
+            r = _mm_add_ps(r, _mm_mul_ps(c1, _mm_set1_ps(b[1])));
+            r = _mm_add_ps(r, _mm_mul_ps(c2, _mm_set1_ps(b[2])));
+            r = _mm_add_ps(r, _mm_mul_ps(c3, _mm_set1_ps(b[3])));
+            _mm_store_ps(ret.c[j], r);
+        }
+        return ret;
+    }
+
+    // M*(p,1) followed by the homogeneous divide, i.e. v4tov3(M*embed<4>(p))
+    Vec3f transform_point(const Vec3f &p) const {
+        __m128 r = _mm_add_ps(_mm_mul_ps(_mm_load_ps(c[0]), _mm_set1_ps(p.x)), _mm_load_ps(c[3]));
+        r = _mm_add_ps(r, _mm_mul_ps(_mm_load_ps(c[1]), _mm_set1_ps(p.y)));
+        r = _mm_add_ps(r, _mm_mul_ps(_mm_load_ps(c[2]), _mm_set1_ps(p.z)));
+        alignas(16) float out[4];
+        _mm_store_ps(out, r);
+        return Vec3f(out[0]/out[3], out[1]/out[3], out[2]/out[3]);
+    }
+
+    Mat4f transpose() const {
+        Mat4f ret = *this;
+        __m128 c0 = _mm_load_ps(c[0]), c1 = _mm_load_ps(c[1]), c2 = _mm_load_ps(c[2]), c3 = _mm_load_ps(c[3]);
+        _MM_TRANSPOSE4_PS(c0, c1, c2, c3);
+        _mm_store_ps(ret.c[0], c0);
+        _mm_store_ps(ret.c[1], c1);
+        _mm_store_ps(ret.c[2], c2);
+        _mm_store_ps(ret.c[3], c3);
+        return ret;
+    }
+
+    // closed-form inverse from the 2x2 sub-determinants of the top and bottom row pairs
+    Mat4f inverse() const {
+        float a00=at(0,0), a01=at(0,1), a02=at(0,2), a03=at(0,3);
+        float a10=at(1,0), a11=at(1,1), a12=at(1,2), a13=at(1,3);
+        float a20=at(2,0), a21=at(2,1), a22=at(2,2), a23=at(2,3);
+        float a30=at(3,0), a31=at(3,1), a32=at(3,2), a33=at(3,3);
+        float s0 = a00*a11 - a10*a01, s1 = a00*a12 - a10*a02, s2 = a00*a13 - a10*a03;
+        float s3 = a01*a12 - a11*a02, s4 = a01*a13 - a11*a03, s5 = a02*a13 - a12*a03;
+        float c5 = a22*a33 - a32*a23, c4 = a21*a33 - a31*a23, c3 = a21*a32 - a31*a22;
+        float c2 = a20*a33 - a30*a23, c1 = a20*a32 - a30*a22, c0 = a20*a31 - a30*a21;
+        float det = s0*c5 - s1*c4 + s2*c3 + s3*c2 - s4*c1 + s5*c0;
+        assert(det!=0);
+        float k = 1.f/det;
+        Mat4f r;
+        r.c[0][0] = ( a11*c5 - a12*c4 + a13*c3)*k; r.c[1][0] = (-a01*c5 + a02*c4 - a03*c3)*k;
+        r.c[2][0] = ( a31*s5 - a32*s4 + a33*s3)*k; r.c[3][0] = (-a21*s5 + a22*s4 - a23*s3)*k;
+        r.c[0][1] = (-a10*c5 + a12*c2 - a13*c1)*k; r.c[1][1] = ( a00*c5 - a02*c2 + a03*c1)*k;
+        r.c[2][1] = (-a30*s5 + a32*s2 - a33*s1)*k; r.c[3][1] = ( a20*s5 - a22*s2 + a23*s1)*k;
+        r.c[0][2] = ( a10*c4 - a11*c2 + a13*c0)*k; r.c[1][2] = (-a00*c4 + a01*c2 - a03*c0)*k;
+        r.c[2][2] = ( a30*s4 - a31*s2 + a33*s0)*k; r.c[3][2] = (-a20*s4 + a21*s2 - a23*s0)*k;
+        r.c[0][3] = (-a10*c3 + a11*c1 - a12*c0)*k; r.c[1][3] = ( a00*c3 - a01*c1 + a02*c0)*k;
+        r.c[2][3] = (-a30*s3 + a31*s1 - a32*s0)*k; r.c[3][3] = ( a20*s3 - a21*s1 + a22*s0)*k;
+        return r;
+    }
+
+    Mat4f invert_transpose() const { return inverse().transpose(); }
+};
+
+// SoA batch transform with homogeneous divide: (ox,oy,oz)[i] = M*(x,y,z,1)[i]
+inline void transform_points(const Mat4f &m, const float *x, const float *y, const float *z,
+                             float *ox, float *oy, float *oz, size_t n) {
+    size_t i = 0;
+#ifdef __AVX__
+    __m256 a[4][4];
+    for (int r=4; r--; ) for (int k=4; k--; a[r][k] = _mm256_set1_ps(m.at(r,k)));
+    for (; i+8<=n; i+=8) {
+        __m256 px = _mm256_loadu_ps(x+i), py = _mm256_loadu_ps(y+i), pz = _mm256_loadu_ps(z+i);
+        __m256 out[4];
+        for (int r=0; r<4; r++) {
+            __m256 t = _mm256_add_ps(_mm256_mul_ps(a[r][0], px), a[r][3]);
+            t = _mm256_add_ps(t, _mm256_mul_ps(a[r][1], py));
+            out[r] = _mm256_add_ps(t, _mm256_mul_ps(a[r][2], pz));
+        }
+        __m256 w = _mm256_div_ps(_mm256_set1_ps(1.f), out[3]);
+        _mm256_storeu_ps(ox+i, _mm256_mul_ps(out[0], w));
+        _mm256_storeu_ps(oy+i, _mm256_mul_ps(out[1], w));
+        _mm256_storeu_ps(oz+i, _mm256_mul_ps(out[2], w));
+    }
+#endif
+    __m128 b[4][4];
+    for (int r=4; r--; ) for (int k=4; k--; b[r][k] = _mm_set1_ps(m.at(r,k)));
+    for (; i+4<=n; i+=4) {
+        __m128 px = _mm_loadu_ps(x+i), py = _mm_loadu_ps(y+i), pz = _mm_loadu_ps(z+i);
+        __m128 out[4];
+        for (int r=0; r<4; r++) {
+            __m128 t = _mm_add_ps(_mm_mul_ps(b[r][0], px), b[r][3]);
+            t = _mm_add_ps(t, _mm_mul_ps(b[r][1], py));
+            out[r] = _mm_add_ps(t, _mm_mul_ps(b[r][2], pz));
+        }
+        __m128 w = _mm_div_ps(_mm_set1_ps(1.f), out[3]);
+        _mm_storeu_ps(ox+i, _mm_mul_ps(out[0], w));
+        _mm_storeu_ps(oy+i, _mm_mul_ps(out[1], w));
+        _mm_storeu_ps(oz+i, _mm_mul_ps(out[2], w));
+    }
+    for (; i<n; i++) {
+        Vec3f p = m.transform_point(Vec3f(x[i], y[i], z[i]));
+        ox[i] = p.x; oy[i] = p.y; oz[i] = p.z;
+    }
+}
+
+// AoS convenience wrapper: gathers 8 points at a time into SoA form
+inline void transform_points(const Mat4f &m, const Vec3f *in, Vec3f *out, size_t n) {
+    alignas(32) float x[8], y[8], z[8];
+    for (size_t i=0; i<n; i+=8) {
+        size_t k = n-i<8 ? n-i : 8;
+        for (size_t j=0; j<k; j++) { x[j] = in[i+j].x; y[j] = in[i+j].y; z[j] = in[i+j].z; }
+        transform_points(m, x, y, z, x, y, z, k);
+        for (size_t j=0; j<k; j++) out[i+j] = Vec3f(x[j], y[j], z[j]);
+    }
+}
+
+// Quantized points, three uint16 each (see quantize.h), through a matrix that
+// takes them as they are: dequantization is folded into m. SSE2 widens four
+// points at a time to floats and transposes them to SoA; each load reads one
+// uint16 past its point, the storage pads for the last one.
+inline void transform_quantized_points(const Mat4f &m, const uint16_t *q, Vec3f *out, size_t n) {
+    alignas(32) float x[8], y[8], z[8];
+    const __m128i zero = _mm_setzero_si128();
+    for (size_t i=0; i<n; i+=8) {
+        size_t k = n-i<8 ? n-i : 8;
+        for (size_t j=0; j<k; j+=4) {
+            __m128 p[4];
+            for (int l=0; l<4; l++) {
+                size_t v = i+j+l<n ? i+j+l : n-1;
+                p[l] = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i *)(q+3*v)), zero));
+            }
+            _MM_TRANSPOSE4_PS(p[0], p[1], p[2], p[3]);
+            _mm_store_ps(x+j, p[0]);
+            _mm_store_ps(y+j, p[1]);
+            _mm_store_ps(z+j, p[2]);
+        }
+        transform_points(m, x, y, z, x, y, z, k);
+        for (size_t j=0; j<k; j++) out[i+j] = Vec3f(x[j], y[j], z[j]);
+    }
+}
 #endif //__GEOMETRY_H__
 
 
@@ -0,0 +1,717 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <streambuf>
+#include "imageencode.h"
+#include "jobs.h"
+#include "trace.h"
+
+static const int STRIPE_ROWS = 64;
+
+bool parse_image_format(const char *name, ImageFormat &format) {
+    if (!strcmp(name, "tga")) format = IMAGE_TGA;
+    else if (!strcmp(name, "tga-raw")) format = IMAGE_TGA_RAW;
+    else if (!strcmp(name, "qoi")) format = IMAGE_QOI;
+    else if (!strcmp(name, "png")) format = IMAGE_PNG;
+    else return false;
+    return true;
+}
+
+const char *image_format_extension(ImageFormat format) {
+    return format==IMAGE_QOI ? "qoi" : format==IMAGE_PNG ? "png" : "tga";
+}
+
+// Buffers of one encode_image call. A job that waits on the stripes can pick
+// up another image's write meanwhile, so they are not thread_local but come
+// from a pool, where they keep their capacity.
+struct EncodeScratch {
+    std::vector<unsigned char> filtered;                // png: filter byte + row, top row first
+    std::vector<std::vector<unsigned char> > stripes;   // encoded stripes
+    std::vector<uint32_t> adler;                        // png: of each stripe's filtered rows
+    std::vector<unsigned char> file;                    // write_image_file's
+};
+
+static std::mutex scratch_mutex;
+static std::vector<std::unique_ptr<EncodeScratch> > scratch_pool; // freed at exit
+
+static std::unique_ptr<EncodeScratch> acquire_scratch() {
+    std::lock_guard<std::mutex> lock(scratch_mutex);
+    if (scratch_pool.empty()) return std::unique_ptr<EncodeScratch>(new EncodeScratch());
+    std::unique_ptr<EncodeScratch> s = std::move(scratch_pool.back());
+    scratch_pool.pop_back();
+    return s;
+}
+
+static void release_scratch(std::unique_ptr<EncodeScratch> s) {
+    std::lock_guard<std::mutex> lock(scratch_mutex);
+    scratch_pool.push_back(std::move(s));
+}
+
+static void put_be32(std::vector<unsigned char> &out, uint32_t v) {
+    unsigned char b[4] = {(unsigned char)(v>>24), (unsigned char)(v>>16), (unsigned char)(v>>8), (unsigned char)v};
+    out.insert(out.end(), b, b+4);
+}
+
+// pixel x of row y as r, g, b, a; grayscale goes to all three
+static inline void rgba(const unsigned char *data, int bpp, size_t i, unsigned char px[4]) {
+    const unsigned char *s = data + i*bpp;
+    if (1==bpp) {
+        px[0] = px[1] = px[2] = s[0];
+        px[3] = 255;
+    } else {
+        px[0] = s[2];
+        px[1] = s[1];
+        px[2] = s[0];
+        px[3] = 4==bpp ? s[3] : 255;
+    }
+}
+
+// -- QOI, https://qoiformat.org/qoi-specification.pdf --
+
+static void qoi_stripe(const ImageView &image, int y0, int y1, std::vector<unsigned char> &out) {
+    const int w = image.width, bpp = image.bytespp;
+    const size_t begin = (size_t)y0*w, end = (size_t)y1*w;
+    out.resize((end-begin)*5); // every pixel an RGBA op at worst
+    unsigned char *p = out.data();
+    uint32_t index[64];
+    uint64_t seen = 0; // index slots filled in this stripe, the decoder's others hold colors from earlier stripes
+    unsigned char prev[4] = {0, 0, 0, 255};
+    int run = 0;
+    const unsigned char *row = image.row(y0);
+    int x = 0;
+    for (size_t i=begin; i<end; i++) {
+        unsigned char px[4];
+        rgba(row, bpp, x, px);
+        if (++x==w) {
+            x = 0;
+            row += image.stride;
+        }
+        if (i>begin && !memcmp(px, prev, 4)) {
+            run++;
+            if (62==run || i+1==end) {
+                *p++ = 0xc0 | (run-1);
+                run = 0;
+            }
+            continue;
+        }
+        if (run) {
+            *p++ = 0xc0 | (run-1);
+            run = 0;
+        }
+        int h = (px[0]*3 + px[1]*5 + px[2]*7 + px[3]*11) & 63;
+        uint32_t color;
+        memcpy(&color, px, 4);
+        if ((seen>>h & 1) && index[h]==color) {
+            *p++ = h;
+        } else {
+            index[h] = color;
+            seen |= (uint64_t)1<<h;
+            int dr = px[0]-prev[0], dg = px[1]-prev[1], db = px[2]-prev[2];
+            dr = (signed char)dr; dg = (signed char)dg; db = (signed char)db; // the decoder wraps around
+            if (i==begin || px[3]!=prev[3]) { // a stripe starts from a literal, whatever the decoder's previous pixel
+                *p++ = 0xff;
+                memcpy(p, px, 4);
+                p += 4;
+            } else if (dr>=-2 && dr<=1 && dg>=-2 && dg<=1 && db>=-2 && db<=1) {
+                *p++ = 0x40 | (dr+2)<<4 | (dg+2)<<2 | (db+2);
+            } else if (dg>=-32 && dg<=31 && dr-dg>=-8 && dr-dg<=7 && db-dg>=-8 && db-dg<=7) {
+                *p++ = 0x80 | (dg+32);
+                *p++ = (dr-dg+8)<<4 | (db-dg+8);
+            } else {
+                *p++ = 0xfe;
+                memcpy(p, px, 3);
+                p += 3;
+            }
+        }
+        memcpy(prev, px, 4);
+    }
+    out.resize(p-out.data());
+}
+
+// -- deflate (RFC 1951) with dynamic Huffman codes, greedy LZ77 over hash chains --
+
+static const int WINDOW = 1<<15;
+static const int HASH_BITS = 15;
+static const int MAX_CHAIN = 16;
+static const int MIN_MATCH = 3, MAX_MATCH = 258;
+static const int NICE_MATCH = 128; // long enough to stop looking
+static const int BLOCK_TOKENS = 1<<14;
+
+static const int LEN_BASE[29] = {3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258};
+static const int LEN_EXTRA[29] = {0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0};
+static const int DIST_BASE[30] = {1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577};
+static const int DIST_EXTRA[30] = {0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
+static const int CODELEN_ORDER[19] = {16,17,18,0,8,7,9,6,10,5,11,4,12,3,13,2,14,1,15};
+
+struct DeflateTables {
+    unsigned char len_code[MAX_MATCH+1];
+    unsigned char dist_lo[257];  // distances up to 256
+    unsigned char dist_hi[256];  // above: by (distance-1)>>7
+    DeflateTables() {
+        for (int c=0; c<29; c++) for (int l=LEN_BASE[c]; l<LEN_BASE[c]+(1<<LEN_EXTRA[c]) && l<=MAX_MATCH; l++) len_code[l] = c;
+        len_code[MAX_MATCH] = 28; // 258 has a code of its own, not 227+31
+        for (int c=0; c<30; c++) {
+            for (int d=DIST_BASE[c]; d<DIST_BASE[c]+(1<<DIST_EXTRA[c]); d++) {
+                if (d<=256) dist_lo[d] = c;
+                else dist_hi[(d-1)>>7] = c;
+            }
+        }
+    }
+    int dist_code(int d) const { return d<=256 ? dist_lo[d] : dist_hi[(d-1)>>7]; }
+};
+
+static const DeflateTables &deflate_tables() {
+    static const DeflateTables tables;
+    return tables;
+}
+
+struct BitWriter {
+    unsigned char *p;
+    uint64_t bits;
+    int nbits;
+    explicit BitWriter(unsigned char *out) : p(out), bits(0), nbits(0) {}
+    void put(uint32_t v, int n) { // least significant bit first
+        bits |= (uint64_t)v<<nbits;
+        nbits += n;
+        while (nbits>=8) {
+            *p++ = bits;
+            bits >>= 8;
+            nbits -= 8;
+        }
+    }
+    void align() { put(0, (8-nbits)&7); }
+};
+
+// code lengths of at most limit bits, from a Huffman tree built with two
+// queues; frequencies get flattened until the tree is shallow enough. Always
+// at least two codes: inflate rejects a lone one but for distances.
+static void huffman_lengths(const uint32_t *freq, int n, int limit, unsigned char *len) {
+    uint32_t f[288], w[2*288];
+    int sym[288], parent[2*288], depth[2*288];
+    for (int i=0; i<n; i++) f[i] = freq[i];
+    int m = 0;
+    for (int i=0; i<n; i++) if (f[i]) m++;
+    for (int i=0; m<2 && i<n; i++) if (!f[i]) { f[i] = 1; m++; }
+    for (;;) {
+        m = 0;
+        for (int i=0; i<n; i++) {
+            len[i] = 0;
+            if (f[i]) sym[m++] = i;
+        }
+        std::sort(sym, sym+m, [&f](int a, int b) { return f[a]!=f[b] ? f[a]<f[b] : a<b; });
+        for (int k=0; k<m; k++) w[k] = f[sym[k]];
+        int leaf = 0, inner = m, next = m;
+        while (next<2*m-1) {
+            int pick[2];
+            for (int j=0; j<2; j++) pick[j] = leaf<m && (inner>=next || w[leaf]<=w[inner]) ? leaf++ : inner++;
+            w[next] = w[pick[0]] + w[pick[1]];
+            parent[pick[0]] = parent[pick[1]] = next++;
+        }
+        depth[2*m-2] = 0;
+        int deepest = 0;
+        for (int k=2*m-3; k>=0; k--) { // parents come after their children
+            depth[k] = depth[parent[k]]+1;
+            if (k<m) deepest = std::max(deepest, depth[k]);
+        }
+        if (deepest<=limit) {
+            for (int k=0; k<m; k++) len[sym[k]] = depth[k];
+            return;
+        }
+        for (int i=0; i<n; i++) if (f[i]) f[i] = (f[i]>>1) | 1;
+    }
+}
+
+// canonical codes, bit reversed for BitWriter
+static void huffman_codes(const unsigned char *len, int n, uint16_t *code) {
+    int count[16] = {0}, next[16];
+    for (int i=0; i<n; i++) count[len[i]]++;
+    count[0] = 0;
+    for (int bits=1, c=0; bits<16; bits++) {
+        c = (c+count[bits-1])<<1;
+        next[bits] = c;
+    }
+    for (int i=0; i<n; i++) {
+        if (!len[i]) continue;
+        int c = next[len[i]]++, r = 0;
+        for (int b=0; b<len[i]; b++) r |= (c>>b & 1)<<(len[i]-1-b);
+        code[i] = r;
+    }
+}
+
+struct Token {
+    uint16_t length; // 0: a literal
+    uint16_t value;  // the literal, or the distance
+};
+
+// Per worker: the hash chains and the tokens of the current block.
+struct DeflateState {
+    std::vector<int> head, prev;
+    std::vector<Token> tokens;
+    DeflateState() : head(1<<HASH_BITS), prev(WINDOW), tokens(BLOCK_TOKENS) {}
+};
+
+// equal bytes at a and b, up to max_len, eight at a time (little endian)
+static inline int match_length(const unsigned char *a, const unsigned char *b, int max_len) {
+    int l = 0;
+    for (; l+8<=max_len; l+=8) {
+        uint64_t x, y;
+        memcpy(&x, a+l, 8);
+        memcpy(&y, b+l, 8);
+        if (x!=y) return l + (__builtin_ctzll(x^y)>>3);
+    }
+    while (l<max_len && a[l]==b[l]) l++;
+    return l;
+}
+
+static inline uint32_t hash3(const unsigned char *p) {
+    return ((p[0]<<16 | p[1]<<8 | p[2])*2654435761u) >> (32-HASH_BITS);
+}
+
+// one block of tokens, covering data[begin, end): dynamic Huffman, or stored if that is smaller
+static void deflate_block(BitWriter &bw, const Token *tokens, int ntokens, const unsigned char *data, int begin, int end, bool last) {
+    const DeflateTables &t = deflate_tables();
+    uint32_t lfreq[286] = {0}, dfreq[30] = {0};
+    uint64_t extra = 0;
+    for (int i=0; i<ntokens; i++) {
+        if (!tokens[i].length) {
+            lfreq[tokens[i].value]++;
+            continue;
+        }
+        int lc = t.len_code[tokens[i].length], dc = t.dist_code(tokens[i].value);
+        lfreq[257+lc]++;
+        dfreq[dc]++;
+        extra += LEN_EXTRA[lc] + DIST_EXTRA[dc];
+    }
+    lfreq[256] = 1;
+    unsigned char llen[286+30], *dlen = llen+286, clen[19];
+    uint16_t lcode[286], dcode[30], ccode[19];
+    huffman_lengths(lfreq, 286, 15, llen);
+    huffman_lengths(dfreq, 30, 15, dlen);
+    int nlit = 286, ndist = 30;
+    while (nlit>257 && !llen[nlit-1]) nlit--;
+    while (ndist>1 && !dlen[ndist-1]) ndist--;
+
+    // the lengths of both codes, run length coded with 16 (repeat), 17 and 18 (zeros)
+    unsigned char lengths[286+30], rle[286+30], rle_extra[286+30];
+    memcpy(lengths, llen, nlit);
+    memcpy(lengths+nlit, dlen, ndist);
+    int nrle = 0;
+    uint32_t cfreq[19] = {0};
+    for (int i=0, total=nlit+ndist; i<total; ) {
+        int l = lengths[i], run = 1;
+        while (i+run<total && lengths[i+run]==l) run++;
+        i += run;
+        if (!l) {
+            while (run>=3) {
+                int r = std::min(run, 138);
+                rle[nrle] = r>=11 ? 18 : 17;
+                rle_extra[nrle++] = r>=11 ? r-11 : r-3;
+                run -= r;
+            }
+        } else {
+            rle[nrle] = l;
+            rle_extra[nrle++] = 0;
+            run--;
+            while (run>=3) {
+                int r = std::min(run, 6);
+                rle[nrle] = 16;
+                rle_extra[nrle++] = r-3;
+                run -= r;
+            }
+        }
+        while (run-->0) {
+            rle[nrle] = l;
+            rle_extra[nrle++] = 0;
+        }
+    }
+    for (int i=0; i<nrle; i++) cfreq[rle[i]]++;
+    huffman_lengths(cfreq, 19, 7, clen);
+    int nclen = 19;
+    while (nclen>4 && !clen[CODELEN_ORDER[nclen-1]]) nclen--;
+
+    uint64_t dynamic_bits = 3 + 14 + 3*nclen + extra;
+    for (int i=0; i<nrle; i++) dynamic_bits += clen[rle[i]] + (rle[i]==16 ? 2 : rle[i]==17 ? 3 : rle[i]==18 ? 7 : 0);
+    for (int i=0; i<286; i++) dynamic_bits += (uint64_t)lfreq[i]*llen[i];
+    for (int i=0; i<30; i++) dynamic_bits += (uint64_t)dfreq[i]*dlen[i];
+    uint64_t stored_bits = (uint64_t)(end-begin)*8 + ((end-begin)/65535+1)*(3+7+32);
+    if (stored_bits<dynamic_bits) {
+        int p = begin;
+        do {
+            int n = std::min(65535, end-p);
+            bw.put(last && p+n==end, 1);
+            bw.put(0, 2);
+            bw.align();
+            bw.put(n, 16);
+            bw.put(~n & 0xffff, 16);
+            memcpy(bw.p, data+p, n);
+            bw.p += n;
+            p += n;
+        } while (p<end);
+        return;
+    }
+
+    huffman_codes(llen, 286, lcode);
+    huffman_codes(dlen, 30, dcode);
+    huffman_codes(clen, 19, ccode);
+    bw.put(last, 1);
+    bw.put(2, 2);
+    bw.put(nlit-257, 5);
+    bw.put(ndist-1, 5);
+    bw.put(nclen-4, 4);
+    for (int i=0; i<nclen; i++) bw.put(clen[CODELEN_ORDER[i]], 3);
+    for (int i=0; i<nrle; i++) {
+        bw.put(ccode[rle[i]], clen[rle[i]]);
+        if (rle[i]>=16) bw.put(rle_extra[i], rle[i]==16 ? 2 : rle[i]==17 ? 3 : 7);
+    }
+    for (int i=0; i<ntokens; i++) {
+        const Token &tok = tokens[i];
+        if (!tok.length) {
+            bw.put(lcode[tok.value], llen[tok.value]);
+            continue;
+        }
+        int lc = t.len_code[tok.length], dc = t.dist_code(tok.value);
+        bw.put(lcode[257+lc], llen[257+lc]);
+        bw.put(tok.length-LEN_BASE[lc], LEN_EXTRA[lc]);
+        bw.put(dcode[dc], dlen[dc]);
+        bw.put(tok.value-DIST_BASE[dc], DIST_EXTRA[dc]);
+    }
+    bw.put(lcode[256], llen[256]);
+}
+
+// data[begin, end) as deflate blocks that end on a byte boundary; matches may
+// reach back into the WINDOW bytes before begin. Unless last, the stream
+// carries on after it (an empty stored block, as zlib's sync flush).
+static void deflate_stripe(const unsigned char *data, int begin, int end, bool last, std::vector<unsigned char> &out) {
+    static thread_local DeflateState *state = NULL; // never freed, one per thread that encoded a png
+    if (!state) state = new DeflateState();
+    std::vector<int> &head = state->head, &prev = state->prev;
+    Token *tokens = state->tokens.data();
+    std::fill(head.begin(), head.end(), -1);
+    out.resize((size_t)(end-begin) + ((end-begin)/65535 + (end-begin)/BLOCK_TOKENS + 2)*5 + 16); // no block is bigger than stored
+    BitWriter bw(out.data());
+    auto insert = [&](int i) {
+        uint32_t h = hash3(data+i);
+        prev[i & (WINDOW-1)] = head[h];
+        head[h] = i;
+    };
+    for (int i=std::max(0, begin-WINDOW); i<begin; i++) insert(i);
+
+    int ntokens = 0, block_begin = begin;
+    for (int i=begin; i<end; ) {
+        int best_len = 0, best_dist = 0;
+        if (i+MIN_MATCH<=end) {
+            const int max_len = std::min(MAX_MATCH, end-i);
+            int candidate = head[hash3(data+i)];
+            for (int chain=MAX_CHAIN; candidate>=0 && candidate>=i-WINDOW && chain; chain--) {
+                if (data[candidate+best_len]==data[i+best_len]) { // can't be longer otherwise
+                    int l = match_length(data+candidate, data+i, max_len);
+                    if (l>best_len) {
+                        best_len = l;
+                        best_dist = i-candidate;
+                        if (l>=NICE_MATCH) break;
+                    }
+                }
+                candidate = prev[candidate & (WINDOW-1)];
+            }
+            insert(i);
+        }
+        if (best_len>=MIN_MATCH) {
+            tokens[ntokens].length = best_len;
+            tokens[ntokens++].value = best_dist;
+            for (int j=i+1; j<i+best_len && j+MIN_MATCH<=end; j++) insert(j);
+            i += best_len;
+        } else {
+            tokens[ntokens].length = 0;
+            tokens[ntokens++].value = data[i];
+            i++;
+        }
+        if (ntokens==BLOCK_TOKENS || i==end) {
+            deflate_block(bw, tokens, ntokens, data, block_begin, i, last && i==end);
+            ntokens = 0;
+            block_begin = i;
+        }
+    }
+    if (begin==end) deflate_block(bw, tokens, 0, data, begin, end, last);
+    if (!last) {
+        bw.put(0, 3);
+        bw.align();
+        bw.put(0, 16);
+        bw.put(0xffff, 16);
+    }
+    bw.align();
+    out.resize(bw.p-out.data());
+}
+
+static uint32_t adler32(const unsigned char *p, size_t n) {
+    uint32_t a = 1, b = 0;
+    while (n) {
+        size_t chunk = std::min(n, (size_t)5552); // the most bytes before b can overflow
+        n -= chunk;
+        while (chunk--) {
+            a += *p++;
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+    return b<<16 | a;
+}
+
+// the sum of the concatenation, from the sums of the parts (zlib's adler32_combine)
+static uint32_t adler32_combine(uint32_t a1, uint32_t a2, size_t len2) {
+    const uint32_t BASE = 65521;
+    uint32_t rem = len2 % BASE;
+    uint32_t sum1 = a1 & 0xffff;
+    uint32_t sum2 = (uint32_t)(((uint64_t)rem*sum1) % BASE);
+    sum1 += (a2 & 0xffff) + BASE - 1;
+    sum2 += (a1>>16) + (a2>>16) + BASE - rem;
+    if (sum1>=BASE) sum1 -= BASE;
+    if (sum1>=BASE) sum1 -= BASE;
+    if (sum2>=2*BASE) sum2 -= 2*BASE;
+    if (sum2>=BASE) sum2 -= BASE;
+    return sum2<<16 | sum1;
+}
+
+static uint32_t crc32(uint32_t crc, const unsigned char *p, size_t n) {
+    struct Table {
+        uint32_t t[256];
+        Table() {
+            for (uint32_t i=0; i<256; i++) {
+                uint32_t c = i;
+                for (int k=0; k<8; k++) c = c&1 ? 0xedb88320u^(c>>1) : c>>1;
+                t[i] = c;
+            }
+        }
+    };
+    static const Table table;
+    crc = ~crc;
+    while (n--) crc = table.t[(crc^*p++) & 0xff] ^ (crc>>8);
+    return ~crc;
+}
+
+// -- PNG --
+
+static inline int paeth(int a, int b, int c) {
+    int p = a+b-c, pa = std::abs(p-a), pb = std::abs(p-b), pc = std::abs(p-c);
+    return pa<=pb && pa<=pc ? a : pb<=pc ? b : c;
+}
+
+// one of png's five filters over a row; cur and up have zeros to their left
+template <int FILTER> static unsigned filter_row(const unsigned char *cur, const unsigned char *up, int stride, int bpp, unsigned char *out) {
+    unsigned sum = 0; // of the bytes as signed values, the usual guess at what compresses best
+    for (int i=0; i<stride; i++) {
+        int a = cur[i-bpp], b = up[i], c = up[i-bpp];
+        int pred = 0==FILTER ? 0 : 1==FILTER ? a : 2==FILTER ? b : 3==FILTER ? (a+b)>>1 : paeth(a, b, c);
+        out[i] = cur[i]-pred;
+        sum += std::abs((signed char)out[i]);
+    }
+    return sum;
+}
+
+// rows [y0, y1) converted to png's channel order and filtered, each with the
+// filter of smallest sum
+static void png_filter_rows(const ImageView &image, int y0, int y1, unsigned char *filtered) {
+    const int w = image.width, bpp = image.bytespp, stride = w*bpp;
+    static thread_local std::vector<unsigned char> rows[2], candidates[5];
+    for (int k=0; k<2; k++) rows[k].assign(stride+4, 0);
+    for (int k=0; k<5; k++) candidates[k].resize(stride);
+    auto convert = [&](int y, unsigned char *row) {
+        const unsigned char *s = image.row(y);
+        if (1==bpp) {
+            memcpy(row, s, stride);
+            return;
+        }
+        for (int x=0; x<w; x++, s+=bpp, row+=bpp) {
+            row[0] = s[2];
+            row[1] = s[1];
+            row[2] = s[0];
+            if (4==bpp) row[3] = s[3];
+        }
+    };
+    unsigned char *up = rows[0].data()+4, *cur = rows[1].data()+4; // 4 zeros before either
+    if (y0>0) convert(y0-1, up);
+    for (int y=y0; y<y1; y++) {
+        convert(y, cur);
+        unsigned sums[5] = {
+            filter_row<0>(cur, up, stride, bpp, candidates[0].data()),
+            filter_row<1>(cur, up, stride, bpp, candidates[1].data()),
+            filter_row<2>(cur, up, stride, bpp, candidates[2].data()),
+            filter_row<3>(cur, up, stride, bpp, candidates[3].data()),
+            filter_row<4>(cur, up, stride, bpp, candidates[4].data())
+        };
+        int best = std::min_element(sums, sums+5)-sums;
+        unsigned char *out = filtered + (size_t)y*(stride+1);
+        out[0] = best;
+        memcpy(out+1, candidates[best].data(), stride);
+        std::swap(up, cur);
+    }
+}
+
+static void put_chunk(std::vector<unsigned char> &out, const char *type, const unsigned char *data, size_t n) {
+    put_be32(out, n);
+    size_t start = out.size();
+    out.insert(out.end(), type, type+4);
+    out.insert(out.end(), data, data+n);
+    put_be32(out, crc32(0, out.data()+start, n+4));
+}
+
+static bool encode_png(const ImageView &image, EncodeScratch &s, std::vector<unsigned char> &out) {
+    const int w = image.width, h = image.height, bpp = image.bytespp;
+    const size_t row_bytes = (size_t)w*bpp+1;
+    const int nstripes = (h+STRIPE_ROWS-1)/STRIPE_ROWS;
+    if (row_bytes*h >= (size_t)1<<31) {
+        std::cerr << "image too large for the png encoder\n";
+        return false;
+    }
+    s.filtered.resize(row_bytes*h);
+    s.adler.resize(nstripes);
+    if ((int)s.stripes.size()<nstripes) s.stripes.resize(nstripes);
+    JobSystem &jobs = JobSystem::instance();
+    jobs.parallel_for(0, nstripes, 1, [&](int s0, int s1) {
+        png_filter_rows(image, s0*STRIPE_ROWS, std::min(h, s1*STRIPE_ROWS), s.filtered.data());
+    });
+    jobs.parallel_for(0, nstripes, 1, [&](int s0, int s1) { // every stripe's window is filtered by now
+        for (int i=s0; i<s1; i++) {
+            int begin = i*STRIPE_ROWS*row_bytes, end = std::min(h, (i+1)*STRIPE_ROWS)*row_bytes;
+            deflate_stripe(s.filtered.data(), begin, end, i+1==nstripes, s.stripes[i]);
+            s.adler[i] = adler32(s.filtered.data()+begin, end-begin);
+        }
+    });
+
+    static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    out.clear();
+    out.insert(out.end(), signature, signature+8);
+    unsigned char ihdr[13] = {(unsigned char)(w>>24), (unsigned char)(w>>16), (unsigned char)(w>>8), (unsigned char)w,
+                              (unsigned char)(h>>24), (unsigned char)(h>>16), (unsigned char)(h>>8), (unsigned char)h,
+                              8, (unsigned char)(1==bpp ? 0 : 3==bpp ? 2 : 6), 0, 0, 0}; // gray, rgb, rgba; 8 bits
+    put_chunk(out, "IHDR", ihdr, sizeof(ihdr));
+    size_t idat = 2+4;
+    for (int i=0; i<nstripes; i++) idat += s.stripes[i].size();
+    put_be32(out, idat);
+    size_t start = out.size();
+    const unsigned char zlib_header[2] = {0x78, 0x01};
+    out.insert(out.end(), "IDAT", "IDAT"+4);
+    out.insert(out.end(), zlib_header, zlib_header+2);
+    uint32_t adler = 1;
+    for (int i=0; i<nstripes; i++) {
+        out.insert(out.end(), s.stripes[i].begin(), s.stripes[i].end());
+        adler = i ? adler32_combine(adler, s.adler[i], std::min(h-i*STRIPE_ROWS, STRIPE_ROWS)*row_bytes) : s.adler[i];
+    }
+    put_be32(out, adler);
+    put_be32(out, crc32(0, out.data()+start, out.size()-start));
+    put_chunk(out, "IEND", NULL, 0);
+    return true;
+}
+
+static bool encode_qoi(const ImageView &image, EncodeScratch &s, std::vector<unsigned char> &out) {
+    const int w = image.width, h = image.height;
+    const int nstripes = (h+STRIPE_ROWS-1)/STRIPE_ROWS;
+    if ((int)s.stripes.size()<nstripes) s.stripes.resize(nstripes);
+    JobSystem::instance().parallel_for(0, nstripes, 1, [&](int s0, int s1) {
+        for (int i=s0; i<s1; i++) qoi_stripe(image, i*STRIPE_ROWS, std::min(h, (i+1)*STRIPE_ROWS), s.stripes[i]);
+    });
+    out.clear();
+    out.insert(out.end(), "qoif", "qoif"+4);
+    put_be32(out, w);
+    put_be32(out, h);
+    out.push_back(4==image.bytespp ? 4 : 3);
+    out.push_back(0); // sRGB
+    for (int i=0; i<nstripes; i++) out.insert(out.end(), s.stripes[i].begin(), s.stripes[i].end());
+    static const unsigned char end_marker[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+    out.insert(out.end(), end_marker, end_marker+8);
+    return true;
+}
+
+// an ostream that appends to a vector, for TGAImage::write_tga
+class VectorStreambuf : public std::streambuf {
+public:
+    explicit VectorStreambuf(std::vector<unsigned char> &out) : out_(out) {}
+protected:
+    int_type overflow(int_type c) {
+        if (c!=traits_type::eof()) out_.push_back(c);
+        return c;
+    }
+    std::streamsize xsputn(const char *s, std::streamsize n) {
+        out_.insert(out_.end(), s, s+n);
+        return n;
+    }
+private:
+    std::vector<unsigned char> &out_;
+};
+
+// the pixels of a view as a TGAImage: its own buffer when the rows are
+// contiguous, a copy otherwise
+static TGAImage as_image(const ImageView &image) {
+    if (image.contiguous()) return TGAImage(image.width, image.height, image.bytespp, image.data);
+    TGAImage copy(image.width, image.height, image.bytespp);
+    for (int y=0; y<image.height; y++) memcpy(copy.buffer()+(size_t)y*image.width*image.bytespp, image.row(y), (size_t)image.width*image.bytespp);
+    return copy;
+}
+
+bool encode_image(const ImageView &image, ImageFormat format, std::vector<unsigned char> &out) {
+    TRACE_SCOPE("encode_image");
+    if (image.empty()) {
+        std::cerr << "can't encode an empty image\n";
+        return false;
+    }
+    if (IMAGE_TGA==format || IMAGE_TGA_RAW==format) {
+        out.clear();
+        VectorStreambuf buf(out);
+        std::ostream os(&buf);
+        return as_image(image).write_tga(os, IMAGE_TGA==format);
+    }
+    std::unique_ptr<EncodeScratch> s = acquire_scratch();
+    bool ok = IMAGE_PNG==format ? encode_png(image, *s, out) : encode_qoi(image, *s, out);
+    release_scratch(std::move(s));
+    return ok;
+}
+
+bool write_image_file(const ImageView &image, const char *filename, ImageFormat format) {
+    if (IMAGE_TGA==format || IMAGE_TGA_RAW==format) return as_image(image).write_tga_file(filename, IMAGE_TGA==format);
+    TRACE_SCOPE("write_image_file");
+    std::unique_ptr<EncodeScratch> s = acquire_scratch();
+    bool ok = encode_image(image, format, s->file);
+    if (ok) {
+        static thread_local char buffer[1<<12]; // the filebuf would allocate its own on every open; the file is one write past it anyway
+        std::ofstream out;
+        out.rdbuf()->pubsetbuf(buffer, sizeof(buffer));
+        out.open(filename, std::ios::binary);
+        if (!out.is_open()) {
+            std::cerr << "can't open file " << filename << "\n";
+            ok = false;
+        } else {
+            out.write((const char *)s->file.data(), s->file.size());
+            ok = out.good();
+            if (!ok) std::cerr << "can't write " << filename << "\n";
+        }
+    }
+    release_scratch(std::move(s));
+    return ok;
+}
+
+bool encode_benchmark(const char *tga_filename, int repeat) {
+    TGAImage image;
+    if (!image.read_tga_file(tga_filename)) return false;
+    const ImageFormat formats[4] = {IMAGE_TGA_RAW, IMAGE_TGA, IMAGE_QOI, IMAGE_PNG};
+    const char *names[4] = {"tga-raw", "tga", "qoi", "png"};
+    const double mb = (double)image.get_width()*image.get_height()*image.get_bytespp()/(1<<20);
+    std::vector<unsigned char> out;
+    std::cerr << tga_filename << ": " << image.get_width() << "x" << image.get_height() << "x" << image.get_bytespp()
+              << ", best of " << repeat << " on " << JobSystem::instance().threads() << " threads" << std::endl;
+    for (int f=0; f<4; f++) {
+        double best = 1e30;
+        for (int r=0; r<std::max(1, repeat); r++) {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            if (!encode_image(image.view(), formats[f], out)) return false;
+            best = std::min(best, std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count());
+        }
+        fprintf(stderr, "%-8s %9zu bytes %6.2f%% %8.2f ms %8.1f MB/s\n", names[f], out.size(), 100.*out.size()/(mb*(1<<20)), best*1e3, best>0 ? mb/best : 0);
+    }
+    return true;
+}
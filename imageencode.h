@@ -0,0 +1,29 @@
+#ifndef __IMAGEENCODE_H__
+#define __IMAGEENCODE_H__
+#include <vector>
+#include "tgaimage.h"
+
+// Lossless output formats next to TGA: QOI, and PNG with its own deflate.
+// Both cut the image into horizontal stripes of a fixed number of rows that
+// are encoded as jobs on the JobSystem and then stitched together, so the
+// file does not depend on the thread count. A QOI stripe starts from a
+// literal pixel and only refers to colors it saw itself; a PNG stripe is a
+// series of deflate blocks that may match into the last 32 KB of the stripe
+// before it and ends on a byte boundary, the Adler-32 sums of the stripes are
+// combined. Rows are written top first, as write_tga_file writes them.
+enum ImageFormat {
+    IMAGE_TGA, IMAGE_TGA_RAW, IMAGE_QOI, IMAGE_PNG
+};
+
+bool parse_image_format(const char *name, ImageFormat &format); // tga, tga-raw, qoi or png
+const char *image_format_extension(ImageFormat format);          // "tga", "qoi" or "png"
+
+// the whole file into out, which keeps its capacity between calls; views of
+// part of an image are encoded in place, tga copies them first
+bool encode_image(const ImageView &image, ImageFormat format, std::vector<unsigned char> &out);
+bool write_image_file(const ImageView &image, const char *filename, ImageFormat format);
+
+// ./main --encode-bench image.tga [repeat]: size and encode MB/s per format
+bool encode_benchmark(const char *tga_filename, int repeat=10);
+
+#endif //__IMAGEENCODE_H__
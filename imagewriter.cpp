@@ -0,0 +1,70 @@
+#include <chrono>
+#include "imagewriter.h"
+#include "jobs.h"
+#include "trace.h"
+
+AsyncImageWriter::AsyncImageWriter(int nslots) : slots_(nslots), free_(), queued_(nslots), queue_head_(0), queue_size_(0),
+    busy_(0), failed_(false), blocked_ms_(0) {
+    free_.reserve(nslots);
+    for (int i=0; i<nslots; i++) free_.push_back(i);
+}
+
+AsyncImageWriter::~AsyncImageWriter() {
+    flush();
+}
+
+void AsyncImageWriter::submit(TGAImage &img, const char *filename, bool flip, ImageFormat format) {
+    TRACE_SCOPE("submit_image");
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (free_.empty()) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        cv_.wait(lock, [this] { return !free_.empty(); });
+        blocked_ms_ += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now()-start).count();
+    }
+    int i = free_.back();
+    free_.pop_back();
+    Slot &slot = slots_[i];
+    if (slot.image.get_width()!=img.get_width() || slot.image.get_height()!=img.get_height() || slot.image.get_bytespp()!=img.get_bytespp()) {
+        slot.image = TGAImage(img.get_width(), img.get_height(), img.get_bytespp()); // only until the slots warm up
+    }
+    slot.image.swap(img);
+    slot.filename = filename;
+    slot.flip = flip;
+    slot.format = format;
+    queued_[(queue_head_+queue_size_++)%queued_.size()] = i;
+    lock.unlock();
+    JobSystem::instance().run([this] { write_next(); });
+}
+
+bool AsyncImageWriter::flush() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this] { return !queue_size_ && !busy_; });
+    bool ok = !failed_;
+    failed_ = false;
+    return ok;
+}
+
+double AsyncImageWriter::blocked_ms() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return blocked_ms_;
+}
+
+void AsyncImageWriter::write_next() {
+    TRACE_SCOPE("write_image");
+    std::unique_lock<std::mutex> lock(mutex_);
+    int i = queued_[queue_head_];
+    queue_head_ = (queue_head_+1)%queued_.size();
+    queue_size_--;
+    busy_++;
+    lock.unlock();
+
+    Slot &slot = slots_[i];
+    if (slot.flip) slot.image.flip_vertically();
+    bool ok = write_image_file(slot.image.view(), slot.filename.c_str(), slot.format);
+
+    lock.lock();
+    busy_--;
+    failed_ = failed_ || !ok;
+    free_.push_back(i);
+    cv_.notify_all();
+}
@@ -0,0 +1,43 @@
+#ifndef __IMAGEWRITER_H__
+#define __IMAGEWRITER_H__
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "imageencode.h"
+#include "tgaimage.h"
+
+// Writes finished images as jobs on the JobSystem (in submit() itself when it
+// has no workers). submit() swaps the caller's
+// image with a recycled slot and returns at once, so the caller gets back a
+// buffer of the same size to render the next frame into; it only blocks when
+// every slot is still queued or being written. Once the slots have images of
+// the right size and long enough file names, submitting does not allocate.
+class AsyncImageWriter {
+public:
+    AsyncImageWriter(int nslots=3);
+    ~AsyncImageWriter(); // waits for the queue to drain
+    void submit(TGAImage &img, const char *filename, bool flip=false, ImageFormat format=IMAGE_TGA);
+    bool flush();        // waits until everything submitted is written, false if a write failed
+    double blocked_ms(); // time submit() spent waiting for a free slot
+private:
+    struct Slot {
+        TGAImage image;
+        std::string filename;
+        bool flip; // flip_vertically() before writing
+        ImageFormat format;
+    };
+    void write_next(); // one job per submitted image, oldest first
+
+    std::vector<Slot> slots_;
+    std::vector<int> free_;    // slot indices, as a stack
+    std::vector<int> queued_;  // slot indices, a ring of nslots in submit order
+    size_t queue_head_, queue_size_;
+    int busy_;
+    bool failed_;
+    double blocked_ms_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+};
+
+#endif //__IMAGEWRITER_H__
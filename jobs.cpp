@@ -0,0 +1,230 @@
+#include <iomanip>
+#include <iostream>
+#include <pthread.h>
+#include <sched.h>
+#include "jobs.h"
+#include "trace.h"
+
+struct Task {
+    std::function<void()> fn;
+    std::atomic<int> refs;     // the caller's hold and the scheduler's
+    std::atomic<int> pending;  // unfinished dependencies, plus one until submit()
+    std::atomic<bool> done;
+    std::mutex mutex;          // done and successors
+    std::vector<Task *> successors;
+    Task() : fn(), refs(0), pending(0), done(false), mutex(), successors() {}
+};
+
+static const int TASK_BLOCK = 64;
+static thread_local int t_queue = 0; // the deque this thread pushes to, 0 outside the pool
+
+static void pin_thread(int cpu) {
+    int ncpu = std::max(1u, std::thread::hardware_concurrency());
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu%ncpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) std::cerr << "can't pin a thread to cpu " << cpu%ncpu << std::endl;
+}
+
+JobSystem &JobSystem::instance() {
+    static JobSystem jobs;
+    return jobs;
+}
+
+JobSystem::JobSystem() : workers_(), queues_(1, new WorkQueue()), stats_(1, new ThreadStats()), queued_(0), stop_(false),
+    sleep_mutex_(), sleep_cv_(), pool_mutex_(), free_tasks_(), task_blocks_(), pinned_(false), started_(std::chrono::steady_clock::now()) {
+}
+
+JobSystem::~JobSystem() {
+    start(1);
+    delete queues_[0];
+    delete stats_[0];
+    for (size_t i=0; i<task_blocks_.size(); i++) delete [] task_blocks_[i];
+}
+
+void JobSystem::start(int nthreads, bool pin) {
+    if (!workers_.empty()) { // workers drain the queues before they exit
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex_);
+            stop_ = true;
+        }
+        sleep_cv_.notify_all();
+        for (size_t i=0; i<workers_.size(); i++) workers_[i].join();
+        workers_.clear();
+        stop_ = false;
+    }
+    for (size_t i=1; i<queues_.size(); i++) {
+        delete queues_[i];
+        delete stats_[i];
+    }
+    queues_.resize(1);
+    stats_.resize(1);
+    stats_[0]->busy_ns = stats_[0]->tasks = stats_[0]->steals = 0;
+
+    if (nthreads<=0) nthreads = std::max(1u, std::thread::hardware_concurrency());
+    for (int i=1; i<nthreads; i++) {
+        queues_.push_back(new WorkQueue());
+        stats_.push_back(new ThreadStats());
+    }
+    pinned_ = pin;
+    if (pin && nthreads>1) pin_thread(0);
+    for (int i=1; i<nthreads; i++) workers_.push_back(std::thread(&JobSystem::worker, this, i, pin));
+    started_ = std::chrono::steady_clock::now();
+}
+
+Task *JobSystem::create(const std::function<void()> &f) {
+    Task *task;
+    {
+        std::lock_guard<std::mutex> lock(pool_mutex_);
+        if (free_tasks_.empty()) {
+            Task *block = new Task[TASK_BLOCK];
+            task_blocks_.push_back(block);
+            free_tasks_.reserve(task_blocks_.size()*TASK_BLOCK);
+            for (int i=0; i<TASK_BLOCK; i++) free_tasks_.push_back(block+i);
+        }
+        task = free_tasks_.back();
+        free_tasks_.pop_back();
+    }
+    task->fn = f;
+    task->refs = 2;
+    task->pending = 1;
+    task->done = false;
+    return task;
+}
+
+void JobSystem::depend(Task *task, Task *on) {
+    std::lock_guard<std::mutex> lock(on->mutex);
+    if (on->done) return;
+    task->pending++;
+    on->successors.push_back(task);
+}
+
+void JobSystem::submit(Task *task) {
+    if (1==task->pending--) enqueue(task);
+}
+
+void JobSystem::wait(Task *task) {
+    while (!task->done.load(std::memory_order_acquire)) {
+        Task *t = find(t_queue);
+        if (t) {
+            execute(t, t_queue);
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(sleep_mutex_);
+        sleep_cv_.wait(lock, [this, task] { return task->done.load() || queued_.load()>0; });
+    }
+    release(task);
+}
+
+void JobSystem::detach(Task *task) {
+    release(task);
+}
+
+void JobSystem::run(const std::function<void()> &f) {
+    Task *task = create(f);
+    submit(task);
+    detach(task);
+}
+
+void JobSystem::enqueue(Task *task) {
+    if (workers_.empty()) {
+        execute(task, 0);
+        return;
+    }
+    WorkQueue &q = *queues_[t_queue];
+    {
+        std::lock_guard<std::mutex> lock(q.mutex);
+        if (q.size<q.ring.size()) {
+            q.ring[(q.head+q.size++)%q.ring.size()] = task;
+            task = NULL;
+        }
+    }
+    if (task) { // deque full, no point in queueing more
+        execute(task, t_queue);
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex_); // a worker between its check and its wait must not miss this
+        queued_++;
+    }
+    sleep_cv_.notify_one();
+}
+
+Task *JobSystem::find(int self) {
+    // newest of our own first, it is the most likely to be in cache; then the oldest of someone else's
+    for (size_t k=0; k<queues_.size(); k++) {
+        WorkQueue &q = *queues_[(self+k)%queues_.size()];
+        std::lock_guard<std::mutex> lock(q.mutex);
+        if (!q.size) continue;
+        Task *task;
+        if (!k) {
+            task = q.ring[(q.head+--q.size)%q.ring.size()];
+        } else {
+            task = q.ring[q.head];
+            q.head = (q.head+1)%q.ring.size();
+            q.size--;
+            stats_[self]->steals++;
+        }
+        queued_--;
+        return task;
+    }
+    return NULL;
+}
+
+void JobSystem::execute(Task *task, int self) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    task->fn();
+    ThreadStats &s = *stats_[self];
+    s.busy_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now()-start).count();
+    s.tasks++;
+    finish(task);
+}
+
+void JobSystem::finish(Task *task) {
+    task->fn = nullptr; // drops the captures now rather than when the task is reused
+    {
+        std::lock_guard<std::mutex> lock(task->mutex);
+        task->done.store(true, std::memory_order_release);
+    }
+    for (size_t i=0; i<task->successors.size(); i++) submit(task->successors[i]);
+    task->successors.clear();
+    if (!workers_.empty()) {
+        { std::lock_guard<std::mutex> lock(sleep_mutex_); }
+        sleep_cv_.notify_all(); // someone may wait() for it
+    }
+    release(task);
+}
+
+void JobSystem::release(Task *task) {
+    if (1!=task->refs--) return;
+    std::lock_guard<std::mutex> lock(pool_mutex_);
+    free_tasks_.push_back(task);
+}
+
+void JobSystem::worker(int index, bool pin) {
+    trace_thread_name("job_worker");
+    if (pin) pin_thread(index);
+    t_queue = index;
+    for (;;) {
+        Task *task = find(index);
+        if (task) {
+            execute(task, index);
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(sleep_mutex_);
+        sleep_cv_.wait(lock, [this] { return stop_ || queued_.load()>0; });
+        if (stop_ && !queued_.load()) return;
+    }
+}
+
+void JobSystem::report(std::ostream &out) {
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now()-started_).count();
+    out << "jobs: " << threads() << " threads" << std::endl;
+    for (size_t i=0; i<stats_.size(); i++) {
+        const ThreadStats &s = *stats_[i];
+        out << "  " << (i ? "worker " : "caller ") << std::setw(2) << i << ": busy " << std::fixed << std::setprecision(1)
+            << (elapsed>0 ? 100.*s.busy_ns.load()*1e-9/elapsed : 0.) << "%, " << s.tasks.load() << " tasks, "
+            << s.steals.load() << " steals" << std::endl;
+        out.unsetf(std::ios_base::floatfield);
+    }
+}
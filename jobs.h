@@ -0,0 +1,97 @@
+#ifndef __JOBS_H__
+#define __JOBS_H__
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <ostream>
+#include <thread>
+#include <vector>
+
+struct Task;
+
+// Work-stealing task scheduler. Each worker owns a deque: it pushes and pops
+// its own tasks at the back, idle workers steal from the front of the others.
+// Threads outside the pool (main, server connections) share deque 0. wait()
+// runs queued tasks instead of blocking. With a single thread there are no
+// workers and every task runs inline as soon as it is runnable.
+// Tasks come from a pool and std::function keeps small captures inline, so
+// scheduling does not allocate once warmed up.
+class JobSystem {
+public:
+    static JobSystem &instance();
+    ~JobSystem(); // runs what is still queued, then stops the workers
+    // nthreads counts the calling thread, 0 is one per core; pin binds worker i to cpu i
+    void start(int nthreads, bool pin=false);
+    int threads() const { return (int)workers_.size()+1; }
+    bool pinned() const { return pinned_; }
+
+    Task *create(const std::function<void()> &f); // held by the caller until wait() or detach()
+    void depend(Task *task, Task *on); // task runs after on finished; call before submit(task)
+    void submit(Task *task);           // runs once every dependency finished
+    void wait(Task *task);             // until task finished, then releases it
+    void detach(Task *task);           // releases the caller's hold, the task still runs
+    void run(const std::function<void()> &f); // create, submit and detach
+
+    // f(i0, i1) over [begin, end) in chunks of about grain, waits for all of them
+    template <typename F> void parallel_for(int begin, int end, int grain, const F &f);
+
+    void report(std::ostream &out); // per-thread utilization since start()
+private:
+    struct WorkQueue {
+        std::mutex mutex;
+        std::vector<Task *> ring;
+        size_t head, size;
+        WorkQueue() : mutex(), ring(1024), head(0), size(0) {}
+    };
+    struct ThreadStats {
+        std::atomic<uint64_t> busy_ns, tasks, steals;
+        ThreadStats() : busy_ns(0), tasks(0), steals(0) {}
+    };
+    JobSystem();
+    void worker(int index, bool pin);
+    void enqueue(Task *task);
+    Task *find(int self);
+    void execute(Task *task, int self);
+    void finish(Task *task);
+    void release(Task *task);
+
+    std::vector<std::thread> workers_;
+    std::vector<WorkQueue *> queues_;     // [0] external threads, [i] worker i
+    std::vector<ThreadStats *> stats_;
+    std::atomic<int> queued_;
+    bool stop_;
+    std::mutex sleep_mutex_;
+    std::condition_variable sleep_cv_;    // work queued, or a task finished
+    std::mutex pool_mutex_;
+    std::vector<Task *> free_tasks_;
+    std::vector<Task *> task_blocks_;
+    bool pinned_;
+    std::chrono::steady_clock::time_point started_;
+};
+
+template <typename F> void JobSystem::parallel_for(int begin, int end, int grain, const F &f) {
+    if (end<=begin) return;
+    const int MAX_CHUNKS = 256;
+    grain = std::max(grain, (end-begin+MAX_CHUNKS-1)/MAX_CHUNKS);
+    int n = (end-begin+grain-1)/grain;
+    if (n==1 || workers_.empty()) {
+        f(begin, end);
+        return;
+    }
+    struct Range { const F *f; int begin, end, grain; } range = {&f, begin, end, grain};
+    Task *tasks[MAX_CHUNKS];
+    for (int i=0; i<n; i++) {
+        tasks[i] = create([&range, i]() { // small enough to stay inside std::function
+            int b = range.begin + i*range.grain;
+            (*range.f)(b, std::min(range.end, b+range.grain));
+        });
+    }
+    for (int i=n; i--; ) submit(tasks[i]); // the caller pops the last pushed first, i.e. chunk 0
+    for (int i=0; i<n; i++) wait(tasks[i]);
+}
+
+#endif //__JOBS_H__
@@ -0,0 +1,172 @@
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include "lights.h"
+#include "pipeLine.h"
+
+Vec3f Light::illuminate(Vec3f p, Vec3f n, Vec3f v, float shininess) const {
+    Vec3f l = position - p;
+    float d2 = l*l;
+    if (d2>=range*range) return Vec3f(0,0,0);
+    float d = std::sqrt(d2);
+    l = l/std::max(d, 1e-6f);
+    float diff = n*l;
+    if (diff<=0) return Vec3f(0,0,0);
+    float t = 1.f - d2/(range*range);
+    float att = t*t; // smooth falloff, exactly 0 at the range
+    if (SPOT==type) {
+        float c = -(l*direction);
+        if (c<=cos_outer) return Vec3f(0,0,0);
+        float s = std::min(1.f, (c-cos_outer)/std::max(cos_inner-cos_outer, 1e-6f));
+        att *= s*s*(3-2*s);
+    }
+    Vec3f h = (l+v).normalize();
+    float spec = pow(std::max(n*h, 0.f), shininess);
+    return color*(att*(1.2f*diff + .6f*spec));
+}
+
+bool load_lights(const char *filename, std::vector<Light> &lights) {
+    std::ifstream in(filename);
+    if (!in) {
+        std::cerr << "can't open light file " << filename << std::endl;
+        return false;
+    }
+    std::string line;
+    int lineno = 0;
+    while (std::getline(in, line)) {
+        lineno++;
+        std::istringstream iss(line);
+        std::string type;
+        if (!(iss >> type) || type[0]=='#') continue;
+        Light l;
+        bool ok = (bool)(iss >> l.position.x >> l.position.y >> l.position.z >> l.color.x >> l.color.y >> l.color.z >> l.range);
+        if (ok && type=="spot") {
+            float inner, outer;
+            ok = (bool)(iss >> l.direction.x >> l.direction.y >> l.direction.z >> inner >> outer) && l.direction.norm()>0;
+            if (ok) {
+                l.type = Light::SPOT;
+                l.direction.normalize();
+                l.cos_inner = cos(inner*MY_PI/180);
+                l.cos_outer = cos(outer*MY_PI/180);
+            }
+        } else if (type!="point") {
+            ok = false;
+        }
+        if (!ok || l.range<=0) {
+            std::cerr << filename << ":" << lineno << ": bad light '" << line << "'" << std::endl;
+            return false;
+        }
+        lights.push_back(l);
+    }
+    return true;
+}
+
+void scatter_lights(int n, Vec3f center, float radius, std::vector<Light> &lights) {
+    unsigned int seed = 12345;
+    auto rnd = [&seed]() { seed = seed*1664525u + 1013904223u; return (seed>>8)/float(1<<24); };
+    for (int i=0; i<n; i++) {
+        Light l;
+        l.position = center + Vec3f(2*rnd()-1, 2*rnd()-1, 2*rnd()-1)*radius;
+        l.color = Vec3f(rnd(), rnd(), rnd());
+        l.range = radius*(.15f + .15f*rnd());
+        lights.push_back(l);
+    }
+}
+
+LightGrid::LightGrid() : width_(0), height_(0), tiles_x_(0), tiles_y_(0), nlights_(0),
+    tile_zmin_(), tile_zmax_(), offsets_(1, 0), indices_(), count_() {
+}
+
+void LightGrid::build(const std::vector<Light> &lights, const Mat4f &world_to_screen, const DepthBuffer *zbuffer, int w, int h, FrameArena &arena) {
+    width_ = w;
+    height_ = h;
+    tiles_x_ = (w+TILE-1)/TILE;
+    tiles_y_ = (h+TILE-1)/TILE;
+    nlights_ = lights.size();
+    const int ntiles = tiles_x_*tiles_y_;
+    const float lowest = -std::numeric_limits<float>::max();
+
+    // depth range of each tile; empty tiles keep zmax<zmin and get no lights
+    tile_zmin_.assign(ntiles, std::numeric_limits<float>::max());
+    tile_zmax_.assign(ntiles, lowest);
+    for (int y=0; y<h; y++) {
+        for (int x=0; x<w; x++) {
+            float z = zbuffer ? zbuffer->depth(x+y*w) : 0;
+            if (z==lowest) continue;
+            int t = x/TILE + (y/TILE)*tiles_x_;
+            tile_zmin_[t] = std::min(tile_zmin_[t], z);
+            tile_zmax_[t] = std::max(tile_zmax_[t], z);
+        }
+    }
+    if (!zbuffer) { // no depth information, every tile may hold anything
+        tile_zmin_.assign(ntiles, lowest);
+        tile_zmax_.assign(ntiles, std::numeric_limits<float>::max());
+    }
+
+    // screen bounds of every light: project the corners of its bounding box
+    int *rect = arena.alloc<int>(4*lights.size());
+    float *zrange = arena.alloc<float>(2*lights.size());
+    for (size_t i=0; i<lights.size(); i++) {
+        const Light &l = lights[i];
+        float x0 = std::numeric_limits<float>::max(), y0 = x0, z0 = x0, x1 = lowest, y1 = lowest, z1 = lowest;
+        bool behind = false;
+        for (int k=0; k<8; k++) {
+            Vec3f c = l.position + Vec3f(k&1 ? l.range : -l.range, k&2 ? l.range : -l.range, k&4 ? l.range : -l.range);
+            Vec4f s = world_to_screen*embed<4>(c);
+            if (s[3]<=1e-6f) { // crosses the eye plane, the projected box is unbounded
+                behind = true;
+                break;
+            }
+            x0 = std::min(x0, s[0]/s[3]); x1 = std::max(x1, s[0]/s[3]);
+            y0 = std::min(y0, s[1]/s[3]); y1 = std::max(y1, s[1]/s[3]);
+            z0 = std::min(z0, s[2]/s[3]); z1 = std::max(z1, s[2]/s[3]);
+        }
+        if (behind) {
+            x0 = y0 = z0 = lowest;
+            x1 = y1 = z1 = std::numeric_limits<float>::max();
+        }
+        rect[4*i+0] = x1<0 ? tiles_x_ : (int)std::max(x0, 0.f)/TILE; // an empty range when off screen
+        rect[4*i+1] = y1<0 ? tiles_y_ : (int)std::max(y0, 0.f)/TILE;
+        rect[4*i+2] = x0>=w ? -1 : (int)std::min(x1, w-1.f)/TILE;
+        rect[4*i+3] = y0>=h ? -1 : (int)std::min(y1, h-1.f)/TILE;
+        zrange[2*i+0] = z0;
+        zrange[2*i+1] = z1;
+    }
+
+    // count, then fill the compact per-tile lists
+    count_.assign(ntiles, 0);
+    for (int pass=0; pass<2; pass++) {
+        if (1==pass) {
+            offsets_.resize(ntiles+1);
+            offsets_[0] = 0;
+            for (int t=0; t<ntiles; t++) offsets_[t+1] = offsets_[t]+count_[t];
+            indices_.resize(offsets_[ntiles]);
+            count_.assign(ntiles, 0);
+        }
+        for (size_t i=0; i<lights.size(); i++) {
+            for (int ty=rect[4*i+1]; ty<=rect[4*i+3]; ty++) {
+                for (int tx=rect[4*i+0]; tx<=rect[4*i+2]; tx++) {
+                    int t = tx + ty*tiles_x_;
+                    if (tile_zmax_[t]<tile_zmin_[t]) continue; // nothing drawn
+                    if (zrange[2*i+1]<tile_zmin_[t] || zrange[2*i]>tile_zmax_[t]) continue;
+                    if (1==pass) indices_[offsets_[t]+count_[t]] = i;
+                    count_[t]++;
+                }
+            }
+        }
+    }
+}
+
+void LightGrid::report(std::ostream &out) const {
+    int ntiles = tiles_x_*tiles_y_, used = 0, maxn = 0;
+    for (int t=0; t<ntiles; t++) {
+        used += count_[t]>0;
+        maxn = std::max(maxn, count_[t]);
+    }
+    out << "light grid: " << nlights_ << " lights, " << tiles_x_ << "x" << tiles_y_ << " tiles of " << TILE << "px, "
+        << (ntiles ? (double)indices_.size()/ntiles : 0) << " lights per tile on average, " << maxn << " at most, "
+        << used << " tiles lit" << std::endl;
+}
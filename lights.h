@@ -0,0 +1,62 @@
+#ifndef __LIGHTS_H__
+#define __LIGHTS_H__
+#include <algorithm>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "geometry.h"
+#include "arena.h"
+#include "pipeLine.h"
+
+// Point and spot lights with a finite range, in world space. They come on top
+// of the shadowed directional light of RenderParams::light_dir.
+struct Light {
+    enum Type { POINT, SPOT };
+    Type type;
+    Vec3f position;
+    Vec3f color;      // rgb, 1 is about as bright as the directional light
+    float range;      // no contribution past this distance
+    Vec3f direction;  // spot axis, pointing away from the light
+    float cos_inner;  // full intensity inside this cone
+    float cos_outer;  // none outside of this one
+
+    Light() : type(POINT), position(), color(1,1,1), range(1), direction(0,0,-1), cos_inner(1), cos_outer(1) {}
+    // rgb added at world position p with unit normal n, v the unit vector towards the eye
+    Vec3f illuminate(Vec3f p, Vec3f n, Vec3f v, float shininess) const;
+};
+
+// "point x y z r g b range" or "spot x y z r g b range dx dy dz inner_deg outer_deg" per line, # comments
+bool load_lights(const char *filename, std::vector<Light> &lights);
+// n small point lights scattered around center, for benchmarking
+void scatter_lights(int n, Vec3f center, float radius, std::vector<Light> &lights);
+
+// Per-screen-tile light lists. A light lands in a tile when its bounding box,
+// projected to the screen, overlaps the tile and the depth range of what was
+// drawn there; a fragment then only evaluates the lights of its own tile.
+class LightGrid {
+public:
+    static const int TILE = 16; // pixels
+    LightGrid();
+    // world_to_screen: viewport*projection*view; zbuffer: w*h depths of a depth
+    // pre-pass, or NULL to cull in screen x and y only; scratch comes from arena
+    void build(const std::vector<Light> &lights, const Mat4f &world_to_screen, const DepthBuffer *zbuffer, int w, int h, FrameArena &arena);
+    // indices of the lights that may reach pixel (x,y), count in n
+    const int *lights_at(int x, int y, int &n) const {
+        x = std::min(std::max(x, 0), width_-1) / TILE;
+        y = std::min(std::max(y, 0), height_-1) / TILE;
+        int t = x + y*tiles_x_;
+        n = offsets_[t+1]-offsets_[t];
+        return indices_.data()+offsets_[t];
+    }
+    void report(std::ostream &out) const; // lights per tile
+private:
+    int width_, height_, tiles_x_, tiles_y_;
+    int nlights_;
+    std::vector<float> tile_zmin_, tile_zmax_;
+    std::vector<int> offsets_;  // tiles_x_*tiles_y_+1, into indices_
+    std::vector<int> indices_;
+    std::vector<int> count_;
+};
+
+#endif //__LIGHTS_H__
@@ -1,117 +1,322 @@
-#include <limits>
-#include "tgaimage.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include "aobake.h"
+#include "batch.h"
+#include "distributed.h"
+#include "imageencode.h"
 #include "model.h"
 #include "pipeLine.h"
-#include <iostream>
-Model *model = NULL;
-float *shadowbuffer = NULL;
-
-const int width  = 800;
-const int height = 800;
-Vec3f light_dir(1,1,1);
-Vec3f       eye(0,0,3);
-Vec3f    center(0,0,0);
-Vec3f        up(0,1,0);
-float angle = 0.0;
-
-struct DepthShader : public IShader {
-    mat<3,3,float> varying_tri;
+#include "quantize.h"
+#include "renderer.h"
+#include "stats.h"
+#include "trace.h"
+#include "imagewriter.h"
+#include "jobs.h"
+#include "lights.h"
+#include "meshopt.h"
+#include "meshstream.h"
+#include "scene.h"
+#include "server.h"
+#include "shadowmap.h"
+#include "texturecache.h"
+#include "vtexture.h"
 
-    DepthShader() : varying_tri() {}
-
-    virtual Vec3f vertex(int iface, int nthvert) {
-        Vec3f gl_Vertex =  v4tov3(viewport*projection*view*modelTras*embed<4>(model->vert(iface, nthvert)));          // transform it to screen coordinates
-        varying_tri.set_col(nthvert, gl_Vertex);
-        return gl_Vertex;
+int main(int argc, char** argv) {
+    const char *model_file = "obj/african_head.obj";
+    const char *stats_file = NULL;
+    const char *serve = NULL;
+    const char *batch = NULL;
+    size_t batch_memory = 0;
+    const char *scene_file = NULL;
+    bool incremental = false;
+    int nthreads = 0;
+    int njobs = 0;
+    bool pin = false;
+    int nframes = 1;
+    size_t stream_budget = 64<<20;
+    int nworkers = 0;
+    bool scaling = false;
+    bool vt_async = false;
+    int quantize_bits = 0;
+    ImageFormat format = IMAGE_TGA;
+    RenderParams params;
+    for (int i=1; i<argc; i++) {
+        if (!strcmp(argv[i], "--stats")) {
+            stats_file = (i+1<argc && argv[i+1][0]!='-') ? argv[++i] : "stats.json";
+        } else if (!strcmp(argv[i], "--overdraw")) {
+            params.overdraw = true;
+        } else if (!strcmp(argv[i], "--trace")) {
+            if (!trace_available()) std::cerr << "tracing was compiled out (build with TRACE=1)" << std::endl;
+            trace_start((i+1<argc && argv[i+1][0]!='-') ? argv[++i] : "trace.json");
+        } else if (!strcmp(argv[i], "--msaa") && i+1<argc) {
+            params.msaa = atoi(argv[++i]);
+            if (params.msaa!=4 && params.msaa!=8) {
+                std::cerr << "--msaa takes 4 or 8 samples" << std::endl;
+                return 1;
+            }
+        } else if ((!strcmp(argv[i], "--depth-format") || !strcmp(argv[i], "--shadow-format")) && i+1<argc) {
+            DepthFormat &f = !strcmp(argv[i], "--depth-format") ? params.depth_format : params.shadow_format;
+            if (!parse_depth_format(argv[i+1], f)) {
+                std::cerr << argv[i] << " takes float, unorm24 or unorm16" << std::endl;
+                return 1;
+            }
+            i++;
+        } else if (!strcmp(argv[i], "--format") && i+1<argc) {
+            if (!parse_image_format(argv[++i], format)) {
+                std::cerr << "--format takes tga, tga-raw, qoi or png" << std::endl;
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "--encode-bench") && i+1<argc) {
+            int repeat = i+2<argc && argv[i+2][0]!='-' ? atoi(argv[i+2]) : 10;
+            JobSystem::instance().start(njobs, pin); // --jobs before --encode-bench applies
+            return encode_benchmark(argv[i+1], repeat) ? 0 : 1;
+        } else if (!strcmp(argv[i], "--quantize") && i+1<argc) {
+            quantize_bits = atoi(argv[++i]);
+            if (quantize_bits!=8 && quantize_bits!=16) {
+                std::cerr << "--quantize takes 8 or 16 bits per normal component" << std::endl;
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "--vertex-bench") && i+1<argc) {
+            int repeat = i+2<argc && argv[i+2][0]!='-' ? atoi(argv[i+2]) : 20;
+            return vertex_benchmark(argv[i+1], quantize_bits, repeat) ? 0 : 1;
+        } else if (!strcmp(argv[i], "--vrs") && i+1<argc) {
+            const char *arg = argv[++i];
+            params.adaptive_rate = !strcmp(arg, "auto");
+            params.shading_rate = params.adaptive_rate ? ShadingRateMap::MAX_RATE : atoi(arg);
+            if (params.shading_rate!=1 && params.shading_rate!=2 && params.shading_rate!=4) {
+                std::cerr << "--vrs takes 1, 2, 4 or auto" << std::endl;
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "--lights") && i+1<argc) {
+            const char *arg = argv[++i];
+            if (strspn(arg, "0123456789")==strlen(arg)) {
+                scatter_lights(atoi(arg), params.center, 1.f, params.lights);
+            } else if (!load_lights(arg, params.lights)) {
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "--shadow-cache") && i+1<argc) {
+            ShadowCache::instance().set_capacity(atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "--scene") && i+1<argc) {
+            scene_file = argv[++i];
+        } else if (!strcmp(argv[i], "--no-occlusion")) {
+            params.occlusion = false;
+        } else if (!strcmp(argv[i], "--no-sort")) {
+            params.front_to_back = false;
+        } else if (!strcmp(argv[i], "--incremental")) {
+            incremental = true;
+        } else if (!strcmp(argv[i], "--frames") && i+1<argc) {
+            nframes = std::max(1, atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "--serve") && i+1<argc) {
+            serve = argv[++i];
+        } else if (!strcmp(argv[i], "--batch") && i+1<argc) {
+            batch = argv[++i];
+        } else if (!strcmp(argv[i], "--batch-memory") && i+1<argc) {
+            batch_memory = (size_t)atof(argv[++i])*1024*1024;
+        } else if (!strcmp(argv[i], "--threads") && i+1<argc) {
+            nthreads = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--jobs") && i+1<argc) {
+            njobs = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--pin")) {
+            pin = true;
+        } else if (!strcmp(argv[i], "--texture-budget") && i+1<argc) {
+            TextureCache::instance().set_budget((size_t)atof(argv[++i])*1024*1024);
+        } else if (!strcmp(argv[i], "--prefetch")) {
+            TextureCache::instance().set_prefetch(true);
+        } else if (!strcmp(argv[i], "--make-vtex") && i+2<argc) {
+            int tile = i+3<argc && argv[i+3][0]!='-' ? atoi(argv[i+3]) : 128;
+            bool ok = vtex_build(argv[i+1], argv[i+2], tile);
+            std::cerr << "vtex " << argv[i+2] << (ok ? " written" : " failed") << std::endl;
+            return ok ? 0 : 1;
+        } else if (!strcmp(argv[i], "--bake-ao") && i+1<argc) {
+            int size = i+2<argc && argv[i+2][0]!='-' ? atoi(argv[i+2]) : 1024;
+            int rays = i+3<argc && argv[i+3][0]!='-' ? atoi(argv[i+3]) : 64;
+            JobSystem::instance().start(njobs, pin); // --jobs before --bake-ao applies
+            return ao_bake(argv[i+1], NULL, size, rays) ? 0 : 1;
+        } else if (!strcmp(argv[i], "--optimize-mesh") && i+1<argc) {
+            return optimize_mesh(argv[i+1], i+2<argc && argv[i+2][0]!='-' ? argv[i+2] : NULL) ? 0 : 1;
+        } else if (!strcmp(argv[i], "--make-stream") && i+1<argc) {
+            std::string out = i+2<argc && argv[i+2][0]!='-' ? argv[i+2] : std::string(argv[i+1]);
+            if (!(i+2<argc && argv[i+2][0]!='-')) {
+                size_t dot = out.find_last_of('.');
+                if (dot!=std::string::npos && out.find('/', dot)==std::string::npos) out.erase(dot);
+                out += ".mstream";
+            }
+            return mesh_stream_build(argv[i+1], out.c_str(), quantize_bits>0) ? 0 : 1; // --quantize before it applies
+        } else if (!strcmp(argv[i], "--stream-budget") && i+1<argc) {
+            stream_budget = (size_t)(atof(argv[++i])*1024*1024);
+        } else if (!strcmp(argv[i], "--vt-cache") && i+1<argc) {
+            VirtualTexture::set_cache_size((size_t)atof(argv[++i])*1024*1024);
+        } else if (!strcmp(argv[i], "--use-optimized")) {
+            Model::set_use_optimized(true);
+        } else if (!strcmp(argv[i], "--vt-async")) {
+            VirtualTexture::set_async(true);
+            vt_async = true;
+        } else if (!strcmp(argv[i], "--size") && i+1<argc) {
+            if (sscanf(argv[++i], "%dx%d", &params.width, &params.height)!=2 || params.width<1 || params.height<1) {
+                std::cerr << "--size takes WIDTHxHEIGHT" << std::endl;
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "--workers") && i+1<argc) {
+            nworkers = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--scaling")) {
+            scaling = true;
+        } else {
+            model_file = argv[i];
+        }
     }
-    virtual bool fragment(Vec3f bar, TGAColor &color) {
-        Vec3f p = varying_tri*bar;
-        color = TGAColor(255, 255, 255)*(p.z/depth);
-        return false;
+    if (nworkers && (incremental || vt_async || serve || batch)) {
+        std::cerr << "--workers renders whole frames with textures loaded up front, not with --incremental, --vt-async, --serve or --batch" << std::endl;
+        return 1;
     }
-};
-struct Shader : public IShader {
-    mat<4,4,float> uniform_M;   //  Projection*ModelView
-    mat<4,4,float> uniform_MIT; // (Projection*ModelView).invert_transpose()
-    mat<4,4,float> uniform_Mshadow; // transform framebuffer screen coordinates to shadowbuffer screen coordinates
-    mat<2,3,float> varying_uv;  // triangle uv coordinates, written by the vertex shader, read by the fragment shader
-    mat<3,3,float> varying_tri; // triangle coordinates before Viewport transform, written by VS, read by FS
-
-    Shader(Matrix M, Matrix MIT, Matrix MS) : uniform_M(M), uniform_MIT(MIT), uniform_Mshadow(MS), varying_uv(), varying_tri() {}
-
-    virtual Vec3f vertex(int iface, int nthvert) {
-        varying_uv.set_col(nthvert, model->uv(iface, nthvert));
-        Vec3f gl_Vertex =  v4tov3(viewport*projection*view*modelTras*embed<4>(model->vert(iface, nthvert)));          // transform it to screen coordinates
-        varying_tri.set_col(nthvert, gl_Vertex);
-        return gl_Vertex;
+    Model::set_quantization(quantize_bits); // after the one-shot tools above, which read the floats
+    JobSystem::instance().start(njobs, pin);
+    if (serve) {
+        return !strcmp(serve, "-") ? serve_stdin(nthreads) : serve_unix(serve, nthreads);
     }
-
-    virtual bool fragment(Vec3f bar, TGAColor &color) {
-        Vec3f sb_p =v4tov3(uniform_Mshadow*embed<4>(varying_tri*bar)); // corresponding point in the shadow buffer
-        float shadow = .3+.7*(shadowbuffer[int(sb_p[0]) + int(sb_p[1])*width]<sb_p[2]); //  avoid z-fighting
-        
-        Vec2f uv = varying_uv*bar;
-        Vec3f n = v4tov3(uniform_MIT*embed<4>(model->normal(uv))).normalize();
-        Vec3f l = v4tov3(uniform_M  *embed<4>(light_dir        )).normalize();
-        Vec3f r = (n*(n*l*2.f) - l).normalize();   // reflected light
-        float spec = pow(std::max(r.z, 0.0f), model->specular(uv));
-        float diff = std::max(0.f, n*l);
-        TGAColor c = model->diffuse(uv);
-
-        for (int i=0; i<3; i++) color[i] = std::min<float>(20 + c[i]*shadow*(1.2*diff + .6*spec), 255);
-        return false;
+    if (batch) {
+        std::vector<BatchJob> jobs;
+        int skipped = 0;
+        if (!load_manifest(batch, jobs, skipped)) return 1;
+        return run_batch(jobs, nthreads, batch_memory) || skipped ? 1 : 0; // the bad jobs fail the batch after the others ran
+    }
+    if ((stats_file || params.overdraw) && !stats_available()) {
+        std::cerr << "statistics were compiled out (build with STATS=1)" << std::endl;
     }
-};
+    stats_enable(stats_file || params.overdraw);
+    std::ofstream stats_out;
+    if (stats_file) stats_out.open(stats_file);
 
-int main(int argc, char** argv) {
-    if (2==argc) {
-        model = new Model(argv[1]);
-    } else {
-        model = new Model("obj/african_head.obj");
+    AssetCache assets;
+    SceneScript script;
+    if (scene_file) {
+        if (!load_scene(scene_file, assets, script)) return 1;
+        nframes = script.frames.size();
     }
-    float *zbuffer = new float[width*height];
-    shadowbuffer   = new float[width*height];
-    for (int i=width*height; --i; ) {
-        zbuffer[i] = shadowbuffer[i] = -std::numeric_limits<float>::max();
+    size_t len = strlen(model_file);
+    bool streamed = !scene_file && len>8 && !strcmp(model_file+len-8, ".mstream");
+    MeshStream mesh;
+    if (streamed) {
+        if (!mesh.open(model_file, stream_budget)) return 1;
+        if (!params.lights.empty()) std::cerr << "streamed meshes are drawn without --lights" << std::endl;
+        params.lights.clear();
     }
-    light_dir.normalize();
-
-    // rendering the shadow buffer
-    TGAImage depth(width, height, TGAImage::RGB);
-    set_view(light_dir, center, up);
-    set_projection(0);
-    set_viewport(width/8, height/8, width*3/4, height*3/4);
-    DepthShader depthshader;
-    Vec3f screen_coords[3];
-    for (int i=0; i<model->nfaces(); i++) {
-        for (int j=0; j<3; j++) {
-            screen_coords[j] = depthshader.vertex(i, j);
+    Model *model = scene_file || streamed ? NULL : new Model(model_file);
+    AsyncImageWriter writer;
+    RenderTarget target;
+    IncrementalRenderer incremental_renderer;
+    TGAImage frame_copy;
+    std::vector<SceneObject> scene;
+    DistributedRenderer distributed;
+    DistributedRenderer::DrawFunc draw = [&](const RenderParams &p, RenderTarget &t) {
+        if (scene_file) render_scene(scene, p, t);
+        else if (streamed) render_stream(mesh, p, t);
+        else render(*model, p, t);
+    };
+    // the frame of params into target, in this process or across --workers
+    auto draw_frame = [&](int f) {
+        if (!nworkers) {
+            draw(params, target);
+            return true;
         }
-        triangle(screen_coords, depthshader, depth, shadowbuffer);
-    }
-    depth.flip_vertically(); // to place the origin in the bottom left corner of the image
-    depth.write_tga_file("depth.tga");
-
-    Matrix M = viewport*projection*view*modelTras;
-
-    // rendering the frame buffer
-    TGAImage frame(width, height, TGAImage::RGB);
-    set_view(eye, center, up);
-    set_projection(-1.f/(eye-center).norm());
-    set_viewport(width/8, height/8, width*3/4, height*3/4);
-
-    Shader shader(view*modelTras, (projection*view*modelTras).invert_transpose(), M*(viewport*projection*view*modelTras).invert());
-    for (int i=0; i<model->nfaces(); i++) {
-        for (int j=0; j<3; j++) {
-            screen_coords[j] = shader.vertex(i, j);
+        if (scene_file) { // decoded before the workers are forked, so they share them
+            for (size_t k=0; k<scene.size(); k++) scene[k].model->decode_textures();
+        } else {
+            (streamed ? mesh.material() : *model).decode_textures();
+        }
+        if (0==f && scaling && !distributed_scaling(params, nworkers, draw, target, std::cerr)) return false;
+        if (!distributed.render(params, nworkers, draw, target)) return false;
+        if (stats_file) distributed.report(std::cerr);
+        return true;
+    };
+    Vec3f eye0 = params.eye;
+    for (int f=0; f<nframes; f++) {
+        TRACE_SCOPE("frame");
+        if (scene_file) {
+            // scene scripts keep the camera still and edit objects between frames
+            for (size_t e=0; e<script.frames[f].size(); e++) {
+                const SceneEdit &edit = script.frames[f][e];
+                std::string error;
+                if (!apply_assignments(script.nodes[edit.node], edit.assignments, assets, error)) {
+                    std::cerr << scene_file << ": frame " << f << ": " << error << std::endl;
+                    return 1;
+                }
+            }
+            scene.clear();
+            for (size_t n=0; n<script.nodes.size(); n++) scene.push_back(script.nodes[n].object());
+            if (incremental) {
+                incremental_renderer.render(scene, params, target);
+                if (stats_file) std::cerr << "frame " << f << ": " << incremental_renderer.dirty_tiles() << "/" << incremental_renderer.tiles() << " tiles redrawn" << std::endl;
+            } else if (!draw_frame(f)) {
+                return 1;
+            }
+        } else {
+            // multi-frame runs orbit the camera around the y axis
+            float a = 2*MY_PI*f/nframes;
+            Vec3f d = eye0-params.center;
+            params.eye = params.center + Vec3f(d.x*cos(a) + d.z*sin(a), d.y, d.z*cos(a) - d.x*sin(a));
+            if (!draw_frame(f)) return 1;
         }
-        triangle(screen_coords, shader, frame, zbuffer);
+        {
+            STATS_TIMER(STAGE_OUTPUT);
+            if (0==f) { // the light does not move, one depth image is enough
+                TGAImage depth_image = target.shadow->image; // a copy, the cached shadow map stays untouched
+                char depth_filename[64];
+                snprintf(depth_filename, sizeof(depth_filename), "depth.%s", image_format_extension(format));
+                writer.submit(depth_image, depth_filename, true, format); // flipped to place the origin in the bottom left corner of the image
+            }
+            char filename[64];
+            if (1==nframes) snprintf(filename, sizeof(filename), "framebuffer.%s", image_format_extension(format));
+            else snprintf(filename, sizeof(filename), "framebuffer_%03d.%s", f, image_format_extension(format));
+            if (incremental) { // submit() takes the image, but the next frame starts from this one
+                if (frame_copy.get_width()!=target.frame.get_width() || frame_copy.get_height()!=target.frame.get_height()) {
+                    frame_copy = target.frame;
+                } else {
+                    memcpy(frame_copy.buffer(), target.frame.buffer(), (size_t)target.frame.get_width()*target.frame.get_height()*target.frame.get_bytespp());
+                }
+                writer.submit(frame_copy, filename, true, format);
+            } else {
+                writer.submit(target.frame, filename, true, format);
+            }
+        }
+        if (stats_file) stats_frame_end(stats_out, f);
+    }
+    if (params.overdraw) {
+        stats_write_overdraw("overdraw.tga");
+    }
+    if (params.msaa) {
+        size_t single = (size_t)params.width*params.height*(sizeof(float) + target.frame.get_bytespp());
+        std::cerr << "msaa " << params.msaa << "x: " << (target.msaa.bytes()>>10) << " KB of sample buffers, "
+                  << (single>>10) << " KB without msaa, plus the " << (target.frame.get_width()*target.frame.get_height()*target.frame.get_bytespp()>>10)
+                  << " KB resolve target" << std::endl;
+    }
+    if (stats_file) {
+        // what the depth formats save against float buffers; the traffic is the depth_bytes counter of stats.json
+        size_t main_bytes = (size_t)params.width*params.height*depth_format_bytes(params.depth_format);
+        size_t shadow_bytes = target.shadow ? target.shadow->buffer.bytes() : 0;
+        size_t pixels = (size_t)params.width*params.height;
+        std::cerr << "depth: main " << depth_format_name(params.depth_format) << " " << (main_bytes>>10) << " KB"
+                  << (params.msaa ? " (unused, msaa samples are float)" : "") << ", shadow " << depth_format_name(params.shadow_format)
+                  << " " << (shadow_bytes>>10) << " KB; " << (2*pixels*sizeof(float)>>10) << " KB for both as float" << std::endl;
+    }
+    if (!writer.flush()) {
+        std::cerr << "some images could not be written" << std::endl;
+    }
+    if (writer.blocked_ms()>0) {
+        std::cerr << "renderer waited " << writer.blocked_ms() << " ms for the image writer" << std::endl;
     }
-    frame.flip_vertically(); // to place the origin in the bottom left corner of the image
-    frame.write_tga_file("framebuffer.tga");
 
+    if (stats_file && !params.lights.empty()) target.lights.report(std::cerr);
+    if (stats_file && model) model->report_textures(std::cerr);
+    if (stats_file && streamed) mesh.report(std::cerr);
     delete model;
-    delete [] zbuffer;
-    delete [] shadowbuffer;
+    if (stats_file) TextureCache::instance().report(std::cerr);
+    if (stats_file) ShadowCache::instance().report(std::cerr);
+    if (stats_file) JobSystem::instance().report(std::cerr);
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,198 @@
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <string>
+#include "meshopt.h"
+#include "trace.h"
+
+// FIFO post-transform cache: a vertex is in it while fewer than cache_size
+// misses happened since it was loaded; start() flushes it
+struct FifoCache {
+    std::vector<int> stamp;
+    int misses, size;
+    FifoCache(int nverts, int cache_size) : stamp(nverts, -(1<<30)), misses(0), size(cache_size) {}
+    void start() { misses += size; }
+    int face(Model &model, int f) { // misses of face f
+        int m = 0;
+        for (int j=0; j<3; j++) {
+            int v = model.vert_index(f, j);
+            if (misses-stamp[v] < size) continue;
+            stamp[v] = misses++;
+            m++;
+        }
+        return m;
+    }
+};
+
+float vertex_cache_miss_ratio(Model &model, const std::vector<int> &order, int cache_size) {
+    if (order.empty()) return 0;
+    FifoCache cache(model.nverts(), cache_size);
+    int misses = 0;
+    for (size_t i=0; i<order.size(); i++) misses += cache.face(model, order[i]);
+    return misses/(float)order.size();
+}
+
+// Forsyth, "Linear-speed vertex cache optimisation": the usual constants
+static float vertex_score(int cache_pos, int remaining, int cache_size) {
+    if (!remaining) return -1;
+    float score = 0;
+    if (cache_pos>=0) {
+        if (cache_pos<3) score = .75f; // the last face's vertices: no bonus for repeating it
+        else score = std::pow(1.f - (cache_pos-3)/(float)(cache_size-3), 1.5f);
+    }
+    return score + 2.f/std::sqrt((float)remaining); // faces left on a vertex: finish off lone ones
+}
+
+std::vector<int> optimize_vertex_cache(Model &model, int cache_size) {
+    const int nverts = model.nverts(), nfaces = model.nfaces();
+    // faces per vertex
+    std::vector<int> first(nverts+1, 0), adjacent(nfaces*3);
+    for (int f=0; f<nfaces; f++) for (int j=0; j<3; j++) first[model.vert_index(f, j)+1]++;
+    for (int v=0; v<nverts; v++) first[v+1] += first[v];
+    std::vector<int> fill(first.begin(), first.end()-1);
+    for (int f=0; f<nfaces; f++) for (int j=0; j<3; j++) adjacent[fill[model.vert_index(f, j)]++] = f;
+
+    std::vector<int> remaining(nverts), cache_pos(nverts, -1);
+    std::vector<float> score(nverts), face_score(nfaces, 0);
+    std::vector<char> added(nfaces, 0);
+    for (int v=0; v<nverts; v++) {
+        remaining[v] = first[v+1]-first[v];
+        score[v] = vertex_score(-1, remaining[v], cache_size);
+    }
+    for (int f=0; f<nfaces; f++) for (int j=0; j<3; j++) face_score[f] += score[model.vert_index(f, j)];
+
+    std::vector<int> order, cache, next;
+    order.reserve(nfaces);
+    int best = nfaces ? (int)(std::max_element(face_score.begin(), face_score.end())-face_score.begin()) : -1;
+    int cursor = 0; // faces before it are all added
+    while (best>=0) {
+        added[best] = 1;
+        order.push_back(best);
+        next.clear();
+        for (int j=0; j<3; j++) {
+            int v = model.vert_index(best, j);
+            remaining[v]--;
+            next.push_back(v);
+        }
+        for (size_t i=0; i<cache.size(); i++) {
+            if (std::find(next.begin(), next.begin()+3, cache[i])==next.begin()+3) next.push_back(cache[i]);
+        }
+        // rescore what is or just fell out of the cache, and the faces around it
+        for (size_t i=0; i<next.size(); i++) {
+            int v = next[i];
+            cache_pos[v] = (int)i<cache_size ? (int)i : -1;
+            score[v] = vertex_score(cache_pos[v], remaining[v], cache_size);
+        }
+        best = -1;
+        float best_score = -1e30f;
+        for (size_t i=0; i<next.size(); i++) {
+            int v = next[i];
+            for (int a=first[v]; a<first[v+1]; a++) {
+                int f = adjacent[a];
+                if (added[f]) continue;
+                face_score[f] = score[model.vert_index(f, 0)] + score[model.vert_index(f, 1)] + score[model.vert_index(f, 2)];
+                if (face_score[f]>best_score) {
+                    best_score = face_score[f];
+                    best = f;
+                }
+            }
+        }
+        next.resize(std::min((int)next.size(), cache_size));
+        cache.swap(next);
+        if (best<0) { // dead end, carry on with the first face left
+            while (cursor<nfaces && added[cursor]) cursor++;
+            if (cursor<nfaces) best = cursor;
+        }
+    }
+    return order;
+}
+
+void optimize_overdraw(Model &model, std::vector<int> &order, int cache_size, float threshold) {
+    const int n = order.size();
+    if (!n) return;
+    FifoCache cache(model.nverts(), cache_size);
+    // hard cuts where the cache order restarted anyway: every vertex of the face missed
+    std::vector<int> hard;
+    for (int i=0; i<n; i++) if (3==cache.face(model, order[i]) || !i) hard.push_back(i);
+    hard.push_back(n);
+    // soft cuts inside those, wherever the piece so far is about as good as the whole
+    std::vector<int> cuts;
+    for (size_t h=0; h+1<hard.size(); h++) {
+        int begin = hard[h], end = hard[h+1], misses = 0;
+        cache.start();
+        for (int i=begin; i<end; i++) misses += cache.face(model, order[i]);
+        float limit = threshold*misses/(end-begin);
+        size_t first_cut = cuts.size();
+        cuts.push_back(begin);
+        cache.start();
+        misses = 0;
+        for (int i=begin, start=begin; i<end; i++) {
+            misses += cache.face(model, order[i]);
+            if (misses <= limit*(i+1-start) && i+1<end) {
+                cuts.push_back(i+1);
+                start = i+1;
+                misses = 0;
+                cache.start();
+            }
+        }
+        // a tail worse than the limit goes with the piece before it
+        if (cuts.size()>first_cut+1 && misses > limit*(end-cuts.back())) cuts.pop_back();
+    }
+    cuts.push_back(n);
+
+    // area weighted centroid and normal per cluster
+    const int nclusters = cuts.size()-1;
+    std::vector<Vec3f> centroid(nclusters, Vec3f(0,0,0)), normal(nclusters, Vec3f(0,0,0));
+    Vec3f mesh_centroid(0,0,0);
+    float mesh_area = 0;
+    for (int c=0; c<nclusters; c++) {
+        float area = 0;
+        for (int i=cuts[c]; i<cuts[c+1]; i++) {
+            Vec3f a = model.vert(order[i], 0), b = model.vert(order[i], 1), d = model.vert(order[i], 2);
+            Vec3f n = cross(b-a, d-a);
+            float A = n.norm();
+            centroid[c] = centroid[c] + (a+b+d)*(A/3);
+            normal[c] = normal[c] + n;
+            area += A;
+        }
+        mesh_centroid = mesh_centroid + centroid[c];
+        mesh_area += area;
+        if (area>0) centroid[c] = centroid[c]*(1/area);
+        if (normal[c].norm()>0) normal[c].normalize();
+    }
+    if (mesh_area>0) mesh_centroid = mesh_centroid*(1/mesh_area);
+    std::vector<float> key(nclusters);
+    std::vector<int> sorted(nclusters);
+    for (int c=0; c<nclusters; c++) {
+        key[c] = (centroid[c]-mesh_centroid)*normal[c];
+        sorted[c] = c;
+    }
+    std::stable_sort(sorted.begin(), sorted.end(), [&key](int a, int b) { return key[a]>key[b]; }); // outermost first
+
+    std::vector<int> out;
+    out.reserve(n);
+    for (int c=0; c<nclusters; c++) out.insert(out.end(), order.begin()+cuts[sorted[c]], order.begin()+cuts[sorted[c]+1]);
+    order.swap(out);
+    std::cerr << "overdraw: " << hard.size()-1 << " cache restarts, " << nclusters << " clusters" << std::endl;
+}
+
+bool optimize_mesh(const char *in_obj, const char *out_obj) {
+    TRACE_SCOPE("optimize_mesh");
+    Model model(in_obj, false);
+    if (!model.nfaces()) {
+        std::cerr << "no faces in " << in_obj << std::endl;
+        return false;
+    }
+    std::vector<int> identity(model.nfaces());
+    for (int i=0; i<model.nfaces(); i++) identity[i] = i;
+    std::vector<int> order = optimize_vertex_cache(model);
+    float acmr_in = vertex_cache_miss_ratio(model, identity), acmr_cache = vertex_cache_miss_ratio(model, order);
+    optimize_overdraw(model, order);
+    std::cerr << "ACMR " << acmr_in << " -> " << acmr_cache << " (vertex cache order) -> "
+              << vertex_cache_miss_ratio(model, order) << " (overdraw order)" << std::endl;
+    model.reorder_faces(order);
+    std::string out = out_obj ? out_obj : std::string(in_obj).substr(0, std::string(in_obj).find_last_of(".")) + ".opt.obj";
+    if (!model.save_obj(out.c_str())) return false;
+    std::cerr << "mesh " << out << " written" << std::endl;
+    return true;
+}
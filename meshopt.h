@@ -0,0 +1,24 @@
+#ifndef __MESHOPT_H__
+#define __MESHOPT_H__
+#include <vector>
+#include "model.h"
+
+// Offline triangle reordering, run once per mesh (./main --optimize-mesh).
+// First for vertex reuse: Forsyth's greedy cache optimization, each next face
+// the one whose vertices score best for a recently-used position and few
+// remaining faces. Then for overdraw: that order is cut into clusters where
+// the cache restarts, and clusters on the outside of the mesh facing away
+// from its center go first. From most directions they are the front, so their
+// pixels are shaded before what they hide and early-Z rejects the rest.
+
+// average vertices transformed per face through a FIFO post-transform cache (ACMR)
+float vertex_cache_miss_ratio(Model &model, const std::vector<int> &order, int cache_size=32);
+std::vector<int> optimize_vertex_cache(Model &model, int cache_size=32);
+// reorders clusters of a vertex cache order; threshold: how much worse than its cluster's ACMR a cut may make a prefix
+void optimize_overdraw(Model &model, std::vector<int> &order, int cache_size=32, float threshold=1.05f);
+
+// both, on in_obj, written to out_obj (by default in_obj's name with .opt.obj,
+// which Model loads in place of in_obj)
+bool optimize_mesh(const char *in_obj, const char *out_obj);
+
+#endif //__MESHOPT_H__
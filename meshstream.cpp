@@ -0,0 +1,293 @@
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <unordered_map>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "meshstream.h"
+#include "quantize.h"
+#include "trace.h"
+
+static const char MAGIC[8] = {'M','S','T','R','E','A','M','\0'};
+static const uint32_t VERSION = 2;
+static const size_t V1_HEADER = offsetof(MeshStreamHeader, flags); // version 1 ends there, float chunks only
+static const size_t PAGE = 4096;
+
+static size_t page_align(size_t n) {
+    return (n+PAGE-1) & ~(PAGE-1);
+}
+
+static size_t chunk_bytes(int nverts, int nfaces, bool quantized) {
+    return (size_t)nverts*(quantized ? 5*sizeof(uint16_t) : sizeof(Vec3f)+sizeof(Vec2f)) + (size_t)nfaces*3*sizeof(uint16_t);
+}
+
+bool mesh_stream_build(const char *obj_filename, const char *stream_filename, bool quantized) {
+    TRACE_SCOPE("mesh_stream_build");
+    Model model(obj_filename); // with --use-optimized, an .opt.obj keeps its vertex cache order inside the chunks
+    const int nfaces = model.nfaces();
+    if (!nfaces) {
+        std::cerr << "no faces in " << obj_filename << std::endl;
+        return false;
+    }
+    // median splits down to ranges of at most CHUNK_FACES faces
+    std::vector<int> faces(nfaces);
+    std::vector<Vec3f> centroid(nfaces);
+    for (int i=0; i<nfaces; i++) {
+        faces[i] = i;
+        centroid[i] = (model.vert(i, 0) + model.vert(i, 1) + model.vert(i, 2))*(1/3.f);
+    }
+    std::vector<std::pair<int, int> > ranges, todo(1, std::make_pair(0, nfaces));
+    while (!todo.empty()) {
+        std::pair<int, int> r = todo.back();
+        todo.pop_back();
+        if (r.second-r.first<=MeshStream::CHUNK_FACES) {
+            std::sort(faces.begin()+r.first, faces.begin()+r.second); // back to model order
+            ranges.push_back(r);
+            continue;
+        }
+        Vec3f lo = centroid[faces[r.first]], hi = lo;
+        for (int i=r.first; i<r.second; i++) {
+            for (int k=0; k<3; k++) {
+                lo[k] = std::min(lo[k], centroid[faces[i]][k]);
+                hi[k] = std::max(hi[k], centroid[faces[i]][k]);
+            }
+        }
+        int axis = 0;
+        for (int k=1; k<3; k++) if (hi[k]-lo[k] > hi[axis]-lo[axis]) axis = k;
+        int mid = (r.first+r.second)/2;
+        std::nth_element(faces.begin()+r.first, faces.begin()+mid, faces.begin()+r.second,
+                         [&centroid, axis](int a, int b) { return centroid[a][axis]<centroid[b][axis]; });
+        todo.push_back(std::make_pair(mid, r.second));
+        todo.push_back(std::make_pair(r.first, mid));
+    }
+
+    std::ofstream out(stream_filename, std::ios::binary);
+    if (!out) {
+        std::cerr << "can't open " << stream_filename << std::endl;
+        return false;
+    }
+    MeshStreamHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.nchunks = ranges.size();
+    header.nfaces = nfaces;
+    header.flags = quantized ? MESH_QUANTIZED : 0;
+    Vec3f lo, hi;
+    model.bounds(lo, hi);
+    Vec3f step(quant_step(lo.x, hi.x), quant_step(lo.y, hi.y), quant_step(lo.z, hi.z));
+    for (int i=0; i<nfaces; i++) {
+        for (int j=0; j<3; j++) {
+            Vec2f uv = model.uv(i, j);
+            for (int k=0; k<2; k++) {
+                header.uv_lo[k] = i||j ? std::min(header.uv_lo[k], uv[k]) : uv[k];
+                header.uv_hi[k] = i||j ? std::max(header.uv_hi[k], uv[k]) : uv[k];
+            }
+        }
+    }
+    Vec2f uv_step(quant_step(header.uv_lo[0], header.uv_hi[0]), quant_step(header.uv_lo[1], header.uv_hi[1]));
+    float max_error = 0;
+    std::vector<MeshChunkInfo> chunks(ranges.size());
+    size_t offset = page_align(sizeof(header) + chunks.size()*sizeof(MeshChunkInfo));
+    out.seekp(offset);
+    // each chunk gets its own copy of the (position, uv) pairs its faces use
+    std::unordered_map<uint64_t, int> local;
+    std::vector<Vec3f> verts;
+    std::vector<Vec2f> uvs;
+    std::vector<uint16_t> indices, qverts, quvs;
+    std::vector<char> padding(PAGE, 0);
+    for (size_t c=0; c<ranges.size(); c++) {
+        local.clear();
+        verts.clear();
+        uvs.clear();
+        indices.clear();
+        MeshChunkInfo &info = chunks[c];
+        for (int i=ranges[c].first; i<ranges[c].second; i++) {
+            for (int j=0; j<3; j++) {
+                uint64_t key = (uint64_t)model.vert_index(faces[i], j)<<32 | (uint32_t)model.uv_index(faces[i], j);
+                std::unordered_map<uint64_t, int>::iterator it = local.find(key);
+                if (it==local.end()) {
+                    it = local.insert(std::make_pair(key, (int)verts.size())).first;
+                    verts.push_back(model.vert(faces[i], j));
+                    uvs.push_back(model.uv(faces[i], j));
+                }
+                indices.push_back(it->second);
+            }
+        }
+        info.offset = offset;
+        info.nverts = verts.size();
+        info.nfaces = ranges[c].second-ranges[c].first;
+        info.bytes = chunk_bytes(info.nverts, info.nfaces, quantized);
+        for (int k=0; k<3; k++) {
+            info.lo[k] = info.hi[k] = verts[0][k];
+            for (size_t v=1; v<verts.size(); v++) {
+                info.lo[k] = std::min(info.lo[k], verts[v][k]);
+                info.hi[k] = std::max(info.hi[k], verts[v][k]);
+            }
+            header.lo[k] = c ? std::min(header.lo[k], info.lo[k]) : info.lo[k];
+            header.hi[k] = c ? std::max(header.hi[k], info.hi[k]) : info.hi[k];
+        }
+        header.max_chunk_verts = std::max(header.max_chunk_verts, info.nverts);
+        header.max_chunk_bytes = std::max(header.max_chunk_bytes, (uint32_t)page_align(info.bytes));
+        if (quantized) {
+            qverts.resize(verts.size()*3);
+            quvs.resize(uvs.size()*2);
+            for (size_t v=0; v<verts.size(); v++) {
+                Vec3f d;
+                for (int k=0; k<3; k++) {
+                    qverts[3*v+k] = quantize_unorm16(verts[v][k], lo[k], step[k]);
+                    d[k] = dequantize_unorm16(qverts[3*v+k], lo[k], step[k]) - verts[v][k];
+                }
+                max_error = std::max(max_error, d.norm());
+                for (int k=0; k<2; k++) quvs[2*v+k] = quantize_unorm16(uvs[v][k], header.uv_lo[k], uv_step[k]);
+            }
+            out.write((const char *)qverts.data(), qverts.size()*sizeof(uint16_t)); // the uvs after them pad the SIMD loads
+            out.write((const char *)quvs.data(), quvs.size()*sizeof(uint16_t));
+        } else {
+            out.write((const char *)verts.data(), verts.size()*sizeof(Vec3f));
+            out.write((const char *)uvs.data(), uvs.size()*sizeof(Vec2f));
+        }
+        out.write((const char *)indices.data(), indices.size()*sizeof(uint16_t));
+        out.write(padding.data(), page_align(info.bytes)-info.bytes);
+        offset += page_align(info.bytes);
+    }
+    out.seekp(0);
+    out.write((const char *)&header, sizeof(header));
+    out.write((const char *)chunks.data(), chunks.size()*sizeof(MeshChunkInfo));
+    out.close();
+    if (out.fail()) {
+        std::cerr << "can't write " << stream_filename << std::endl;
+        return false;
+    }
+    std::cerr << "stream " << stream_filename << ": " << nfaces << " faces in " << chunks.size() << " chunks, "
+              << (offset>>20) << " MB, chunks up to " << (header.max_chunk_bytes>>10) << " KB";
+    if (quantized) std::cerr << ", quantized, max position error " << max_error;
+    std::cerr << std::endl;
+    return true;
+}
+
+MeshStream::MeshStream() : fd_(-1), map_(NULL), map_size_(0), header_(), chunks_(), material_(NULL), window_(0), pending_(),
+    bytes_streamed_(0), chunks_streamed_(0), stall_ms_(0) {
+}
+
+MeshStream::~MeshStream() {
+    for (size_t i=0; i<pending_.size(); i++) if (pending_[i]) JobSystem::instance().wait(pending_[i]);
+    if (map_) munmap((void *)map_, map_size_);
+    if (fd_>=0) close(fd_);
+    delete material_;
+}
+
+bool MeshStream::open(const char *filename, size_t budget) {
+    TRACE_SCOPE("open_stream");
+    fd_ = ::open(filename, O_RDONLY);
+    struct stat st;
+    if (fd_<0 || fstat(fd_, &st)) {
+        std::cerr << "can't open " << filename << std::endl;
+        return false;
+    }
+    map_size_ = st.st_size;
+    if (map_size_<sizeof(header_)) {
+        std::cerr << filename << " is not a mesh stream" << std::endl;
+        return false;
+    }
+    void *p = mmap(NULL, map_size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+    if (p==MAP_FAILED) {
+        std::cerr << "can't map " << filename << std::endl;
+        return false;
+    }
+    map_ = (const unsigned char *)p;
+    madvise(p, map_size_, MADV_RANDOM); // chunks are read in view order, the read-ahead is ours
+    memcpy(&header_, map_, sizeof(header_));
+    size_t header_size = sizeof(header_);
+    if (header_.version==1) {
+        header_size = V1_HEADER;
+        memset((char *)&header_ + V1_HEADER, 0, sizeof(header_)-V1_HEADER);
+    }
+    if (memcmp(header_.magic, MAGIC, sizeof(MAGIC)) || header_.version<1 || header_.version>VERSION ||
+        header_size + (uint64_t)header_.nchunks*sizeof(MeshChunkInfo) > map_size_) {
+        std::cerr << filename << " is not a mesh stream (version " << VERSION << " or before)" << std::endl;
+        return false;
+    }
+    chunks_.resize(header_.nchunks);
+    memcpy(chunks_.data(), map_+header_size, chunks_.size()*sizeof(MeshChunkInfo));
+    madvise(p, page_align(header_size + chunks_.size()*sizeof(MeshChunkInfo)), MADV_DONTNEED); // copied
+    for (size_t i=0; i<chunks_.size(); i++) {
+        const MeshChunkInfo &c = chunks_[i];
+        if (c.offset%PAGE || c.offset+c.bytes>map_size_ || c.bytes!=chunk_bytes(c.nverts, c.nfaces, quantized()) ||
+            c.nverts>header_.max_chunk_verts || page_align(c.bytes)>header_.max_chunk_bytes) {
+            std::cerr << filename << ": bad chunk " << i << std::endl;
+            return false;
+        }
+    }
+    window_ = std::max((size_t)2, budget/std::max((size_t)1, (size_t)header_.max_chunk_bytes));
+    window_ = std::min(window_, std::max(1, nchunks()));
+    pending_.assign(window_, NULL);
+    material_ = new Model(filename, true, false);
+    std::cerr << "stream " << filename << ": " << header_.nfaces << " faces in " << chunks_.size() << (quantized() ? " quantized" : "")
+              << " chunks, " << window_ << " resident (" << ((size_t)window_*header_.max_chunk_bytes>>10) << " KB)" << std::endl;
+    return true;
+}
+
+void MeshStream::prefetch(int slot, int chunk) {
+    const MeshChunkInfo &c = chunks_[chunk];
+    madvise((void *)(map_+c.offset), c.bytes, MADV_WILLNEED); // the kernel starts reading
+    const unsigned char *begin = map_+c.offset, *end = begin+c.bytes;
+    JobSystem &jobs = JobSystem::instance();
+    pending_[slot] = jobs.create([begin, end]() { // and a job waits for it, off the render thread
+        TRACE_SCOPE("stream_read_ahead");
+        unsigned sum = 0;
+        for (const volatile unsigned char *p=begin; p<end; p+=PAGE) sum += *p;
+        (void)sum;
+    });
+    jobs.submit(pending_[slot]);
+}
+
+MeshChunk MeshStream::acquire(int slot, int chunk) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    JobSystem::instance().wait(pending_[slot]);
+    pending_[slot] = NULL;
+    stall_ms_ += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now()-start).count();
+    const MeshChunkInfo &c = chunks_[chunk];
+    MeshChunk m;
+    m.verts = NULL;
+    m.uvs = NULL;
+    m.qverts = m.quvs = NULL;
+    m.nverts = c.nverts;
+    m.nfaces = c.nfaces;
+    if (quantized()) {
+        const MeshStreamHeader &h = header_;
+        m.qverts = (const uint16_t *)(map_+c.offset);
+        m.quvs = m.qverts+3*c.nverts;
+        m.indices = m.quvs+2*c.nverts;
+        for (int k=0; k<3; k++) {
+            m.lo[k] = h.lo[k];
+            m.step[k] = quant_step(h.lo[k], h.hi[k]);
+        }
+        for (int k=0; k<2; k++) {
+            m.uv_lo[k] = h.uv_lo[k];
+            m.uv_step[k] = quant_step(h.uv_lo[k], h.uv_hi[k]);
+        }
+    } else {
+        m.verts = (const Vec3f *)(map_+c.offset);
+        m.uvs = (const Vec2f *)(m.verts+c.nverts);
+        m.indices = (const uint16_t *)(m.uvs+c.nverts);
+    }
+    bytes_streamed_ += c.bytes;
+    chunks_streamed_++;
+    return m;
+}
+
+void MeshStream::release(int chunk) {
+    const MeshChunkInfo &c = chunks_[chunk];
+    madvise((void *)(map_+c.offset), c.bytes, MADV_DONTNEED); // unmodified file pages: read again on the next touch
+}
+
+void MeshStream::report(std::ostream &out) {
+    out << "mesh stream: " << chunks_streamed_ << " chunks, " << (bytes_streamed_>>20) << " MB streamed through a window of "
+        << window_ << " chunks, " << stall_ms_ << " ms waiting for read-ahead" << std::endl;
+}
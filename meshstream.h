@@ -0,0 +1,114 @@
+#ifndef __MESHSTREAM_H__
+#define __MESHSTREAM_H__
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <vector>
+#include "geometry.h"
+#include "jobs.h"
+#include "model.h"
+
+// Out-of-core meshes. ./main --make-stream in.obj [out.mstream] cuts a model's
+// faces into spatially compact chunks (median splits of the face centroids
+// along the widest axis, at most CHUNK_FACES faces each) and writes them to a
+// binary file: the header, the chunk table with each chunk's box, then the
+// chunks, page aligned, each with its own vertex positions, uvs and 16-bit
+// indices. Nothing is parsed at render time: the file is mmapped and chunks
+// are used where they lie. The textures are those a model of the same name
+// would have. Little endian, as written. With --quantize the chunks hold the
+// quantized attributes of quantize.h as they are, positions over the box of
+// the whole mesh so that chunks sharing a vertex decode it alike, uvs over
+// uv_lo/uv_hi (version 2, MESH_QUANTIZED).
+enum { MESH_QUANTIZED = 1 };
+
+struct MeshStreamHeader {
+    char magic[8];        // "MSTREAM"
+    uint32_t version;
+    uint32_t nchunks;
+    uint64_t nfaces;
+    float lo[3], hi[3];   // object space box around every chunk
+    uint32_t max_chunk_verts;
+    uint32_t max_chunk_bytes;
+    // version 2
+    uint32_t flags;
+    float uv_lo[2], uv_hi[2];
+};
+
+struct MeshChunkInfo {
+    uint64_t offset;      // in the file, a multiple of the page size
+    uint32_t bytes;
+    uint32_t nverts, nfaces;
+    float lo[3], hi[3];
+};
+
+// a chunk while it is resident: its arrays inside the mapping, float or quantized
+struct MeshChunk {
+    const Vec3f *verts;
+    const Vec2f *uvs;
+    const uint16_t *qverts;  // instead of verts and uvs in a quantized stream: 3 per vertex,
+    const uint16_t *quvs;    // 2 per vertex, coordinates lo + q*step
+    Vec3f lo, step;
+    Vec2f uv_lo, uv_step;
+    const uint16_t *indices; // three per face
+    int nverts, nfaces;
+    Vec2f uv(int v) const {
+        if (!quvs) return uvs[v];
+        return Vec2f(uv_lo.x + quvs[2*v]*uv_step.x, uv_lo.y + quvs[2*v+1]*uv_step.y);
+    }
+};
+
+bool mesh_stream_build(const char *obj_filename, const char *stream_filename, bool quantized=false);
+
+// A mapped .mstream. stream() hands chunks to a draw callback through a window
+// that keeps at most budget bytes of them resident: while one is drawn, jobs
+// fault in the ones after it (read-ahead), and each is dropped from memory
+// once drawn. Peak memory is the window plus the chunk table, whatever the
+// mesh size. Used by one render thread at a time.
+class MeshStream {
+public:
+    static const int CHUNK_FACES = 4096;
+    MeshStream();
+    ~MeshStream();
+    bool open(const char *filename, size_t budget=64<<20);
+    int nchunks() const { return (int)chunks_.size(); }
+    const MeshChunkInfo &info(int i) const { return chunks_[i]; }
+    uint64_t nfaces() const { return header_.nfaces; }
+    bool quantized() const { return header_.flags & MESH_QUANTIZED; }
+    const MeshStreamHeader &header() const { return header_; }
+    int max_chunk_verts() const { return header_.max_chunk_verts; }
+    int window() const { return window_; }
+    Model &material() { return *material_; }      // the textures, no faces
+    uint64_t geometry_version() const { return material_->geometry_version(); } // unique per opened stream
+    // draw(const MeshChunk &) for the chunks order[0, n), in that order, on the calling thread
+    template <typename F> void stream(const int *order, int n, const F &draw);
+    void report(std::ostream &out); // since open()
+private:
+    void prefetch(int slot, int chunk); // queues the read-ahead job of slot
+    MeshChunk acquire(int slot, int chunk); // waits for it
+    void release(int chunk);            // drops its pages
+    MeshStream(const MeshStream &);
+    MeshStream &operator=(const MeshStream &);
+
+    int fd_;
+    const unsigned char *map_;
+    size_t map_size_;
+    MeshStreamHeader header_;
+    std::vector<MeshChunkInfo> chunks_;
+    Model *material_;
+    int window_;                  // chunks resident at once
+    std::vector<Task *> pending_; // read-ahead per window slot
+    uint64_t bytes_streamed_, chunks_streamed_;
+    double stall_ms_;             // waiting for read-ahead that was not done yet
+};
+
+template <typename F> void MeshStream::stream(const int *order, int n, const F &draw) {
+    for (int i=0; i<std::min(n, window_); i++) prefetch(i, order[i]);
+    for (int i=0; i<n; i++) {
+        int slot = i%window_;
+        draw(acquire(slot, order[i]));
+        release(order[i]);
+        if (i+window_<n) prefetch(slot, order[i+window_]);
+    }
+}
+
+#endif //__MESHSTREAM_H__
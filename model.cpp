@@ -1,14 +1,61 @@
+#include <algorithm>
+#include <atomic>
+#include <cstring>
 #include <iostream>
 #include <string>
 #include <fstream>
+#include <iomanip>
 #include <sstream>
 #include <vector>
+#include <sys/stat.h>
 #include "model.h"
+#include "quantize.h"
+#include "trace.h"
 
-Model::Model(const char *filename) : verts_(), faces_(),norms_(), diffusemap_(), normalmap_(), specularmap_() {
+static std::atomic<uint64_t> geometry_versions(0);
+static std::atomic<int> quantize_on_load(0);
+static std::atomic<bool> use_optimized(false);
+
+void Model::set_quantization(int normal_bits) {
+    quantize_on_load = normal_bits;
+}
+
+void Model::set_use_optimized(bool on) {
+    use_optimized = on;
+}
+
+// <name>.opt.obj next to filename, empty when there is none or it is older than filename
+static std::string optimized_file(const char *filename) {
+    std::string base(filename);
+    base = base.substr(0, base.find_last_of("."));
+    if (base.size()>4 && !base.compare(base.size()-4, 4, ".opt")) return "";
+    std::string opt = base + ".opt.obj";
+    struct stat src_st, opt_st;
+    if (stat(opt.c_str(), &opt_st) || stat(filename, &src_st)) return "";
+    if (opt_st.st_mtime<src_st.st_mtime) {
+        std::cerr << "ignoring " << opt << ", older than " << filename << std::endl;
+        return "";
+    }
+    return opt;
+}
+
+Model::Model(const char *filename, bool optimized, bool geometry) : verts_(), faces_(),norms_(), diffusemap_(), normalmap_(), specularmap_(), aomap_(), version_(++geometry_versions),
+    bbox_min_(0,0,0), bbox_max_(0,0,0), clusters_(), normal_bits_(0), qverts_(), quvs_(), qnorms_(), qlo_(), qstep_(), uv_lo_(), uv_step_(),
+    quant_error_(0) {
+    TRACE_SCOPE("load_model");
+    if (!geometry) {
+        load_textures(filename);
+        return;
+    }
     std::ifstream in;
-    in.open (filename, std::ifstream::in);
+    std::string opt = optimized && use_optimized ? optimized_file(filename) : std::string();
+    if (!opt.empty()) {
+        in.open(opt.c_str(), std::ifstream::in);
+        if (in.is_open()) std::cerr << "loading " << opt << " in place of " << filename << std::endl;
+    }
+    if (!in.is_open()) in.open (filename, std::ifstream::in);
     if (in.fail()) return;
+    load_textures(filename); // first, so that with prefetching on the textures decode while the geometry parses
     std::string line;
     while (!in.eof()) {
         std::getline(in, line);
@@ -43,64 +90,294 @@ Model::Model(const char *filename) : verts_(), faces_(),norms_(), diffusemap_(),
             norms_.push_back(n);
         }
     }
+    if (!verts_.empty()) bbox_min_ = bbox_max_ = verts_[0];
+    for (size_t i=1; i<verts_.size(); i++) {
+        for (int k=0; k<3; k++) {
+            bbox_min_[k] = std::min(bbox_min_[k], verts_[i][k]);
+            bbox_max_[k] = std::max(bbox_max_[k], verts_[i][k]);
+        }
+    }
+    build_clusters();
     std::cerr << "# v# " << verts_.size() << " f# "  << faces_.size() << std::endl;
+    if (quantize_on_load) quantize(quantize_on_load);
+}
+
+Model::~Model() {
+}
+
+void Model::load_textures(const char *filename) {
     load_texture(filename, "_diffuse.tga", diffusemap_);
    //load_texture(filename, "_nm.tga",      normalmap_);
     load_texture(filename, "_nm_tangent.tga",      normalmap_);
     load_texture(filename, "_spec.tga",    specularmap_);
+    std::string aofile = std::string(filename).substr(0, std::string(filename).find_last_of(".")) + "_ao.tga";
+    if (std::ifstream(aofile.c_str()).good()) load_texture(filename, "_ao.tga", aomap_); // optional, unlike the others
 }
 
-Model::~Model() {
+int Model::nverts() {
+    return normal_bits_ ? (int)qverts_.size()/3 : (int)verts_.size();
 }
 
-int Model::nverts() {
-    return (int)verts_.size();
+int Model::nuvs() const {
+    return normal_bits_ ? (int)quvs_.size()/2 : (int)text_coords_.size();
+}
+
+int Model::nnorms() const {
+    return normal_bits_ ? (int)qnorms_.size()/(normal_bits_/4) : (int)norms_.size();
+}
+
+Vec3f Model::position(int i) const {
+    if (!normal_bits_) return verts_[i];
+    const uint16_t *q = &qverts_[3*i];
+    return Vec3f(dequantize_unorm16(q[0], qlo_.x, qstep_.x), dequantize_unorm16(q[1], qlo_.y, qstep_.y), dequantize_unorm16(q[2], qlo_.z, qstep_.z));
+}
+
+Vec2f Model::tex_coord(int i) const {
+    if (!normal_bits_) return text_coords_[i];
+    return Vec2f(dequantize_unorm16(quvs_[2*i], uv_lo_.x, uv_step_.x), dequantize_unorm16(quvs_[2*i+1], uv_lo_.y, uv_step_.y));
+}
+
+Vec3f Model::norm(int i) const {
+    if (!normal_bits_) return norms_[i];
+    int16_t x, y;
+    if (normal_bits_==8) {
+        x = (int8_t)qnorms_[2*i];
+        y = (int8_t)qnorms_[2*i+1];
+    } else {
+        memcpy(&x, &qnorms_[4*i], 2);
+        memcpy(&y, &qnorms_[4*i+2], 2);
+    }
+    return oct_decode(x, y, normal_bits_);
 }
 
 int Model::nfaces() {
     return (int)faces_.size();
 }
 Vec3f Model::vert(int i) {
-    return verts_[i];
+    return position(i);
 }
 Vec3f Model::vert(int iface, int nthvert) {
-    int id = faces_[iface][nthvert][0];
-    return verts_[id];
+    return position(faces_[iface][nthvert][0]);
+}
+int Model::vert_index(int iface, int nthvert) {
+    return faces_[iface][nthvert][0];
+}
+int Model::uv_index(int iface, int nthvert) {
+    return faces_[iface][nthvert][1];
+}
+void Model::transform_verts(const Mat4f &M, Vec3f *out, int begin, int end) {
+    if (normal_bits_) transform_quantized_points(dequantize_matrix(M, qlo_, qstep_), qverts_.data()+3*begin, out, end-begin);
+    else transform_points(M, verts_.data()+begin, out, end-begin);
+}
+
+size_t Model::attribute_bytes() const {
+    return verts_.size()*sizeof(Vec3f) + text_coords_.size()*sizeof(Vec2f) + norms_.size()*sizeof(Vec3f)
+         + qverts_.size()*sizeof(uint16_t) + quvs_.size()*sizeof(uint16_t) + qnorms_.size();
+}
+
+size_t Model::bytes() const {
+    return verts_.capacity()*sizeof(Vec3f) + text_coords_.capacity()*sizeof(Vec2f) + norms_.capacity()*sizeof(Vec3f)
+         + qverts_.capacity()*sizeof(uint16_t) + quvs_.capacity()*sizeof(uint16_t) + qnorms_.capacity()
+         + faces_.capacity()*sizeof(std::vector<Vec3i>) + faces_.size()*3*sizeof(Vec3i) + clusters_.capacity()*sizeof(FaceCluster);
+}
+
+void Model::quantize(int normal_bits) {
+    if (normal_bits_ || (normal_bits!=8 && normal_bits!=16)) return;
+    TRACE_SCOPE("quantize_model");
+    const size_t float_bytes = attribute_bytes();
+    qlo_ = bbox_min_;
+    for (int k=0; k<3; k++) qstep_[k] = quant_step(bbox_min_[k], bbox_max_[k]);
+    qverts_.resize(verts_.size()*3 + 1);
+    qverts_.back() = 0;
+    quant_error_ = 0;
+    for (size_t i=0; i<verts_.size(); i++) {
+        Vec3f d;
+        for (int k=0; k<3; k++) {
+            qverts_[3*i+k] = quantize_unorm16(verts_[i][k], qlo_[k], qstep_[k]);
+            d[k] = dequantize_unorm16(qverts_[3*i+k], qlo_[k], qstep_[k]) - verts_[i][k];
+        }
+        quant_error_ = std::max(quant_error_, d.norm());
+    }
+    Vec2f uv_hi;
+    if (!text_coords_.empty()) uv_lo_ = uv_hi = text_coords_[0];
+    for (size_t i=1; i<text_coords_.size(); i++) {
+        for (int k=0; k<2; k++) {
+            uv_lo_[k] = std::min(uv_lo_[k], text_coords_[i][k]);
+            uv_hi[k] = std::max(uv_hi[k], text_coords_[i][k]);
+        }
+    }
+    for (int k=0; k<2; k++) uv_step_[k] = quant_step(uv_lo_[k], uv_hi[k]);
+    quvs_.resize(text_coords_.size()*2);
+    for (size_t i=0; i<text_coords_.size(); i++) {
+        for (int k=0; k<2; k++) quvs_[2*i+k] = quantize_unorm16(text_coords_[i][k], uv_lo_[k], uv_step_[k]);
+    }
+    const int nbytes = normal_bits/4;
+    qnorms_.resize(norms_.size()*nbytes);
+    for (size_t i=0; i<norms_.size(); i++) {
+        int16_t x, y;
+        oct_encode(norms_[i], normal_bits, x, y);
+        if (normal_bits==8) {
+            qnorms_[2*i] = (unsigned char)(int8_t)x;
+            qnorms_[2*i+1] = (unsigned char)(int8_t)y;
+        } else {
+            memcpy(&qnorms_[4*i], &x, 2);
+            memcpy(&qnorms_[4*i+2], &y, 2);
+        }
+    }
+    std::vector<Vec3f>().swap(verts_);
+    std::vector<Vec2f>().swap(text_coords_);
+    std::vector<Vec3f>().swap(norms_);
+    normal_bits_ = normal_bits;
+    if (nverts()) std::cerr << "# quantized: " << (double)float_bytes/nverts() << " -> " << (double)attribute_bytes()/nverts()
+                            << " attribute bytes per vertex, max position error " << quant_error_ << std::endl;
+}
+
+void Model::bounds(Vec3f &lo, Vec3f &hi) const {
+    lo = bbox_min_;
+    hi = bbox_max_;
+}
+
+void Model::build_clusters() {
+    clusters_.clear();
+    for (int begin=0; begin<nfaces(); begin+=CLUSTER_FACES) {
+        FaceCluster c;
+        c.begin = begin;
+        c.end = std::min(nfaces(), begin+CLUSTER_FACES);
+        c.lo = c.hi = vert(begin, 0);
+        for (int i=c.begin; i<c.end; i++) {
+            for (int j=0; j<3; j++) {
+                Vec3f v = vert(i, j);
+                for (int k=0; k<3; k++) {
+                    c.lo[k] = std::min(c.lo[k], v[k]);
+                    c.hi[k] = std::max(c.hi[k], v[k]);
+                }
+            }
+        }
+        clusters_.push_back(c);
+    }
+}
+
+int Model::nclusters() const {
+    return (int)clusters_.size();
+}
+
+const FaceCluster &Model::cluster(int i) const {
+    return clusters_[i];
+}
+
+// the elements of v renumbered by remap, stride values each
+template <typename T> static void renumber(std::vector<T> &v, const std::vector<int> &remap, int used, int stride) {
+    std::vector<T> out((size_t)used*stride);
+    for (size_t i=0; i<remap.size(); i++) {
+        if (remap[i]>=0) std::copy(v.begin()+i*stride, v.begin()+(i+1)*stride, out.begin()+(size_t)remap[i]*stride);
+    }
+    v.swap(out);
+}
+
+void Model::reorder_faces(const std::vector<int> &order) {
+    std::vector<std::vector<Vec3i> > faces(order.size());
+    for (size_t i=0; i<order.size(); i++) faces[i] = faces_[order[i]];
+    // renumber each attribute in the order the faces first use it
+    std::vector<int> remap[3] = {std::vector<int>(nverts(), -1), std::vector<int>(nuvs(), -1), std::vector<int>(nnorms(), -1)};
+    int used[3] = {0, 0, 0};
+    for (size_t i=0; i<faces.size(); i++) {
+        for (size_t j=0; j<faces[i].size(); j++) {
+            for (int k=0; k<3; k++) {
+                int &idx = faces[i][j][k];
+                if (remap[k][idx]<0) remap[k][idx] = used[k]++;
+                idx = remap[k][idx];
+            }
+        }
+    }
+    faces_.swap(faces);
+    if (normal_bits_) {
+        renumber(qverts_, remap[0], used[0], 3);
+        qverts_.push_back(0); // padding
+        renumber(quvs_, remap[1], used[1], 2);
+        renumber(qnorms_, remap[2], used[2], normal_bits_/4);
+    } else {
+        renumber(verts_, remap[0], used[0], 1);
+        renumber(text_coords_, remap[1], used[1], 1);
+        renumber(norms_, remap[2], used[2], 1);
+    }
+    version_ = ++geometry_versions;
+    build_clusters();
+}
+
+bool Model::save_obj(const char *filename) {
+    std::ofstream out(filename);
+    if (!out) {
+        std::cerr << "can't open " << filename << std::endl;
+        return false;
+    }
+    out << std::setprecision(9); // floats read back exactly
+    for (int i=0; i<nverts(); i++) out << "v " << position(i).x << " " << position(i).y << " " << position(i).z << "\n";
+    for (int i=0; i<nuvs(); i++) out << "vt " << tex_coord(i).x << " " << tex_coord(i).y << " 0\n";
+    for (int i=0; i<nnorms(); i++) out << "vn " << norm(i).x << " " << norm(i).y << " " << norm(i).z << "\n";
+    for (size_t i=0; i<faces_.size(); i++) {
+        out << "f";
+        for (size_t j=0; j<faces_[i].size(); j++) out << " " << faces_[i][j][0]+1 << "/" << faces_[i][j][1]+1 << "/" << faces_[i][j][2]+1;
+        out << "\n";
+    }
+    out.close();
+    return !out.fail();
+}
+
+uint64_t Model::geometry_version() const {
+    return version_;
 }
 Vec2f Model::uv(int iface, int nthvert) {
-    return text_coords_[faces_[iface][nthvert][1]];
+    return tex_coord(faces_[iface][nthvert][1]);
 }
 // void Model::load_texture(std::string filename,  TGAImage &img) {
 //     img.read_tga_file(filename.c_str());
 //     img.flip_vertically();
 // }
-void Model::load_texture(std::string filename, const char *suffix, TGAImage &img) {
+void Model::load_texture(std::string filename, const char *suffix, Texture &tex) {
+    TRACE_SCOPE_ARG("load_texture", suffix);
     std::string texfile(filename);
     size_t dot = texfile.find_last_of(".");
     if (dot!=std::string::npos) {
         texfile = texfile.substr(0,dot) + std::string(suffix);
-        std::cerr << "texture file " << texfile << " loading " << (img.read_tga_file(texfile.c_str()) ? "ok" : "failed") << std::endl;
-        img.flip_vertically();
+        // a pre-tiled .vtex next to the .tga is preferred, it is sampled as a virtual texture
+        std::string vtexfile = texfile.substr(0, texfile.find_last_of(".")) + ".vtex";
+        if (std::ifstream(vtexfile.c_str()).good()) texfile = vtexfile;
+        tex = TextureCache::instance().acquire(texfile);
     }
 }
-TGAColor Model::diffuse(Vec2f uvf) {
-    Vec2i uv(uvf[0]*diffusemap_.get_width(), uvf[1]*diffusemap_.get_height());
-    return diffusemap_.get(uv[0], uv[1]);
+TGAColor Model::diffuse(Vec2f uvf, float uv_lod) {
+    return diffusemap_.get(uvf, uv_lod);
 }
 Vec3f Model::normal(int iface, int nthvert) {
-    int idx = faces_[iface][nthvert][2];
-    return norms_[idx].normalize();
+    Vec3f n = norm(faces_[iface][nthvert][2]);
+    return n.normalize();
 }
-Vec3f Model::normal(Vec2f uvf) {
-    Vec2i uv(uvf[0]*normalmap_.get_width(), uvf[1]*normalmap_.get_height());
-    TGAColor c = normalmap_.get(uv[0], uv[1]);
+Vec3f Model::normal(Vec2f uvf, float uv_lod) {
+    TGAColor c = normalmap_.get(uvf, uv_lod);
     Vec3f res;
     for (int i=0; i<3; i++)
         res[2-i] = (float)c[i]/255.f*2.f - 1.f;
     return res;
 }
 
-float Model::specular(Vec2f uvf) {
-    Vec2i uv(uvf[0]*specularmap_.get_width(), uvf[1]*specularmap_.get_height());
-    return specularmap_.get(uv[0], uv[1])[0]/1.f;
+float Model::specular(Vec2f uvf, float uv_lod) {
+    return specularmap_.get(uvf, uv_lod)[0]/1.f;
+}
+
+float Model::ambient_occlusion(Vec2f uvf, float uv_lod) {
+    return aomap_.valid() ? aomap_.get(uvf, uv_lod)[0]/255.f : 1.f;
+}
+
+void Model::decode_textures() {
+    Texture *maps[4] = {&diffusemap_, &normalmap_, &specularmap_, &aomap_};
+    for (int i=0; i<4; i++) {
+        if (maps[i]->valid() && !maps[i]->virtual_texture()) maps[i]->image();
+    }
+}
+
+void Model::report_textures(std::ostream &out) {
+    Texture *maps[4] = {&diffusemap_, &normalmap_, &specularmap_, &aomap_};
+    for (int i=0; i<4; i++) {
+        if (maps[i]->virtual_texture()) maps[i]->virtual_texture()->report(out);
+    }
 }
\ No newline at end of file
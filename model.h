@@ -2,8 +2,17 @@
 #define __MODEL_H__
 #include <vector>
 #include <string>
+#include <cstdint>
 #include "geometry.h"
 #include "tgaimage.h"
+#include "texturecache.h"
+
+// a run of consecutive faces with the object space box around them; the
+// main pass sorts them nearest first
+struct FaceCluster {
+    int begin, end; // faces
+    Vec3f lo, hi;
+};
 
 class Model {
 private:
@@ -11,24 +20,70 @@ private:
 	std::vector<Vec2f> text_coords_;
     std::vector<std::vector<Vec3i> > faces_; // attention, this Vec3i means vertex/uv/normal
 	std::vector<Vec3f> norms_;
-	TGAImage diffusemap_;
-    TGAImage normalmap_;
-    TGAImage specularmap_;
+	Texture diffusemap_;  // handles into the TextureCache, decoded on first sample
+    Texture normalmap_;
+    Texture specularmap_;
+    Texture aomap_;       // baked ambient occlusion (see aobake.h), invalid when there is none
+    uint64_t version_;
+    Vec3f bbox_min_, bbox_max_;
+    std::vector<FaceCluster> clusters_;
+    // quantized attributes (see quantize.h), in place of the float ones when normal_bits_ is set
+    int normal_bits_;                 // 8 or 16, 0 for float attributes
+    std::vector<uint16_t> qverts_;    // 3 per vertex, and one of padding for the SIMD loads
+    std::vector<uint16_t> quvs_;      // 2 per uv
+    std::vector<unsigned char> qnorms_; // 2 snorms of normal_bits_ per normal
+    Vec3f qlo_, qstep_;
+    Vec2f uv_lo_, uv_step_;
+    float quant_error_;               // largest distance of a decoded position to its float
+    void build_clusters();
+    void load_textures(const char *filename); // the maps named after filename
+    Vec3f position(int i) const;
+    Vec2f tex_coord(int i) const;
+    Vec3f norm(int i) const;
+    int nuvs() const;
+    int nnorms() const;
 public:
-	Model(const char *filename);
+    static const int CLUSTER_FACES = 32;
+	// with set_use_optimized(true), a pre-optimized <name>.opt.obj next to filename (see meshopt.h) that is
+	// not older than it is parsed in its place, unless !optimized;
+	// without geometry only the textures named after filename are loaded (the material of a MeshStream)
+	Model(const char *filename, bool optimized=true, bool geometry=true);
 	~Model();
 	int nverts();
 	int nfaces();
 	Vec3f vert(int i);
 	Vec3f vert(int iface, int nthvert);
+	int vert_index(int iface, int nthvert);
+	int uv_index(int iface, int nthvert);
+	// out[i] = M*vert(i) for the vertices [begin, end), dequantized in the same
+	// pass when quantized (the batched vertex stage)
+	void transform_verts(const Mat4f &M, Vec3f *out, int begin, int end);
+	void bounds(Vec3f &lo, Vec3f &hi) const; // object space box around the vertices
+	int nclusters() const;
+	const FaceCluster &cluster(int i) const;
+	// faces in the given order, vertices, uvs and normals renumbered by first use; a new geometry version
+	void reorder_faces(const std::vector<int> &order);
+	bool save_obj(const char *filename); // v, vt, vn and f lines, the textures are not written
+	uint64_t geometry_version() const; // unique per loaded geometry, keys derived data such as shadow maps
 	Vec2f uv(int iface, int nthvert);
-    TGAColor diffuse(Vec2f uv);
-	std::vector<int> face(int idx);
-	std::vector<int> faceUv(int iduv);
-	void load_texture(std::string filename, const char *suffix, TGAImage &img);
+    TGAColor diffuse(Vec2f uv, float uv_lod=-1e9f); // uv_lod: see Texture::get()
+	void load_texture(std::string filename, const char *suffix, Texture &tex);
 	Vec3f normal(int iface, int nthvert);
-	float specular(Vec2f uvf);
-	Vec3f normal(Vec2f uvf);//get a normal information from a tgaimage
+	float specular(Vec2f uvf, float uv_lod=-1e9f);
+	float ambient_occlusion(Vec2f uvf, float uv_lod=-1e9f); // in [0,1], 1 without an _ao.tga
+	Vec3f normal(Vec2f uvf, float uv_lod=-1e9f);//get a normal information from a tgaimage
+	void report_textures(std::ostream &out); // virtual texture residency
+	void decode_textures(); // now rather than on first sample, e.g. before fork() so that processes share them
+	size_t bytes() const;   // of the geometry and derived data, not the textures (see TextureCache)
+	// the vertex attributes to 16-bit positions and uvs and normal_bits octahedral
+	// normals (8 or 16), the float ones are dropped; accessors decode
+	void quantize(int normal_bits);
+	bool quantized() const { return normal_bits_>0; }
+	int normal_bits() const { return normal_bits_; }
+	float quantization_error() const { return quant_error_; } // largest position error, 0 when not quantized
+	size_t attribute_bytes() const; // of the vertex attributes as stored, float or quantized
+	static void set_quantization(int normal_bits); // models loaded from now on are quantized, 0 for none
+	static void set_use_optimized(bool on);        // off by default
 };
 
 #endif //__MODEL_H__
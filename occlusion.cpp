@@ -0,0 +1,130 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include "occlusion.h"
+
+static const uint64_t FULL = ~0ull;
+
+OcclusionBuffer::OcclusionBuffer() : width_(0), height_(0), cells_x_(0), cells_y_(0), samples_(1), mask_(NULL), zfar_(NULL), layer_mask_(NULL), layer_zfar_(NULL) {
+}
+
+void OcclusionBuffer::clear(int width, int height, int samples, FrameArena &arena) {
+    width_ = width;
+    height_ = height;
+    cells_x_ = (width+CELL-1)/CELL;
+    cells_y_ = (height+CELL-1)/CELL;
+    samples_ = std::max(1, samples);
+    int ncells = cells_x_*cells_y_;
+    mask_ = arena.alloc<uint64_t>(ncells*samples_);
+    zfar_ = arena.alloc<float>(ncells);
+    layer_mask_ = arena.alloc<uint64_t>(ncells*samples_);
+    layer_zfar_ = arena.alloc<float>(ncells);
+    std::fill(zfar_, zfar_+ncells, std::numeric_limits<float>::max());
+    // pixels past the right and bottom edges never get drawn, count them as covered
+    for (int cy=0; cy<cells_y_; cy++) {
+        for (int cx=0; cx<cells_x_; cx++) {
+            uint64_t outside = 0;
+            for (int y=0; y<CELL; y++) {
+                for (int x=0; x<CELL; x++) {
+                    if (cx*CELL+x>=width || cy*CELL+y>=height) outside |= 1ull<<(x+y*CELL);
+                }
+            }
+            std::fill(mask_+(cx+cy*cells_x_)*samples_, mask_+(cx+cy*cells_x_+1)*samples_, outside);
+        }
+    }
+}
+
+uint64_t OcclusionBuffer::covered(int cell) const {
+    uint64_t m = FULL;
+    for (int s=0; s<samples_; s++) m &= mask_[cell*samples_+s];
+    return m;
+}
+
+void OcclusionBuffer::rasterize(Model &model, const Vec3f *screen_verts) {
+    static const int center[1][2] = {{0, 0}};
+    const int (*pos)[2] = samples_>1 ? msaa_positions(samples_) : center;
+    const int ncells = cells_x_*cells_y_;
+    std::fill(layer_mask_, layer_mask_+ncells*samples_, 0);
+    std::fill(layer_zfar_, layer_zfar_+ncells, std::numeric_limits<float>::max());
+    Vec3f tri[3];
+    for (int i=0; i<model.nfaces(); i++) {
+        for (int j=0; j<3; j++) tri[j] = screen_verts[model.vert_index(i, j)];
+        const Vec3f &a = tri[0], &b = tri[1], &c = tri[2];
+        int x0 = std::max(0, (int)std::floor(std::min(a.x, std::min(b.x, c.x))));
+        int y0 = std::max(0, (int)std::floor(std::min(a.y, std::min(b.y, c.y))));
+        int x1 = std::min(width_-1, (int)std::ceil(std::max(a.x, std::max(b.x, c.x))));
+        int y1 = std::min(height_-1, (int)std::ceil(std::max(a.y, std::max(b.y, c.y))));
+        if (x0>x1 || y0>y1) continue;
+        float zmin = std::min(a.z, std::min(b.z, c.z));
+        for (int cy=y0/CELL; cy<=y1/CELL; cy++) {
+            for (int cx=x0/CELL; cx<=x1/CELL; cx++) {
+                int cell = cx+cy*cells_x_;
+                uint64_t full = FULL;
+                for (int s=0; s<samples_; s++) full &= layer_mask_[cell*samples_+s];
+                if (full==FULL) continue;
+                int px0 = std::max(x0, cx*CELL), px1 = std::min(x1, cx*CELL+CELL-1);
+                int py0 = std::max(y0, cy*CELL), py1 = std::min(y1, cy*CELL+CELL-1);
+                bool added = false;
+                for (int s=0; s<samples_; s++) {
+                    uint64_t bits = 0;
+                    for (int y=py0; y<=py1; y++) {
+                        for (int x=px0; x<=px1; x++) {
+                            // the very test triangle() and triangle_msaa() make, so the bits match what they draw
+                            Vec3f bc = barycentric(tri, samples_>1 ? Vec3f(x+pos[s][0]/16.f, y+pos[s][1]/16.f, 0) : Vec3f(x, y, 0));
+                            if (bc.x>=0 && bc.y>=0 && bc.z>=0) bits |= 1ull<<((x-cx*CELL) + (y-cy*CELL)*CELL);
+                        }
+                    }
+                    uint64_t &mask = layer_mask_[cell*samples_+s];
+                    added = added || (bits & ~mask);
+                    mask |= bits;
+                }
+                if (added) layer_zfar_[cell] = std::min(layer_zfar_[cell], zmin);
+            }
+        }
+    }
+    // Into the buffer. Where a nearer occluder already is, a farther one would
+    // push the depth of the cell back and hide less than before: it is left out.
+    for (int c=0; c<ncells; c++) {
+        if (layer_zfar_[c]==std::numeric_limits<float>::max()) continue; // untouched
+        if (zfar_[c]!=std::numeric_limits<float>::max() && layer_zfar_[c]<zfar_[c]) continue;
+        zfar_[c] = std::min(zfar_[c], layer_zfar_[c]);
+        for (int s=0; s<samples_; s++) mask_[c*samples_+s] |= layer_mask_[c*samples_+s];
+    }
+}
+
+bool OcclusionBuffer::occluded(const ScreenRect &rect, float zmax) const {
+    if (rect.empty()) return true;
+    const float eps = .01f; // triangle() interpolates depths, allow for its rounding
+    for (int cy=rect.y0/CELL; cy<=rect.y1/CELL; cy++) {
+        for (int cx=rect.x0/CELL; cx<=rect.x1/CELL; cx++) {
+            // the pixels of the rectangle in this cell
+            int x0 = std::max(rect.x0-cx*CELL, 0), x1 = std::min(rect.x1-cx*CELL, CELL-1);
+            int y0 = std::max(rect.y0-cy*CELL, 0), y1 = std::min(rect.y1-cy*CELL, CELL-1);
+            uint64_t row = ((2ull<<x1)-1) & ~((1ull<<x0)-1), want = 0;
+            for (int y=y0; y<=y1; y++) want |= row<<(y*CELL);
+            int c = cx+cy*cells_x_;
+            if ((covered(c) & want)!=want || !(zmax < zfar_[c]-eps)) return false;
+        }
+    }
+    return true;
+}
+
+bool screen_box(Model &model, const Mat4f &M, int width, int height, ScreenRect &rect, float &zmax) {
+    Vec3f lo, hi;
+    model.bounds(lo, hi);
+    float x0 = std::numeric_limits<float>::max(), y0 = x0, x1 = -x0, y1 = -x0;
+    zmax = -x0;
+    for (int k=0; k<8; k++) {
+        Vec3f corner(k&1 ? hi.x : lo.x, k&2 ? hi.y : lo.y, k&4 ? hi.z : lo.z);
+        Vec4f s = M*embed<4>(corner);
+        if (s[3]<=1e-6f) return false;
+        x0 = std::min(x0, s[0]/s[3]); x1 = std::max(x1, s[0]/s[3]);
+        y0 = std::min(y0, s[1]/s[3]); y1 = std::max(y1, s[1]/s[3]);
+        zmax = std::max(zmax, s[2]/s[3]);
+    }
+    if (x1<0 || y1<0 || x0>width-1 || y0>height-1) rect = ScreenRect();
+    else rect = ScreenRect(std::max(0, (int)std::floor(x0)), std::max(0, (int)std::floor(y0)),
+                           std::min(width-1, (int)std::ceil(x1)), std::min(height-1, (int)std::ceil(y1)));
+    return true;
+}
+
@@ -0,0 +1,39 @@
+#ifndef __OCCLUSION_H__
+#define __OCCLUSION_H__
+#include <cstdint>
+#include "arena.h"
+#include "geometry.h"
+#include "model.h"
+#include "pipeLine.h"
+
+// Coarse occlusion buffer of 8x8 pixel cells. Each cell keeps a bit per pixel
+// (per sample with msaa) covered by the occluders drawn into it and the
+// farthest depth of the faces that covered them. Back faces count as well:
+// the main pass draws them too, and they fill the cracks between front faces.
+// Coverage is the barycentric() test triangle() and triangle_msaa() make at
+// the same points, so a covered pixel is one the occluder really draws over.
+// An object whose screen box only has covered pixels, all nearer than the
+// nearest corner of its bounding box, cannot show up in the frame.
+class OcclusionBuffer {
+public:
+    static const int CELL = 8; // pixels, one uint64_t mask per cell
+    OcclusionBuffer();
+    // storage comes from arena and lives until it resets
+    void clear(int width, int height, int samples, FrameArena &arena); // samples: 1, or as for msaa
+    void rasterize(Model &model, const Vec3f *screen_verts); // an occluder, screen_verts as for its main pass
+    bool occluded(const ScreenRect &rect, float zmax) const;
+private:
+    int width_, height_, cells_x_, cells_y_;
+    int samples_;
+    uint64_t *mask_;  // samples_ per cell, bit x+8*y: that sample of pixel (x,y) of the cell is covered
+    float *zfar_;     // farthest depth of the faces that set bits in the cell
+    uint64_t *layer_mask_; // the same for the occluder being rasterized
+    float *layer_zfar_;
+    uint64_t covered(int cell) const; // pixels with every sample covered
+};
+
+// screen rectangle and nearest depth of the bounding box of model under M
+// (viewport*projection*view*transform); false when it crosses the eye plane
+bool screen_box(Model &model, const Mat4f &M, int width, int height, ScreenRect &rect, float &zmax);
+
+#endif //__OCCLUSION_H__
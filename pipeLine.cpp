@@ -1,11 +1,14 @@
 #include "pipeLine.h"
 #include <limits>
-Matrix modelTras = Matrix::identity();
-Matrix view = Matrix::identity();
-Matrix projection = Matrix::identity();
-Matrix viewport = Matrix::identity();
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include "stats.h"
+thread_local Matrix modelTras = Matrix::identity();
+thread_local Matrix view = Matrix::identity();
+thread_local Matrix projection = Matrix::identity();
+thread_local Matrix viewport = Matrix::identity();
 IShader::~IShader() {}
-constexpr double MY_PI = 3.1415926;
 void set_model(float rotation_angle)
 {
     float randian = rotation_angle / 180.0 * MY_PI;
@@ -51,11 +54,26 @@ Vec3f barycentric(Vec3f *pts, Vec3f P)
         return Vec3f(-1, 1, 1);
     return Vec3f(1.f - (u.x + u.y) / u.z, u.y / u.z, u.x / u.z);
 }
-void triangle(Vec3f *pts, IShader &shader, TGAImage &image, float* zbuffer) {
-    int min_X = std::floor(std::min(pts[0][0], std::min(pts[1][0], pts[2][0])));
-    int min_Y = std::floor(std::min(pts[0][1], std::min(pts[1][1], pts[2][1])));
-    int max_X = std::ceil(std::max(pts[0][0], std::max(pts[1][0], pts[2][0])));
-    int max_Y = std::ceil(std::max(pts[0][1], std::max(pts[1][1], pts[2][1])));
+template <typename D> static void triangle(Vec3f *pts, IShader &shader, const ImageView &image, const D &zbuffer, const ScreenRect *scissor) {
+    STATS_RASTER_TIMER(timer);
+    STATS_ADD(tris_submitted, 1);
+    int min_X = std::max(0, (int)std::floor(std::min(pts[0][0], std::min(pts[1][0], pts[2][0]))));
+    int min_Y = std::max(0, (int)std::floor(std::min(pts[0][1], std::min(pts[1][1], pts[2][1]))));
+    int max_X = std::min(image.width-1,  (int)std::ceil(std::max(pts[0][0], std::max(pts[1][0], pts[2][0]))));
+    int max_Y = std::min(image.height-1, (int)std::ceil(std::max(pts[0][1], std::max(pts[1][1], pts[2][1]))));
+    if (scissor) {
+        min_X = std::max(min_X, scissor->x0);
+        min_Y = std::max(min_Y, scissor->y0);
+        max_X = std::min(max_X, scissor->x1);
+        max_Y = std::min(max_Y, scissor->y1);
+    }
+    float area = (pts[1].x-pts[0].x)*(pts[2].y-pts[0].y) - (pts[2].x-pts[0].x)*(pts[1].y-pts[0].y);
+    if (min_X>max_X || min_Y>max_Y || std::abs(area)<1) { // off screen, or degenerate (see barycentric())
+        STATS_ADD(tris_culled, 1);
+        return;
+    }
+    STATS_ADD(tris_rasterized, 1);
+    RasterCounters counters;
     Vec3f P;
      for (int x = min_X; x < max_X + 1; x++)
     {
@@ -67,16 +85,300 @@ void triangle(Vec3f *pts, IShader &shader, TGAImage &image, float* zbuffer) {
             Vec3f bcentric = barycentric(pts, P);
             if (bcentric.x < 0 || bcentric.y < 0 || bcentric.z < 0)
                 continue;
+            counters.tested++;
             P.z = bcentric.x * pts[0].z + bcentric.y * pts[1].z + bcentric.z * pts[2].z;
-            if (zbuffer[int(P.x+P.y*image.get_width())] > P.z)
-                 continue;
-            bool discard = shader.fragment(bcentric, color);
+            const int i = int(P.x+P.y*image.width);
+            const typename D::Value z = zbuffer.encode(P.z);
+            if (zbuffer.load(i) > z) {
+                counters.rejected++;
+                continue;
+            }
+            bool discard = STATS_SHADE(timer, shader.fragment(bcentric, color));
+            counters.shaded++;
+            STATS_OVERDRAW(x, y);
             if (!discard) {
-                zbuffer[int(P.x+P.y*image.get_width())] = P.z;
+                counters.written++;
+                zbuffer.store(i, z);
                 image.set(P.x, P.y, color);
             }
         }
     }
+    counters.depth_bytes = (counters.tested+counters.written)*D::BYTES;
+    STATS_FLUSH(counters);
+}
+
+void triangle(Vec3f *pts, IShader &shader, const ImageView &image, DepthBuffer &zbuffer, const ScreenRect *scissor) {
+    with_depth_access(zbuffer, [&](const auto &access) { triangle(pts, shader, image, access, scissor); });
+}
+
+template <typename D> static void triangle_vrs(Vec3f *pts, IShader &shader, const ImageView &image, const D &zbuffer,
+                                               const ShadingRateMap *rates, int rate, const ScreenRect *scissor) {
+    STATS_RASTER_TIMER(timer);
+    STATS_ADD(tris_submitted, 1);
+    const int width = image.width;
+    int min_X = std::max(0, (int)std::floor(std::min(pts[0][0], std::min(pts[1][0], pts[2][0]))));
+    int min_Y = std::max(0, (int)std::floor(std::min(pts[0][1], std::min(pts[1][1], pts[2][1]))));
+    int max_X = std::min(width-1, (int)std::ceil(std::max(pts[0][0], std::max(pts[1][0], pts[2][0]))));
+    int max_Y = std::min(image.height-1, (int)std::ceil(std::max(pts[0][1], std::max(pts[1][1], pts[2][1]))));
+    if (scissor) {
+        min_X = std::max(min_X, scissor->x0);
+        min_Y = std::max(min_Y, scissor->y0);
+        max_X = std::min(max_X, scissor->x1);
+        max_Y = std::min(max_Y, scissor->y1);
+    }
+    float area = (pts[1].x-pts[0].x)*(pts[2].y-pts[0].y) - (pts[2].x-pts[0].x)*(pts[1].y-pts[0].y);
+    if (min_X>max_X || min_Y>max_Y || std::abs(area)<1) {
+        STATS_ADD(tris_culled, 1);
+        return;
+    }
+    STATS_ADD(tris_rasterized, 1);
+    RasterCounters counters;
+    const int M = ShadingRateMap::MAX_RATE;
+    for (int by = min_Y & ~(M-1); by<=max_Y; by+=M) {
+        for (int bx = min_X & ~(M-1); bx<=max_X; bx+=M) {
+            int r = rate ? rate : rates->at(bx, by);
+            for (int sy=by; sy<by+M; sy+=r) {
+                for (int sx=bx; sx<bx+M; sx+=r) {
+                    // one r x r block: the shading point does not depend on the
+                    // scissor or the zbuffer, so bands and draw order do not change it
+                    bool shaded = false, discard = false;
+                    TGAColor color;
+                    for (int y=std::max(sy, min_Y); y<=std::min(sy+r-1, max_Y); y++) {
+                        for (int x=std::max(sx, min_X); x<=std::min(sx+r-1, max_X); x++) {
+                            Vec3f bc = barycentric(pts, Vec3f(x, y, 0));
+                            if (bc.x<0 || bc.y<0 || bc.z<0) continue;
+                            counters.tested++;
+                            const typename D::Value z = zbuffer.encode(bc.x*pts[0].z + bc.y*pts[1].z + bc.z*pts[2].z);
+                            if (zbuffer.load(x+y*width) > z) {
+                                counters.rejected++;
+                                continue;
+                            }
+                            if (!shaded) {
+                                Vec3f at = barycentric(pts, Vec3f(sx+(r-1)*.5f, sy+(r-1)*.5f, 0));
+                                for (int k=0; k<r*r && (at.x<0 || at.y<0 || at.z<0); k++) at = barycentric(pts, Vec3f(sx+k%r, sy+k/r, 0));
+                                discard = STATS_SHADE(timer, shader.fragment(at, color));
+                                shaded = true;
+                                counters.shaded++;
+                                STATS_OVERDRAW(x, y);
+                            }
+                            if (!discard) {
+                                counters.written++;
+                                zbuffer.store(x+y*width, z);
+                                image.set(x, y, color);
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+    counters.depth_bytes = (counters.tested+counters.written)*D::BYTES;
+    STATS_FLUSH(counters);
+}
+
+void triangle_vrs(Vec3f *pts, IShader &shader, const ImageView &image, DepthBuffer &zbuffer, const ShadingRateMap *rates, int rate,
+                  const ScreenRect *scissor) {
+    with_depth_access(zbuffer, [&](const auto &access) { triangle_vrs(pts, shader, image, access, rates, rate, scissor); });
+}
+
+void ShadingRateMap::fill(int w, int h, int r) {
+    width = w;
+    height = h;
+    tiles_x = (w+TILE-1)/TILE;
+    tiles_y = (h+TILE-1)/TILE;
+    rate.assign(tiles_x*tiles_y, r);
+}
+
+void ShadingRateMap::measure(const ImageView &frame, const DepthBuffer &zbuffer, int max_rate) {
+    const int FINE = 48, COARSE = 16; // largest luminance step between neighbours, out of 255
+    const int w = frame.width, h = frame.height, tiles_x = (w+TILE-1)/TILE, tiles_y = (h+TILE-1)/TILE;
+    const bool same = detail_width==w && detail_height==h; // detail still holds the frame before
+    detail_width = detail_height = 0;
+    if (zbuffer.width!=w || zbuffer.height!=h) return;
+    if (!same) detail.assign(tiles_x*tiles_y, max_rate);
+    detail_width = w;
+    detail_height = h;
+    for (int ty=0; ty<tiles_y; ty++) {
+        for (int tx=0; tx<tiles_x; tx++) {
+            int step = 0;
+            bool drawn = false;
+            for (int y=ty*TILE; y<std::min(h, (ty+1)*TILE); y++) {
+                for (int x=tx*TILE; x<std::min(w, (tx+1)*TILE); x++) {
+                    drawn = drawn || zbuffer.drawn(x+y*w);
+                    TGAColor c = frame.get(x, y), cx = frame.get(std::min(w-1, x+1), y), cy = frame.get(x, std::min(h-1, y+1));
+                    int l = c[2]*2 + c[1]*5 + c[0], lx = cx[2]*2 + cx[1]*5 + cx[0], ly = cy[2]*2 + cy[1]*5 + cy[0]; // 8x luma
+                    step = std::max(step, std::max(std::abs(l-lx), std::abs(l-ly)));
+                }
+            }
+            step = drawn ? step/8 : 255;
+            unsigned char &d = detail[tx+ty*tiles_x];
+            int need = step>FINE ? 1 : step>COARSE ? std::min(2, max_rate) : max_rate;
+            // Coarser than the frame before only well below the threshold: a
+            // tile shaded coarser shows larger steps at its block edges, which
+            // would otherwise take it back to the finer rate on every other frame.
+            int calm = step*4 > FINE*3 ? 1 : step*4 > COARSE*3 ? std::min(2, max_rate) : max_rate;
+            d = need<d ? need : std::min(need, std::max((int)d, calm));
+        }
+    }
+}
+
+void ShadingRateMap::adapt(int w, int h, int max_rate) {
+    if (detail_width!=w || detail_height!=h) {
+        fill(w, h, 1);
+        return;
+    }
+    fill(w, h, max_rate);
+    // the content moved since: a tile takes the finest rate around it
+    for (int ty=0; ty<tiles_y; ty++) {
+        for (int tx=0; tx<tiles_x; tx++) {
+            int r = max_rate;
+            for (int y=std::max(0, ty-1); y<=std::min(tiles_y-1, ty+1); y++) {
+                for (int x=std::max(0, tx-1); x<=std::min(tiles_x-1, tx+1); x++) r = std::min(r, (int)detail[x+y*tiles_x]);
+            }
+            rate[tx+ty*tiles_x] = r;
+        }
+    }
+}
+
+template <typename D> static void triangle_depth(Vec3f *pts, const D &zbuffer, int width, int height, const ScreenRect *scissor) {
+    STATS_TIMER(STAGE_RASTER);
+    STATS_ADD(tris_submitted, 1);
+    int min_X = std::max(0, (int)std::floor(std::min(pts[0][0], std::min(pts[1][0], pts[2][0]))));
+    int min_Y = std::max(0, (int)std::floor(std::min(pts[0][1], std::min(pts[1][1], pts[2][1]))));
+    int max_X = std::min(width-1,  (int)std::ceil(std::max(pts[0][0], std::max(pts[1][0], pts[2][0]))));
+    int max_Y = std::min(height-1, (int)std::ceil(std::max(pts[0][1], std::max(pts[1][1], pts[2][1]))));
+    if (scissor) {
+        min_X = std::max(min_X, scissor->x0);
+        min_Y = std::max(min_Y, scissor->y0);
+        max_X = std::min(max_X, scissor->x1);
+        max_Y = std::min(max_Y, scissor->y1);
+    }
+    float area = (pts[1].x-pts[0].x)*(pts[2].y-pts[0].y) - (pts[2].x-pts[0].x)*(pts[1].y-pts[0].y);
+    if (min_X>max_X || min_Y>max_Y || std::abs(area)<1) {
+        STATS_ADD(tris_culled, 1);
+        return;
+    }
+    STATS_ADD(tris_rasterized, 1);
+    RasterCounters counters;
+    Vec3f P;
+    for (int x = min_X; x <= max_X; x++) {
+        for (int y = min_Y; y <= max_Y; y++) {
+            P.x = x;
+            P.y = y;
+            Vec3f bc = barycentric(pts, P);
+            if (bc.x < 0 || bc.y < 0 || bc.z < 0) continue;
+            counters.tested++;
+            P.z = bc.x * pts[0].z + bc.y * pts[1].z + bc.z * pts[2].z;
+            const int i = int(P.x+P.y*width);
+            const typename D::Value z = zbuffer.encode(P.z);
+            if (zbuffer.load(i) > z) {
+                counters.rejected++;
+                continue;
+            }
+            counters.written++;
+            zbuffer.store(i, z);
+        }
+    }
+    counters.depth_bytes = (counters.tested+counters.written)*D::BYTES;
+    STATS_FLUSH(counters);
+}
+
+void triangle_depth(Vec3f *pts, DepthBuffer &zbuffer, const ScreenRect *scissor) {
+    with_depth_access(zbuffer, [&](const auto &access) { triangle_depth(pts, access, zbuffer.width, zbuffer.height, scissor); });
+}
+
+bool parse_depth_format(const char *name, DepthFormat &format) {
+    for (int f=0; f<DEPTH_FORMATS; f++) {
+        if (!strcmp(name, depth_format_name((DepthFormat)f))) {
+            format = (DepthFormat)f;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char *depth_format_name(DepthFormat format) {
+    static const char *names[DEPTH_FORMATS] = {"float", "unorm24", "unorm16"};
+    return names[format];
+}
+
+int depth_format_bytes(DepthFormat format) {
+    static const int bytes[DEPTH_FORMATS] = {4, 3, 2};
+    return bytes[format];
+}
+
+void DepthBuffer::reset(DepthFormat f, int w, int h, float far_z, float near_z) {
+    format = f;
+    width = w;
+    height = h;
+    zfar = f==DEPTH_FLOAT ? 0 : far_z;
+    znear = near_z;
+    scale = 1;
+    if (f==DEPTH_UNORM16) scale = (DepthUnorm16Access::TOP-1)/std::max(near_z-far_z, 1e-6f);
+    if (f==DEPTH_UNORM24) scale = (DepthUnorm24Access::TOP-1)/std::max(near_z-far_z, 1e-6f);
+    // only the storage of the format is kept
+    if (f!=DEPTH_FLOAT) std::vector<float>().swap(floats);
+    if (f!=DEPTH_UNORM16) std::vector<uint16_t>().swap(unorm16);
+    if (f!=DEPTH_UNORM24) std::vector<unsigned char>().swap(unorm24);
+    clear();
+}
+
+void DepthBuffer::clear() {
+    const size_t n = (size_t)width*height;
+    switch (format) {
+    case DEPTH_UNORM16: unorm16.assign(n, 0); break;
+    case DEPTH_UNORM24: unorm24.assign(3*n, 0); break;
+    default:            floats.assign(n, -std::numeric_limits<float>::max()); break;
+    }
+}
+
+void DepthBuffer::clear(const ScreenRect &rect) {
+    for (int y=rect.y0; y<=rect.y1; y++) {
+        const size_t row = (size_t)y*width, n = rect.x1-rect.x0+1;
+        switch (format) {
+        case DEPTH_UNORM16: std::fill_n(unorm16.begin()+row+rect.x0, n, 0); break;
+        case DEPTH_UNORM24: std::fill_n(unorm24.begin()+3*(row+rect.x0), 3*n, 0); break;
+        default:            std::fill_n(floats.begin()+row+rect.x0, n, -std::numeric_limits<float>::max()); break;
+        }
+    }
+}
+
+size_t DepthBuffer::bytes() const {
+    return floats.size()*sizeof(float) + unorm16.size()*sizeof(uint16_t) + unorm24.size();
+}
+
+bool DepthBuffer::drawn(int i) const {
+    switch (format) {
+    case DEPTH_UNORM16: return unorm16[i]!=0;
+    case DEPTH_UNORM24: return (unorm24[3*i] | unorm24[3*i+1] | unorm24[3*i+2])!=0;
+    default:            return floats[i]!=-std::numeric_limits<float>::max();
+    }
+}
+
+float DepthBuffer::depth(int i) const {
+    if (!drawn(i)) return -std::numeric_limits<float>::max();
+    switch (format) {
+    case DEPTH_UNORM16: return zfar + (unorm16[i]-1)/scale;
+    case DEPTH_UNORM24: return zfar + ((unorm24[3*i] | unorm24[3*i+1]<<8 | unorm24[3*i+2]<<16)-1)/scale;
+    default:            return floats[i];
+    }
+}
+
+float DepthBuffer::stored(int i) const {
+    switch (format) {
+    case DEPTH_UNORM16: return unorm16[i];
+    case DEPTH_UNORM24: return unorm24[3*i] | unorm24[3*i+1]<<8 | unorm24[3*i+2]<<16;
+    default:            return floats[i];
+    }
+}
+
+Mat4f DepthBuffer::encoding() const {
+    Mat4f M;
+    if (format==DEPTH_UNORM16 || format==DEPTH_UNORM24) {
+        M.c[2][2] = scale;
+        M.c[3][2] = 1-zfar*scale;
+    }
+    return M;
 }
 
 Vec3f v4tov3(Vec4f v) {
@@ -85,4 +387,108 @@ Vec3f v4tov3(Vec4f v) {
     m[1] = v[1]/v[3];
     m[2] = v[2]/v[3];
     return m;
-}
\ No newline at end of file
+}
+
+// standard rotated/sparse grid sample positions, in 1/16 pixel from the pixel center
+static const int msaa4_pos[4][2] = {{-2,-6}, {6,-2}, {-6,2}, {2,6}};
+static const int msaa8_pos[8][2] = {{1,-3}, {-1,3}, {5,1}, {-3,-5}, {-5,5}, {-7,-1}, {3,7}, {7,-7}};
+
+const int (*msaa_positions(int samples))[2] {
+    return 4==samples ? msaa4_pos : msaa8_pos;
+}
+
+void MsaaBuffer::resize(int w, int h, int nsamples, int bpp) {
+    assert(4==nsamples || 8==nsamples);
+    width = w;
+    height = h;
+    samples = nsamples;
+    bytespp = bpp;
+    depth.assign((size_t)w*h*nsamples, -std::numeric_limits<float>::max());
+    color.assign((size_t)w*h*nsamples*bpp, 0);
+}
+
+size_t MsaaBuffer::bytes() const {
+    return depth.size()*sizeof(float) + color.size();
+}
+
+void MsaaBuffer::resolve(const ImageView &image) const {
+    resolve_rows(image, 0, height-1);
+}
+
+void MsaaBuffer::resolve_rows(const ImageView &image, int y0, int y1) const {
+    TGAColor c;
+    c.bytespp = bytespp;
+    for (int y=y0; y<=y1; y++) {
+        for (int x=0; x<width; x++) {
+            const unsigned char *s = &color[((size_t)x+y*width)*samples*bytespp];
+            for (int k=0; k<bytespp; k++) {
+                int sum = 0;
+                for (int i=0; i<samples; i++) sum += s[i*bytespp+k];
+                c.bgra[k] = (sum + samples/2)/samples;
+            }
+            image.set(x, y, c);
+        }
+    }
+}
+
+void triangle_msaa(Vec3f *pts, IShader &shader, MsaaBuffer &target, const ScreenRect *scissor) {
+    STATS_RASTER_TIMER(timer);
+    STATS_ADD(tris_submitted, 1);
+    int min_X = std::max(0, (int)std::floor(std::min(pts[0][0], std::min(pts[1][0], pts[2][0]))));
+    int min_Y = std::max(0, (int)std::floor(std::min(pts[0][1], std::min(pts[1][1], pts[2][1]))));
+    int max_X = std::min(target.width-1,  (int)std::ceil(std::max(pts[0][0], std::max(pts[1][0], pts[2][0]))));
+    int max_Y = std::min(target.height-1, (int)std::ceil(std::max(pts[0][1], std::max(pts[1][1], pts[2][1]))));
+    if (scissor) {
+        min_X = std::max(min_X, scissor->x0);
+        min_Y = std::max(min_Y, scissor->y0);
+        max_X = std::min(max_X, scissor->x1);
+        max_Y = std::min(max_Y, scissor->y1);
+    }
+    float area = (pts[1].x-pts[0].x)*(pts[2].y-pts[0].y) - (pts[2].x-pts[0].x)*(pts[1].y-pts[0].y);
+    if (min_X>max_X || min_Y>max_Y || std::abs(area)<1) {
+        STATS_ADD(tris_culled, 1);
+        return;
+    }
+    STATS_ADD(tris_rasterized, 1);
+    const int (*pos)[2] = msaa_positions(target.samples);
+    const int S = target.samples, bpp = target.bytespp;
+    RasterCounters counters;
+    for (int y = min_Y; y <= max_Y; y++) {
+        for (int x = min_X; x <= max_X; x++) {
+            Vec3f center = barycentric(pts, Vec3f(x, y, 0));
+            Vec3f shade_at = center;
+            bool center_inside = center.x>=0 && center.y>=0 && center.z>=0;
+            size_t base = ((size_t)x+y*target.width)*S;
+            unsigned int covered = 0, passed = 0;
+            float z[8];
+            for (int i=0; i<S; i++) {
+                Vec3f bc = barycentric(pts, Vec3f(x+pos[i][0]/16.f, y+pos[i][1]/16.f, 0));
+                if (bc.x<0 || bc.y<0 || bc.z<0) continue;
+                if (!covered && !center_inside) shade_at = bc; // don't extrapolate varyings past the edge
+                covered |= 1u<<i;
+                z[i] = bc.x*pts[0].z + bc.y*pts[1].z + bc.z*pts[2].z;
+                if (target.depth[base+i] > z[i]) continue;
+                passed |= 1u<<i;
+            }
+            if (!covered) continue;
+            counters.tested++;
+            if (!passed) {
+                counters.rejected++;
+                continue;
+            }
+            TGAColor color;
+            bool discard = STATS_SHADE(timer, shader.fragment(shade_at, color));
+            counters.shaded++;
+            STATS_OVERDRAW(x, y);
+            if (discard) continue;
+            counters.written++;
+            for (int i=0; i<S; i++) {
+                if (!(passed & (1u<<i))) continue;
+                target.depth[base+i] = z[i];
+                memcpy(&target.color[(base+i)*bpp], color.bgra, bpp);
+            }
+        }
+    }
+    counters.depth_bytes = (counters.tested+counters.written)*S*sizeof(float);
+    STATS_FLUSH(counters);
+}
@@ -1,10 +1,18 @@
+#ifndef __PIPELINE_H__
+#define __PIPELINE_H__
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <vector>
 #include "geometry.h"
 #include "tgaimage.h"
-extern Matrix modelTras;
-extern Matrix view;
-extern Matrix projection;
-extern Matrix viewport;
+// per-thread pipeline state, so independent renders can run on different threads
+extern thread_local Matrix modelTras;
+extern thread_local Matrix view;
+extern thread_local Matrix projection;
+extern thread_local Matrix viewport;
 const float depth =2000.0;
+constexpr double MY_PI = 3.1415926;
 struct IShader {
     virtual ~IShader();
     virtual Vec3f vertex(int iface, int nthvert) = 0;
@@ -14,6 +22,146 @@ void set_model(float rotation_angle);
 void set_view(Vec3f eye, Vec3f center, Vec3f up);
 void set_projection(float coeff);
 void set_viewport(int x, int y, int w, int h);
-void triangle(Vec3f *pts, IShader &shader, TGAImage &image, float* zbuffer);
+// inclusive pixel rectangle, empty when x0>x1 or y0>y1
+struct ScreenRect {
+    int x0, y0, x1, y1;
+    ScreenRect() : x0(0), y0(0), x1(-1), y1(-1) {}
+    ScreenRect(int X0, int Y0, int X1, int Y1) : x0(X0), y0(Y0), x1(X1), y1(Y1) {}
+    bool empty() const { return x0>x1 || y0>y1; }
+    bool overlaps(const ScreenRect &r) const { return !empty() && !r.empty() && x0<=r.x1 && r.x0<=x1 && y0<=r.y1 && r.y0<=y1; }
+    ScreenRect intersection(const ScreenRect &r) const {
+        return ScreenRect(std::max(x0, r.x0), std::max(y0, r.y0), std::min(x1, r.x1), std::min(y1, r.y1));
+    }
+};
+
+// Depth buffer storage. Depths are screen z, larger is nearer; a format keeps
+//   DEPTH_FLOAT     the float
+//   DEPTH_UNORM24   fixed point from zfar to znear, 3 bytes a pixel
+//   DEPTH_UNORM16   fixed point from zfar to znear, 2 bytes a pixel
+// Stored values compare as the depths do. Fixed point rounds depths down
+// (farther) and clamps them to the range, and keeps 0 for pixels nothing was
+// drawn into.
+enum DepthFormat { DEPTH_FLOAT, DEPTH_UNORM24, DEPTH_UNORM16 };
+const int DEPTH_FORMATS = 3;
+bool parse_depth_format(const char *name, DepthFormat &format); // float, unorm24 or unorm16
+const char *depth_format_name(DepthFormat format);
+int depth_format_bytes(DepthFormat format); // per pixel
+
+struct DepthBuffer {
+    DepthFormat format;
+    int width, height;
+    float zfar, znear;              // the range reset() was given
+    float scale;                    // stored = (z-zfar)*scale, plus 1 in fixed point
+    std::vector<float> floats;      // DEPTH_FLOAT
+    std::vector<uint16_t> unorm16;
+    std::vector<unsigned char> unorm24;
+    DepthBuffer() : format(DEPTH_FLOAT), width(0), height(0), zfar(0), znear(0), scale(1), floats(), unorm16(), unorm24() {}
+    // cleared, for depths from far_z up to near_z; DEPTH_FLOAT ignores the range
+    void reset(DepthFormat f, int w, int h, float far_z, float near_z);
+    void clear();
+    void clear(const ScreenRect &rect);
+    size_t bytes() const;
+    bool drawn(int i) const;     // something was drawn into pixel i
+    float depth(int i) const;    // of pixel i, -max() where nothing was drawn
+    float stored(int i) const;   // the value of pixel i as stored, as a float
+    Mat4f encoding() const;      // screen coordinates to those with z in stored units, x and y kept
+};
+
+// Typed access to one format, for code specialized per format: encode() maps
+// a depth to the stored value, which load() and store() move.
+struct DepthFloatAccess {
+    typedef float Value;
+    static const int BYTES = 4;
+    float *p;
+    explicit DepthFloatAccess(DepthBuffer &b) : p(b.floats.data()) {}
+    Value encode(float z) const { return z; }
+    Value load(int i) const { return p[i]; }
+    void store(int i, Value v) const { p[i] = v; }
+};
+template <int BITS> struct DepthUnormEncode {
+    typedef uint32_t Value;
+    static const uint32_t TOP = (1u<<BITS)-1;
+    float zfar, scale;
+    DepthUnormEncode(const DepthBuffer &b) : zfar(b.zfar), scale(b.scale) {}
+    Value encode(float z) const {
+        float t = (z-zfar)*scale;
+        return t<=0 ? 1 : t>=TOP-1 ? TOP : 1+(uint32_t)t;
+    }
+};
+struct DepthUnorm16Access : DepthUnormEncode<16> {
+    static const int BYTES = 2;
+    uint16_t *p;
+    explicit DepthUnorm16Access(DepthBuffer &b) : DepthUnormEncode<16>(b), p(b.unorm16.data()) {}
+    Value load(int i) const { return p[i]; }
+    void store(int i, Value v) const { p[i] = v; }
+};
+struct DepthUnorm24Access : DepthUnormEncode<24> {
+    static const int BYTES = 3;
+    unsigned char *p;
+    explicit DepthUnorm24Access(DepthBuffer &b) : DepthUnormEncode<24>(b), p(b.unorm24.data()) {}
+    Value load(int i) const { const unsigned char *s = p+3*i; return s[0] | s[1]<<8 | s[2]<<16; }
+    void store(int i, Value v) const { unsigned char *d = p+3*i; d[0] = v; d[1] = v>>8; d[2] = v>>16; }
+};
+// f(access) with the access of b's format
+template <typename F> inline void with_depth_access(DepthBuffer &b, const F &f) {
+    switch (b.format) {
+    case DEPTH_UNORM16: f(DepthUnorm16Access(b)); break;
+    case DEPTH_UNORM24: f(DepthUnorm24Access(b)); break;
+    default:            f(DepthFloatAccess(b)); break;
+    }
+}
+
+// scissor: only pixels inside it are touched, NULL for the whole image
+void triangle(Vec3f *pts, IShader &shader, const ImageView &image, DepthBuffer &zbuffer, const ScreenRect *scissor=NULL);
+// depth only, the same depths triangle() computes, so a later triangle() pass
+// over this zbuffer shades exactly the visible fragments
+void triangle_depth(Vec3f *pts, DepthBuffer &zbuffer, const ScreenRect *scissor=NULL);
+
+// Shading rate per 16x16 pixel tile for triangle_vrs(): 1, 2 or 4, the side
+// of the pixel blocks (aligned to the rate) the fragment shader runs once for.
+struct ShadingRateMap {
+    static const int TILE = 16;
+    static const int MAX_RATE = 4;
+    int width, height, tiles_x, tiles_y;
+    std::vector<unsigned char> rate;
+    std::vector<unsigned char> detail; // measure(): the rates the tiles of the last frame need on their own
+    int detail_width, detail_height;   // of that frame, 0 before the first
+    ShadingRateMap() : width(0), height(0), tiles_x(0), tiles_y(0), rate(), detail(), detail_width(0), detail_height(0) {}
+    void fill(int w, int h, int r);
+    // Once a frame is drawn, from its luminance gradients: smooth tiles need
+    // up to max_rate, detailed ones full rate. Tiles nothing was drawn into
+    // (zbuffer untouched) need full rate too, what moves in is unknown and
+    // empty tiles cost nothing. A tile only gets coarser than the last frame
+    // measured it once its steps are well below the threshold.
+    void measure(const ImageView &frame, const DepthBuffer &zbuffer, int max_rate);
+    // For the next frame: every tile takes the finest rate measure() found
+    // around it, the content moves. Full rate everywhere when the last frame
+    // measured was not w x h.
+    void adapt(int w, int h, int max_rate);
+    int at(int x, int y) const { return rate[x/TILE + y/TILE*tiles_x]; }
+};
+// triangle() shading once per block of covered pixels, at the block centre if
+// the triangle covers it, else at the first covered pixel of the block; depth
+// test and write stay per pixel. rate: that for every block, 0 for rates'.
+void triangle_vrs(Vec3f *pts, IShader &shader, const ImageView &image, DepthBuffer &zbuffer, const ShadingRateMap *rates, int rate,
+                  const ScreenRect *scissor=NULL);
+
+// Multisampled target: depth and color per sample (4 or 8 per pixel). The
+// fragment shader still runs once per pixel per triangle, its color goes to
+// every covered sample that passes the depth test; resolve() averages them.
+struct MsaaBuffer {
+    int width, height, samples, bytespp;
+    std::vector<float> depth;
+    std::vector<unsigned char> color;
+    MsaaBuffer() : width(0), height(0), samples(0), bytespp(0), depth(), color() {}
+    void resize(int w, int h, int nsamples, int bpp); // and clear
+    size_t bytes() const;
+    void resolve(const ImageView &image) const;
+    void resolve_rows(const ImageView &image, int y0, int y1) const; // inclusive
+};
+void triangle_msaa(Vec3f *pts, IShader &shader, MsaaBuffer &target, const ScreenRect *scissor=NULL);
+// sample offsets from the pixel center in 1/16 pixel, for 4 or 8 samples
+const int (*msaa_positions(int samples))[2];
 Vec3f barycentric(Vec3f * pts, Vec3f P);
-Vec3f v4tov3(Vec4f v);
\ No newline at end of file
+Vec3f v4tov3(Vec4f v);
+#endif //__PIPELINE_H__
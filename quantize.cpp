@@ -0,0 +1,91 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <vector>
+#include "model.h"
+#include "quantize.h"
+#include "renderer.h"
+
+static float sign_not_zero(float v) {
+    return v<0 ? -1.f : 1.f;
+}
+
+void oct_encode(Vec3f n, int bits, int16_t &x, int16_t &y) {
+    float l1 = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+    float u = l1>0 ? n.x/l1 : 0, v = l1>0 ? n.y/l1 : 0;
+    if (n.z<0) { // the lower half folds over the diagonals
+        float fu = (1-std::abs(v))*sign_not_zero(u);
+        v = (1-std::abs(u))*sign_not_zero(v);
+        u = fu;
+    }
+    const float scale = (float)((1<<(bits-1))-1);
+    x = (int16_t)std::floor(std::max(-1.f, std::min(1.f, u))*scale + .5f);
+    y = (int16_t)std::floor(std::max(-1.f, std::min(1.f, v))*scale + .5f);
+}
+
+Vec3f oct_decode(int16_t x, int16_t y, int bits) {
+    const float scale = (float)((1<<(bits-1))-1);
+    Vec3f n(std::max(-1.f, x/scale), std::max(-1.f, y/scale), 0);
+    n.z = 1 - std::abs(n.x) - std::abs(n.y);
+    if (n.z<0) {
+        float fx = (1-std::abs(n.y))*sign_not_zero(n.x);
+        n.y = (1-std::abs(n.x))*sign_not_zero(n.y);
+        n.x = fx;
+    }
+    return n.normalize();
+}
+
+Mat4f dequantize_matrix(const Mat4f &M, const Vec3f &lo, const Vec3f &step) {
+    Mat4f D;
+    for (int k=0; k<3; k++) {
+        D.c[k][k] = step[k];
+        D.c[3][k] = lo[k];
+    }
+    return M*D;
+}
+
+// best of repeat single threaded vertex stages over the whole model, ms
+static double time_vertex_stage(Model &model, const Mat4f &M, std::vector<Vec3f> &out, int repeat) {
+    out.resize(model.nverts());
+    double best = 1e30;
+    for (int r=0; r<std::max(1, repeat); r++) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        model.transform_verts(M, out.data(), 0, model.nverts());
+        best = std::min(best, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now()-start).count());
+    }
+    return best;
+}
+
+bool vertex_benchmark(const char *filename, int normal_bits, int repeat) {
+    Model::set_quantization(0);
+    Model full(filename), quant(filename);
+    if (!full.nfaces()) return false;
+    quant.quantize(normal_bits ? normal_bits : 16);
+    const int nverts = full.nverts();
+    const Mat4f M = camera_matrix(RenderParams());
+    std::vector<Vec3f> a, b;
+    double full_ms = time_vertex_stage(full, M, a, repeat);
+    double quant_ms = time_vertex_stage(quant, M, b, repeat);
+
+    float screen_error = 0, uv_error = 0, normal_error = 0;
+    for (int i=0; i<nverts; i++) screen_error = std::max(screen_error, (a[i]-b[i]).norm());
+    for (int f=0; f<full.nfaces(); f++) {
+        for (int j=0; j<3; j++) {
+            Vec2f d = full.uv(f, j)-quant.uv(f, j);
+            uv_error = std::max(uv_error, std::max(std::abs(d.x), std::abs(d.y)));
+            float c = full.normal(f, j)*quant.normal(f, j);
+            normal_error = std::max(normal_error, std::acos(std::min(1.f, c))*180.f/(float)M_PI);
+        }
+    }
+    Vec3f lo, hi;
+    full.bounds(lo, hi);
+    const double full_bpv = (double)full.attribute_bytes()/nverts, quant_bpv = (double)quant.attribute_bytes()/nverts;
+    fprintf(stderr, "%s: %d vertices, best of %d single threaded vertex stages\n", filename, nverts, repeat);
+    fprintf(stderr, "  float     %6.1f attribute bytes per vertex %8.3f ms %8.1f Mverts/s %8.1f MB/s of positions\n",
+            full_bpv, full_ms, nverts/full_ms*1e-3, nverts*sizeof(Vec3f)/full_ms*1e-3);
+    fprintf(stderr, "  quantized %6.1f attribute bytes per vertex %8.3f ms %8.1f Mverts/s %8.1f MB/s of positions (%.0f%% of the bytes, %d-bit normals)\n",
+            quant_bpv, quant_ms, nverts/quant_ms*1e-3, nverts*3*sizeof(uint16_t)/quant_ms*1e-3, 100*quant_bpv/full_bpv, quant.normal_bits());
+    fprintf(stderr, "  max error: position %g (%.5f%% of the box diagonal), screen %.4f px, uv %g, normal %.3f degrees\n",
+            quant.quantization_error(), 100*quant.quantization_error()/std::max(1e-30f, (hi-lo).norm()), screen_error, uv_error, normal_error);
+    return true;
+}
@@ -0,0 +1,40 @@
+#ifndef __QUANTIZE_H__
+#define __QUANTIZE_H__
+#include <cstdint>
+#include "geometry.h"
+
+// Quantized vertex attributes (./main --quantize 8|16). Positions are three
+// 16-bit unorms over the mesh box, uvs two over their own box, normals are
+// octahedral, two snorms of 8 or 16 bits. A coordinate is lo + q*step; the
+// vertex stage folds lo and step into its matrix (dequantize_matrix()) and
+// converts the integers with SIMD (transform_quantized_points() in geometry.h),
+// other fetches decode one value at a time. The error of a position is at
+// most step/2 per axis.
+static const int QUANT_MAX = 65535;
+
+inline float quant_step(float lo, float hi) {
+    return hi>lo ? (hi-lo)/QUANT_MAX : 0.f;
+}
+
+inline uint16_t quantize_unorm16(float v, float lo, float step) {
+    if (step<=0) return 0;
+    float q = std::floor((v-lo)/step + .5f);
+    return (uint16_t)(q<0 ? 0 : q>QUANT_MAX ? QUANT_MAX : q);
+}
+
+inline float dequantize_unorm16(uint16_t q, float lo, float step) {
+    return lo + q*step;
+}
+
+// octahedral mapping of a unit vector to two snorms of the given bits (8 or 16)
+void oct_encode(Vec3f n, int bits, int16_t &x, int16_t &y);
+Vec3f oct_decode(int16_t x, int16_t y, int bits); // normalized
+
+// M*(lo + q*step): takes quantized positions straight to where M takes the floats
+Mat4f dequantize_matrix(const Mat4f &M, const Vec3f &lo, const Vec3f &step);
+
+// ./main --vertex-bench model.obj [repeat]: attribute bytes per vertex, vertex
+// stage throughput and the largest position error, float against quantized
+bool vertex_benchmark(const char *filename, int normal_bits, int repeat=20);
+
+#endif //__QUANTIZE_H__
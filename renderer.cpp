@@ -0,0 +1,828 @@
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cmath>
+#include <limits>
+#include "renderer.h"
+#include "jobs.h"
+#include "pipeLine.h"
+#include "quantize.h"
+#include "stats.h"
+#include "trace.h"
+#include "vtexture.h"
+
+// runs every model vertex through M once per pass (the batched vertex stage)
+static void transform_vertices(Model &model, const Mat4f &M, std::vector<Vec3f> &out) {
+    STATS_TIMER(STAGE_VERTEX);
+    out.resize(model.nverts());
+    Vec3f *dst = out.data();
+    JobSystem::instance().parallel_for(0, (int)out.size(), 4096, [&](int i0, int i1) {
+        model.transform_verts(M, dst+i0, i0, i1);
+    });
+}
+
+// The raster passes split the frame into horizontal bands, one task each.
+// Every band sees the triangles in submission order, so the image is the same
+// for any number of bands. pass(clip) draws into clip, the band cut by one of
+// the regions; clip is NULL for the whole frame when there is a single band.
+template <typename F> static void for_bands(int width, int height, const ScreenRect *regions, int nregions, const F &pass) {
+    JobSystem &jobs = JobSystem::instance();
+    int nbands = jobs.threads()==1 ? 1 : std::min(height, 4*jobs.threads());
+    jobs.parallel_for(0, nbands, 1, [&](int b0, int b1) {
+        for (int b=b0; b<b1; b++) {
+            if (!regions && nbands==1) {
+                pass((const ScreenRect *)NULL);
+                continue;
+            }
+            ScreenRect band(0, height*b/nbands, width-1, height*(b+1)/nbands-1);
+            if (!regions) {
+                pass(&band);
+                continue;
+            }
+            for (int r=0; r<nregions; r++) {
+                ScreenRect clip = band.intersection(regions[r]);
+                if (!clip.empty()) pass(&clip);
+            }
+        }
+    });
+}
+
+// Faces of one object in the order the main pass draws them: its clusters
+// (see Model::cluster()) nearest first, with their screen rectangles.
+struct ClusterOrder {
+    const int *cluster;
+    const ScreenRect *rect; // per cluster, with two pixels of slack, not clipped to the frame
+    int n;
+};
+
+// screen rectangle of a box under M, with two pixels of slack, and the depth
+// of its centre (larger is nearer); a box crossing the eye plane is nearest
+// and everywhere
+static void project_box(const Vec3f &lo, const Vec3f &hi, const Mat4f &M, ScreenRect &rect, float &depth) {
+    float x0 = std::numeric_limits<float>::max(), y0 = x0, z0 = x0, x1 = -x0, y1 = -x0, z1 = -x0;
+    for (int k=0; k<8; k++) {
+        Vec4f p = M*embed<4>(Vec3f(k&1 ? hi.x : lo.x, k&2 ? hi.y : lo.y, k&4 ? hi.z : lo.z));
+        if (p[3]<=1e-6f) {
+            x0 = y0 = -1e9f;
+            x1 = y1 = z0 = z1 = 1e9f;
+            break;
+        }
+        x0 = std::min(x0, p[0]/p[3]); x1 = std::max(x1, p[0]/p[3]);
+        y0 = std::min(y0, p[1]/p[3]); y1 = std::max(y1, p[1]/p[3]);
+        z0 = std::min(z0, p[2]/p[3]); z1 = std::max(z1, p[2]/p[3]);
+    }
+    depth = (z0+z1)/2;
+    rect = ScreenRect((int)std::floor(x0)-2, (int)std::floor(y0)-2, (int)std::ceil(x1)+2, (int)std::ceil(y1)+2);
+}
+
+static ClusterOrder sort_clusters(Model &model, const Mat4f &M, FrameArena &arena) {
+    ClusterOrder order;
+    order.n = model.nclusters();
+    int *cluster = arena.alloc<int>(order.n);
+    ScreenRect *rect = arena.alloc<ScreenRect>(order.n);
+    float *depth = arena.alloc<float>(order.n);
+    for (int c=0; c<order.n; c++) {
+        const FaceCluster &fc = model.cluster(c);
+        cluster[c] = c;
+        project_box(fc.lo, fc.hi, M, rect[c], depth[c]);
+    }
+    std::sort(cluster, cluster+order.n, [depth](int a, int b) { return depth[a]>depth[b] || (depth[a]==depth[b] && a<b); });
+    order.cluster = cluster;
+    order.rect = rect;
+    return order;
+}
+
+// whether a face's screen bounds stay out of clip, with a pixel of slack for multisample positions
+static inline bool face_outside(const Vec3f &a, const Vec3f &b, const Vec3f &c, const ScreenRect &clip) {
+    return std::max(a.x, std::max(b.x, c.x))<clip.x0-1 || std::min(a.x, std::min(b.x, c.x))>clip.x1+1 ||
+           std::max(a.y, std::max(b.y, c.y))<clip.y0-1 || std::min(a.y, std::min(b.y, c.y))>clip.y1+1;
+}
+
+// draw(iface) for the faces whose screen bounds reach into clip, every face if clip is NULL;
+// a pixel of slack either way for multisample positions. Faces in the order of
+// clusters if given, in model order otherwise.
+template <typename F> static void for_faces(Model &model, const Vec3f *screen_verts, const ScreenRect *clip, const ClusterOrder *clusters, const F &draw) {
+    int n = clusters ? clusters->n : 1;
+    for (int k=0; k<n; k++) {
+        int begin = 0, end = model.nfaces();
+        if (clusters) {
+            int c = clusters->cluster[k];
+            if (clip && !clip->overlaps(clusters->rect[c])) continue;
+            const FaceCluster &fc = model.cluster(c);
+            begin = fc.begin;
+            end = fc.end;
+        }
+        for (int i=begin; i<end; i++) {
+            if (clip && face_outside(screen_verts[model.vert_index(i, 0)], screen_verts[model.vert_index(i, 1)],
+                                     screen_verts[model.vert_index(i, 2)], *clip)) continue;
+            draw(i);
+        }
+    }
+}
+
+struct DepthShader : public IShader {
+    Model *model;
+    const Vec3f *uniform_screen_verts; // model vertices in screen coordinates
+    mat<3,3,float> varying_tri;
+
+    DepthShader(Model *m, const Vec3f *screen_verts) : model(m), uniform_screen_verts(screen_verts), varying_tri() {}
+
+    virtual Vec3f vertex(int iface, int nthvert) {
+        Vec3f gl_Vertex = uniform_screen_verts[model->vert_index(iface, nthvert)];
+        varying_tri.set_col(nthvert, gl_Vertex);
+        return gl_Vertex;
+    }
+    virtual bool fragment(Vec3f bar, TGAColor &color) {
+        Vec3f p = varying_tri*bar;
+        color = TGAColor(255, 255, 255)*(p.z/depth);
+        return false;
+    }
+};
+
+struct Shader : public IShader {
+    Model *model;
+    const Vec3f *uniform_screen_verts; // model vertices in screen coordinates
+    const DepthBuffer *uniform_shadowbuffer;
+    int uniform_width, uniform_height; // of the shadow buffer
+    Mat4f uniform_MIT;     // (Projection*ModelView).invert_transpose()
+    Mat4f uniform_Mshadow; // transform framebuffer screen coordinates to shadowbuffer screen coordinates, z as stored there
+    Vec3f uniform_l;       // light direction in view space
+    mat<2,3,float> varying_uv;  // triangle uv coordinates, written by the vertex shader, read by the fragment shader
+    mat<3,3,float> varying_tri; // triangle coordinates before Viewport transform, written by VS, read by FS
+    float varying_uv_lod;       // log2 of the uv extent of one pixel, selects virtual texture mips
+    const LightGrid *uniform_grid;   // point and spot lights, NULL if there are none
+    const Light *uniform_lights;
+    Mat4f uniform_screen_to_world;
+    Mat4f uniform_model;             // model to world, for the normals
+    Vec3f uniform_eye;
+    Vec3f uniform_tint;              // rgb factor on the diffuse texture
+    uint64_t light_evals;            // lights evaluated over all fragments
+
+    Shader(Model *m, const Vec3f *screen_verts, const DepthBuffer *shadowbuffer, Vec3f light_dir, Matrix M, Matrix MIT, const Mat4f &MS)
+        : model(m), uniform_screen_verts(screen_verts), uniform_shadowbuffer(shadowbuffer), uniform_width(shadowbuffer->width),
+          uniform_height(shadowbuffer->height), uniform_MIT(MIT), uniform_Mshadow(MS), uniform_l(), varying_uv(), varying_tri(), varying_uv_lod(0),
+          uniform_grid(NULL), uniform_lights(NULL), uniform_screen_to_world(), uniform_model(), uniform_eye(), uniform_tint(1,1,1), light_evals(0) {
+        uniform_l = v4tov3(Mat4f(M)*embed<4>(light_dir)).normalize();
+        if (shadowbuffer->format!=DEPTH_FLOAT) uniform_Mshadow = shadowbuffer->encoding()*uniform_Mshadow; // compared as stored, no decode per fragment
+    }
+
+    virtual Vec3f vertex(int iface, int nthvert) {
+        return set_vertex(nthvert, model->uv(iface, nthvert), uniform_screen_verts[model->vert_index(iface, nthvert)]);
+    }
+
+    Vec3f set_vertex(int nthvert, Vec2f uv, Vec3f gl_Vertex) {
+        varying_uv.set_col(nthvert, uv);
+        varying_tri.set_col(nthvert, gl_Vertex);
+        if (2==nthvert) {
+            Vec2f t0 = varying_uv.col(0), t1 = varying_uv.col(1), t2 = varying_uv.col(2);
+            Vec3f p0 = varying_tri.col(0), p1 = varying_tri.col(1), p2 = varying_tri.col(2);
+            float uv_area = std::abs((t1.x-t0.x)*(t2.y-t0.y) - (t2.x-t0.x)*(t1.y-t0.y));
+            float screen_area = std::abs((p1.x-p0.x)*(p2.y-p0.y) - (p2.x-p0.x)*(p1.y-p0.y));
+            varying_uv_lod = screen_area>0 && uv_area>0 ? .5f*std::log2(uv_area/screen_area) : -1e9f;
+        }
+        return gl_Vertex;
+    }
+
+    // the shadow buffer value at i as stored, the common formats read inline
+    float shadow_stored(int i) const {
+        const DepthBuffer &b = *uniform_shadowbuffer;
+        switch (b.format) {
+        case DEPTH_UNORM16: return b.unorm16[i];
+        case DEPTH_UNORM24: return b.stored(i);
+        default:            return b.floats[i];
+        }
+    }
+
+    virtual bool fragment(Vec3f bar, TGAColor &color) {
+        Vec3f p = varying_tri*bar;
+        Vec3f sb_p = uniform_Mshadow.transform_point(p); // corresponding point in the shadow buffer
+        int sx = int(sb_p[0]), sy = int(sb_p[1]);
+        bool lit = sx<0 || sy<0 || sx>=uniform_width || sy>=uniform_height || shadow_stored(sx + sy*uniform_width)<sb_p[2];
+        float shadow = .3+.7*lit; //  avoid z-fighting
+
+        Vec2f uv = varying_uv*bar;
+        Vec3f nm = model->normal(uv, varying_uv_lod);
+        Vec3f n = v4tov3(uniform_MIT*embed<4>(nm)).normalize();
+        const Vec3f &l = uniform_l;
+        Vec3f r = (n*(n*l*2.f) - l).normalize();   // reflected light
+        float shininess = model->specular(uv, varying_uv_lod);
+        float spec = pow(std::max(r.z, 0.0f), shininess);
+        float diff = std::max(0.f, n*l);
+        TGAColor c = model->diffuse(uv, varying_uv_lod);
+
+        Vec3f lights(0, 0, 0); // rgb
+        if (uniform_grid) {
+            int nlights;
+            const int *idx = uniform_grid->lights_at(int(p.x), int(p.y), nlights);
+            if (nlights) {
+                Vec3f pw = uniform_screen_to_world.transform_point(p);
+                Vec3f nw = proj<3>(uniform_model*embed<4>(nm, 0.f)).normalize();
+                Vec3f v = (uniform_eye-pw).normalize();
+                for (int k=0; k<nlights; k++) lights = lights + uniform_lights[idx[k]].illuminate(pw, nw, v, shininess);
+                light_evals += nlights;
+            }
+        }
+        float ao = model->ambient_occlusion(uv, varying_uv_lod);
+        for (int i=0; i<3; i++) {
+            float ci = c[i]*uniform_tint[2-i]; // bgr
+            color[i] = std::min<float>(ao*(20 + ci*shadow*(1.2*diff + .6*spec) + ci*lights[2-i]), 255);
+        }
+        return false;
+    }
+};
+
+// The shaders over a resident MeshStream chunk: its faces index its own
+// vertices, which screen_verts holds transformed.
+struct ChunkDepthShader : public DepthShader {
+    const MeshChunk *chunk;
+
+    ChunkDepthShader(const MeshChunk *c, const Vec3f *screen_verts) : DepthShader(NULL, screen_verts), chunk(c) {}
+
+    virtual Vec3f vertex(int iface, int nthvert) {
+        Vec3f gl_Vertex = uniform_screen_verts[chunk->indices[iface*3+nthvert]];
+        varying_tri.set_col(nthvert, gl_Vertex);
+        return gl_Vertex;
+    }
+};
+
+struct ChunkShader : public Shader {
+    const MeshChunk *chunk;
+
+    ChunkShader(const Shader &shader, const MeshChunk *c) : Shader(shader), chunk(c) {}
+
+    virtual Vec3f vertex(int iface, int nthvert) {
+        int v = chunk->indices[iface*3+nthvert];
+        return set_vertex(nthvert, chunk->uv(v), uniform_screen_verts[v]);
+    }
+};
+
+void RenderTarget::resize(int w, int h, DepthFormat format, float zfar, float znear) {
+    if (w!=width || h!=height || frame.get_width()!=w) {
+        width = w;
+        height = h;
+        frame = TGAImage(w, h, TGAImage::RGB);
+    } else {
+        frame.clear();
+    }
+    zbuffer.reset(format, w, h, zfar, znear);
+}
+
+// widens [zlo, zhi] to the screen depths of the box lo..hi under M; a box
+// crossing the eye plane reaches to the near end of the viewport's depth
+static void box_depth_range(const Vec3f &lo, const Vec3f &hi, const Mat4f &M, float &zlo, float &zhi) {
+    for (int k=0; k<8; k++) {
+        Vec4f p = M*embed<4>(Vec3f(k&1 ? hi.x : lo.x, k&2 ? hi.y : lo.y, k&4 ? hi.z : lo.z));
+        if (p[3]<=1e-6f) {
+            zhi = std::max(zhi, depth);
+            continue;
+        }
+        zlo = std::min(zlo, p[2]/p[3]);
+        zhi = std::max(zhi, p[2]/p[3]);
+    }
+}
+
+void scene_depth_range(const std::vector<SceneObject> &scene, const Mat4f &world_to_screen, float &zlo, float &zhi) {
+    zlo = std::numeric_limits<float>::max();
+    zhi = -zlo;
+    for (size_t k=0; k<scene.size(); k++) {
+        Vec3f lo, hi;
+        scene[k].model->bounds(lo, hi);
+        box_depth_range(lo, hi, world_to_screen*Mat4f(scene[k].transform), zlo, zhi);
+    }
+    if (zlo>zhi) { // nothing to draw
+        zlo = 0;
+        zhi = depth;
+    }
+}
+
+// the pixels of the frame a render draws
+static ScreenRect render_window(const RenderParams &params) {
+    return params.window.empty() ? ScreenRect(0, 0, params.width-1, params.height-1) : params.window;
+}
+
+// the main pass matrices, the viewport shifted so that the window starts at (0, 0)
+static void set_camera(const RenderParams &params) {
+    ScreenRect w = render_window(params);
+    set_view(params.eye, params.center, params.up);
+    set_projection(-1.f/(params.eye-params.center).norm());
+    set_viewport(params.width/8-w.x0, params.height/8-w.y0, params.width*3/4, params.height*3/4);
+}
+
+// FNV-1a over the geometry version and transform of a shadow caster, h is the
+// hash of the casters before it
+static uint64_t geometry_key(uint64_t h, uint64_t version, const Matrix &transform) {
+    auto mix = [&h](const void *p, size_t n) {
+        for (size_t i=0; i<n; i++) h = (h ^ ((const unsigned char *)p)[i]) * 1099511628211ull;
+    };
+    mix(&version, sizeof(version));
+    for (int i=0; i<4; i++) for (int j=0; j<4; j++) mix(&transform[i][j], sizeof(float));
+    return h;
+}
+
+static const uint64_t GEOMETRY_KEY_SEED = 14695981039346656037ull;
+
+static uint64_t scene_geometry_key(const std::vector<SceneObject> &scene) {
+    uint64_t h = GEOMETRY_KEY_SEED;
+    for (size_t k=0; k<scene.size(); k++) h = geometry_key(h, scene[k].model->geometry_version(), scene[k].transform);
+    return h;
+}
+
+// the shadow pass proper, called by the ShadowCache on a miss
+static void build_shadow_map(const std::vector<SceneObject> &scene, const RenderParams &params, Vec3f light_dir, RenderTarget &target, ShadowMap &map) {
+    const int width = params.width, height = params.height;
+    map.width = width;
+    map.height = height;
+    map.image = TGAImage(width, height, TGAImage::RGB);
+    set_view(light_dir, params.center, params.up);
+    set_projection(0);
+    set_viewport(width/8, height/8, width*3/4, height*3/4);
+    map.transform = Mat4f(viewport)*Mat4f(projection)*Mat4f(view);
+    float zlo, zhi;
+    scene_depth_range(scene, map.transform, zlo, zhi);
+    map.buffer.reset(params.shadow_format, width, height, zlo, zhi);
+    const ImageView image = map.image.view();
+    stats_pass_begin("shadow");
+    {
+        TRACE_SCOPE("shadow_pass");
+        for (size_t k=0; k<scene.size(); k++) {
+            Model &model = *scene[k].model;
+            transform_vertices(model, map.transform*Mat4f(scene[k].transform), target.screen_verts);
+            const DepthShader depthshader(&model, target.screen_verts.data());
+            for_bands(width, height, NULL, 0, [&](const ScreenRect *clip) {
+                DepthShader shader = depthshader;
+                Vec3f screen_coords[3];
+                STATS_VERTEX_TIMER(vertex_timer);
+                for_faces(model, target.screen_verts.data(), clip, NULL, [&](int i) {
+                    STATS_VERTICES(vertex_timer, for (int j=0; j<3; j++) screen_coords[j] = shader.vertex(i, j));
+                    triangle(screen_coords, shader, image, map.buffer, clip);
+                });
+            });
+        }
+    }
+    stats_pass_end();
+}
+
+// pixels the projected vertices of one object may cover
+static ScreenRect vertex_bounds(const std::vector<Vec3f> &verts, int width, int height) {
+    if (verts.empty()) return ScreenRect();
+    float x0 = verts[0].x, y0 = verts[0].y, x1 = x0, y1 = y0;
+    for (size_t i=1; i<verts.size(); i++) {
+        x0 = std::min(x0, verts[i].x); x1 = std::max(x1, verts[i].x);
+        y0 = std::min(y0, verts[i].y); y1 = std::max(y1, verts[i].y);
+    }
+    if (x1<0 || y1<0 || x0>width-1 || y0>height-1) return ScreenRect();
+    return ScreenRect(std::max(0, (int)std::floor(x0)), std::max(0, (int)std::floor(y0)),
+                      std::min(width-1, (int)std::ceil(x1)), std::min(height-1, (int)std::ceil(y1)));
+}
+
+ScreenRect project_bounds(Model &model, const Mat4f &M, int width, int height) {
+    static thread_local std::vector<Vec3f> verts;
+    verts.resize(model.nverts());
+    model.transform_verts(M, verts.data(), 0, model.nverts());
+    return vertex_bounds(verts, width, height);
+}
+
+// Drawing order of the objects of a scene and, with params.occlusion, the
+// ones the main pass can skip. With params.front_to_back the nearest come
+// first (those crossing the eye plane before all), so their depth is in the
+// zbuffer before what they hide is shaded; otherwise scene order.
+// Occlusion culling: the nearest objects big enough on screen are drawn into
+// the occlusion buffer, each only if the ones before do not hide it already;
+// then every other object is tested against it. Off screen objects are hidden too.
+static const int MAX_OCCLUDERS = 16;
+
+static void order_objects(const std::vector<SceneObject> &scene, const RenderParams &params, const Mat4f &world_to_screen,
+                          RenderTarget &target, int *draw, unsigned char *hidden) {
+    const int n = scene.size(), width = target.width, height = target.height;
+    for (int k=0; k<n; k++) {
+        draw[k] = k;
+        hidden[k] = 0;
+    }
+    if (n<2 || (!params.occlusion && !params.front_to_back)) return;
+    TRACE_SCOPE("order_objects");
+    ScreenRect *rect = target.arena.alloc<ScreenRect>(n);
+    float *zmax = target.arena.alloc<float>(n);
+    int *order = target.arena.alloc<int>(n);
+    unsigned char *occluder = target.arena.alloc<unsigned char>(n);
+    int nboxed = 0;
+    for (int k=0; k<n; k++) {
+        occluder[k] = 0;
+        if (!screen_box(*scene[k].model, world_to_screen*Mat4f(scene[k].transform), width, height, rect[k], zmax[k])) { // crosses the eye plane, always drawn
+            zmax[k] = std::numeric_limits<float>::max();
+            continue;
+        }
+        if (rect[k].empty()) {
+            hidden[k] = params.occlusion;
+            continue;
+        }
+        // a pixel of slack for the rounding of the main pass matrices
+        rect[k] = ScreenRect(rect[k].x0-1, rect[k].y0-1, rect[k].x1+1, rect[k].y1+1).intersection(ScreenRect(0, 0, width-1, height-1));
+        order[nboxed++] = k;
+    }
+    std::sort(order, order+nboxed, [zmax](int a, int b) { return zmax[a]>zmax[b]; }); // nearest first
+    if (params.front_to_back) {
+        std::sort(draw, draw+n, [zmax](int a, int b) { return zmax[a]>zmax[b] || (zmax[a]==zmax[b] && a<b); }); // stable_sort would allocate
+    }
+    if (!params.occlusion) return;
+    target.occlusion.clear(width, height, params.msaa ? params.msaa : 1, target.arena);
+    for (int i=0, noccluders=0; i<nboxed && noccluders<MAX_OCCLUDERS; i++) {
+        int k = order[i];
+        const ScreenRect &r = rect[k];
+        if ((r.x1-r.x0+1)*(r.y1-r.y0+1)*64 < width*height) continue; // too small to hide much
+        if (target.occlusion.occluded(r, zmax[k])) {
+            hidden[k] = 1;
+            continue;
+        }
+        Model &model = *scene[k].model;
+        transform_vertices(model, Mat4f(viewport)*(Mat4f(projection)*Mat4f(view)*Mat4f(scene[k].transform)), target.screen_verts);
+        target.occlusion.rasterize(model, target.screen_verts.data());
+        occluder[k] = 1;
+        noccluders++;
+    }
+    for (int i=0; i<nboxed; i++) {
+        int k = order[i];
+        if (!occluder[k] && !hidden[k] && target.occlusion.occluded(rect[k], zmax[k])) hidden[k] = 1;
+    }
+}
+
+Mat4f camera_matrix(const RenderParams &params) {
+    set_camera(params);
+    return Mat4f(viewport)*Mat4f(projection)*Mat4f(view);
+}
+
+// Shadow map, camera and main pass over every object of the scene. regions
+// NULL: the whole frame (target already resized and cleared), otherwise only
+// those rectangles, which the caller has cleared.
+static void draw_scene(const std::vector<SceneObject> &scene, const RenderParams &params, RenderTarget &target,
+                       const ScreenRect *regions, int nregions) {
+    const int width = target.width, height = target.height;
+    Vec3f light_dir = params.light_dir;
+    light_dir.normalize();
+    Matrix saved_model = modelTras;
+
+    // rendering the shadow buffer, unless an identical one is cached
+    ShadowKey key;
+    key.geometry = scene_geometry_key(scene);
+    for (int i=0; i<3; i++) {
+        key.light[i] = light_dir[i];
+        key.center[i] = params.center[i];
+        key.up[i] = params.up[i];
+    }
+    key.width = params.width; // the shadow pass covers the whole frame
+    key.height = params.height;
+    key.format = params.shadow_format;
+    struct { const std::vector<SceneObject> *scene; const RenderParams *params; Vec3f light_dir; RenderTarget *target; } job =
+        {&scene, &params, light_dir, &target};
+    target.shadow = ShadowCache::instance().get(key, [&job](ShadowMap &map) { // one pointer, std::function does not allocate
+        build_shadow_map(*job.scene, *job.params, job.light_dir, *job.target, map);
+    });
+    const ShadowMap &shadow = *target.shadow;
+
+    // rendering the frame buffer
+    set_camera(params);
+    Mat4f world_to_screen = Mat4f(viewport)*Mat4f(projection)*Mat4f(view);
+    target.bounds.resize(scene.size());
+    int *draw = target.arena.alloc<int>(scene.size());
+    unsigned char *hidden = target.arena.alloc<unsigned char>(scene.size());
+    order_objects(scene, params, world_to_screen, target, draw, hidden);
+
+    if (!params.lights.empty()) {
+        if (!params.msaa) { // the multisampled pass keeps its own depth, cull in screen x and y only
+            stats_pass_begin("depth_prepass");
+            TRACE_SCOPE("depth_prepass");
+            for (size_t k=0; k<scene.size(); k++) {
+                if (hidden[k]) continue;
+                Model &model = *scene[k].model;
+                transform_vertices(model, Mat4f(viewport)*(Mat4f(projection)*Mat4f(view)*Mat4f(scene[k].transform)), target.screen_verts);
+                const Vec3f *verts = target.screen_verts.data();
+                for_bands(width, height, NULL, 0, [&](const ScreenRect *clip) {
+                    Vec3f screen_coords[3];
+                    for_faces(model, verts, clip, NULL, [&](int i) {
+                        for (int j=0; j<3; j++) screen_coords[j] = verts[model.vert_index(i, j)];
+                        triangle_depth(screen_coords, target.zbuffer, clip);
+                    });
+                });
+            }
+            stats_pass_end();
+        }
+        TRACE_SCOPE("light_culling");
+        target.lights.build(params.lights, world_to_screen, params.msaa ? NULL : &target.zbuffer, width, height, target.arena);
+    }
+    if (params.msaa) target.msaa.resize(width, height, params.msaa, target.frame.get_bytespp());
+    stats_pass_begin("main", params.overdraw ? width : 0, params.overdraw ? height : 0);
+    const ImageView frame = target.frame.view();
+    uint64_t light_evals = 0;
+    for (size_t d=0; d<scene.size(); d++) {
+        int k = draw[d];
+        if (hidden[k]) {
+            target.bounds[k] = ScreenRect();
+            STATS_ADD(objects_culled, 1);
+            continue;
+        }
+        const SceneObject &obj = scene[k];
+        Model &model = *obj.model;
+        modelTras = obj.transform;
+        Mat4f PV = Mat4f(projection)*Mat4f(view)*Mat4f(obj.transform);
+        Mat4f VPV = Mat4f(viewport)*PV;
+        transform_vertices(model, VPV, target.screen_verts);
+        target.bounds[k] = vertex_bounds(target.screen_verts, width, height);
+        Shader shader(&model, target.screen_verts.data(), &shadow.buffer, light_dir,
+                      view, PV.invert_transpose(), shadow.transform*Mat4f(obj.transform)*VPV.inverse());
+        shader.uniform_tint = obj.tint;
+        if (!params.lights.empty()) {
+            shader.uniform_grid = &target.lights;
+            shader.uniform_lights = params.lights.data();
+            shader.uniform_screen_to_world = world_to_screen.inverse();
+            shader.uniform_model = Mat4f(obj.transform);
+            shader.uniform_eye = params.eye;
+        }
+        bool vrs = obj.shading_rate>1 || (!obj.shading_rate && params.shading_rate>1);
+        ClusterOrder clusters;
+        if (params.front_to_back) clusters = sort_clusters(model, VPV, target.arena);
+        TRACE_SCOPE("main_pass");
+        std::atomic<uint64_t> evals(0);
+        for_bands(width, height, regions, nregions, [&](const ScreenRect *clip) {
+            if (clip && !clip->overlaps(target.bounds[k])) return;
+            Shader band_shader = shader; // the varyings are per band
+            Vec3f screen_coords[3];
+            STATS_VERTEX_TIMER(vertex_timer);
+            for_faces(model, target.screen_verts.data(), clip, params.front_to_back ? &clusters : NULL, [&](int i) {
+                STATS_VERTICES(vertex_timer, for (int j=0; j<3; j++) screen_coords[j] = band_shader.vertex(i, j));
+                if (params.msaa) triangle_msaa(screen_coords, band_shader, target.msaa, clip);
+                else if (vrs) triangle_vrs(screen_coords, band_shader, frame, target.zbuffer, &target.rates, obj.shading_rate, clip);
+                else triangle(screen_coords, band_shader, frame, target.zbuffer, clip);
+            });
+            evals += band_shader.light_evals;
+        });
+        light_evals += evals;
+    }
+    if (params.msaa) {
+        TRACE_SCOPE("msaa_resolve");
+        STATS_TIMER(STAGE_RASTER);
+        JobSystem::instance().parallel_for(0, height, 16, [&](int y0, int y1) {
+            target.msaa.resolve_rows(frame, y0, y1-1);
+        });
+    }
+    STATS_ADD(light_evaluations, light_evals);
+    stats_pass_end();
+    modelTras = saved_model;
+}
+
+void render(Model &model, const RenderParams &params, RenderTarget &target) {
+    static thread_local std::vector<SceneObject> scene(1);
+    scene[0].model = &model;
+    scene[0].transform = modelTras;
+    render_scene(scene, params, target);
+}
+
+void render_scene(const std::vector<SceneObject> &scene, const RenderParams &params, RenderTarget &target) {
+    TRACE_SCOPE("render");
+    VirtualTexture::Frame vt_frame;
+    target.arena.reset();
+    const ScreenRect window = render_window(params);
+    if (params.shading_rate>1) {
+        if (params.adaptive_rate) target.rates.adapt(window.x1-window.x0+1, window.y1-window.y0+1, params.shading_rate);
+        else target.rates.fill(window.x1-window.x0+1, window.y1-window.y0+1, params.shading_rate);
+    }
+    float zlo, zhi;
+    scene_depth_range(scene, camera_matrix(params), zlo, zhi);
+    target.resize(window.x1-window.x0+1, window.y1-window.y0+1, params.depth_format, zlo, zhi);
+    draw_scene(scene, params, target, NULL, 0);
+    if (params.shading_rate>1 && params.adaptive_rate) target.rates.measure(target.frame.view(), target.zbuffer, params.shading_rate);
+}
+
+void render_regions(const std::vector<SceneObject> &scene, const RenderParams &params, RenderTarget &target,
+                    const ScreenRect *regions, int nregions) {
+    TRACE_SCOPE("render_regions");
+    VirtualTexture::Frame vt_frame;
+    const ScreenRect window = render_window(params);
+    assert(target.width==window.x1-window.x0+1 && target.height==window.y1-window.y0+1 && !params.msaa && params.lights.empty());
+    (void)window;
+    TGAColor black(0, 0, 0);
+    for (int r=0; r<nregions; r++) {
+        const ScreenRect &rect = regions[r];
+        for (int y=rect.y0; y<=rect.y1; y++) {
+            for (int x=rect.x0; x<=rect.x1; x++) target.frame.set(x, y, black);
+        }
+        target.zbuffer.clear(rect);
+    }
+    draw_scene(scene, params, target, regions, nregions);
+}
+
+// the vertex stage of one chunk
+static void transform_chunk(const MeshChunk &chunk, const Mat4f &M, std::vector<Vec3f> &out) {
+    STATS_TIMER(STAGE_VERTEX);
+    out.resize(chunk.nverts);
+    Vec3f *dst = out.data();
+    JobSystem::instance().parallel_for(0, chunk.nverts, 4096, [&](int i0, int i1) {
+        if (chunk.qverts) transform_quantized_points(dequantize_matrix(M, chunk.lo, chunk.step), chunk.qverts+3*i0, dst+i0, i1-i0);
+        else transform_points(M, chunk.verts+i0, dst+i0, i1-i0);
+    });
+}
+
+// draw(iface) for the faces of a chunk whose screen bounds reach into clip,
+// every face if clip is NULL; faces indexing past the chunk's vertices (a
+// damaged file) are skipped
+template <typename F> static void for_chunk_faces(const MeshChunk &chunk, const Vec3f *screen_verts, const ScreenRect *clip, const F &draw) {
+    for (int i=0; i<chunk.nfaces; i++) {
+        const uint16_t *v = chunk.indices+3*i;
+        if (v[0]>=chunk.nverts || v[1]>=chunk.nverts || v[2]>=chunk.nverts) continue;
+        if (clip && face_outside(screen_verts[v[0]], screen_verts[v[1]], screen_verts[v[2]], *clip)) continue;
+        draw(i);
+    }
+}
+
+// The chunks of mesh whose boxes reach into the width x height frame under M,
+// nearest first if sorted, in file order otherwise; rect gets the screen
+// rectangle of every chunk. The others are never read.
+static int visible_chunks(MeshStream &mesh, const Mat4f &M, int width, int height, bool sorted, FrameArena &arena,
+                          int *&order, ScreenRect *&rect) {
+    const int n = mesh.nchunks();
+    order = arena.alloc<int>(n);
+    rect = arena.alloc<ScreenRect>(n);
+    float *depth = arena.alloc<float>(n);
+    const ScreenRect frame(0, 0, width-1, height-1);
+    int visible = 0;
+    for (int c=0; c<n; c++) {
+        const MeshChunkInfo &info = mesh.info(c);
+        project_box(Vec3f(info.lo[0], info.lo[1], info.lo[2]), Vec3f(info.hi[0], info.hi[1], info.hi[2]), M, rect[c], depth[c]);
+        if (rect[c].overlaps(frame)) order[visible++] = c;
+    }
+    if (sorted) std::sort(order, order+visible, [depth](int a, int b) { return depth[a]>depth[b] || (depth[a]==depth[b] && a<b); });
+    return visible;
+}
+
+// scene_depth_range() of a stream, from the box around all of its chunks
+static void stream_depth_range(const MeshStream &mesh, const Mat4f &M, float &zlo, float &zhi) {
+    const MeshStreamHeader &h = mesh.header();
+    zlo = std::numeric_limits<float>::max();
+    zhi = -zlo;
+    box_depth_range(Vec3f(h.lo[0], h.lo[1], h.lo[2]), Vec3f(h.hi[0], h.hi[1], h.hi[2]), M, zlo, zhi);
+    if (zlo>zhi) { // behind the eye
+        zlo = 0;
+        zhi = depth;
+    }
+}
+
+// build_shadow_map() over the chunks of a stream
+static void build_stream_shadow_map(MeshStream &mesh, const RenderParams &params, Vec3f light_dir, RenderTarget &target, ShadowMap &map) {
+    const int width = params.width, height = params.height;
+    map.width = width;
+    map.height = height;
+    map.image = TGAImage(width, height, TGAImage::RGB);
+    set_view(light_dir, params.center, params.up);
+    set_projection(0);
+    set_viewport(width/8, height/8, width*3/4, height*3/4);
+    map.transform = Mat4f(viewport)*Mat4f(projection)*Mat4f(view);
+    Mat4f M = map.transform*Mat4f(modelTras);
+    float zlo, zhi;
+    stream_depth_range(mesh, M, zlo, zhi);
+    map.buffer.reset(params.shadow_format, width, height, zlo, zhi);
+    const ImageView image = map.image.view();
+    int *order;
+    ScreenRect *rect;
+    int n = visible_chunks(mesh, M, width, height, params.front_to_back, target.arena, order, rect);
+    stats_pass_begin("shadow");
+    {
+        TRACE_SCOPE("shadow_pass");
+        mesh.stream(order, n, [&](const MeshChunk &chunk) {
+            transform_chunk(chunk, M, target.screen_verts);
+            const Vec3f *verts = target.screen_verts.data();
+            for_bands(width, height, NULL, 0, [&](const ScreenRect *clip) {
+                ChunkDepthShader shader(&chunk, verts);
+                Vec3f screen_coords[3];
+                for_chunk_faces(chunk, verts, clip, [&](int i) {
+                    for (int j=0; j<3; j++) screen_coords[j] = shader.vertex(i, j);
+                    triangle(screen_coords, shader, image, map.buffer, clip);
+                });
+            });
+        });
+    }
+    stats_pass_end();
+}
+
+void render_stream(MeshStream &mesh, const RenderParams &params, RenderTarget &target) {
+    TRACE_SCOPE("render_stream");
+    VirtualTexture::Frame vt_frame;
+    target.arena.reset();
+    const ScreenRect window = render_window(params);
+    if (params.shading_rate>1) {
+        if (params.adaptive_rate) target.rates.adapt(window.x1-window.x0+1, window.y1-window.y0+1, params.shading_rate);
+        else target.rates.fill(window.x1-window.x0+1, window.y1-window.y0+1, params.shading_rate);
+    }
+    set_camera(params);
+    float zlo, zhi;
+    stream_depth_range(mesh, Mat4f(viewport)*Mat4f(projection)*Mat4f(view)*Mat4f(modelTras), zlo, zhi);
+    target.resize(window.x1-window.x0+1, window.y1-window.y0+1, params.depth_format, zlo, zhi);
+    target.screen_verts.reserve(mesh.max_chunk_verts());
+    const int width = target.width, height = target.height;
+    Vec3f light_dir = params.light_dir;
+    light_dir.normalize();
+
+    ShadowKey key;
+    key.geometry = geometry_key(GEOMETRY_KEY_SEED, mesh.geometry_version(), modelTras);
+    for (int i=0; i<3; i++) {
+        key.light[i] = light_dir[i];
+        key.center[i] = params.center[i];
+        key.up[i] = params.up[i];
+    }
+    key.width = params.width; // the shadow pass covers the whole frame
+    key.height = params.height;
+    key.format = params.shadow_format;
+    struct { MeshStream *mesh; const RenderParams *params; Vec3f light_dir; RenderTarget *target; } job = {&mesh, &params, light_dir, &target};
+    target.shadow = ShadowCache::instance().get(key, [&job](ShadowMap &map) {
+        build_stream_shadow_map(*job.mesh, *job.params, job.light_dir, *job.target, map);
+    });
+    const ShadowMap &shadow = *target.shadow;
+
+    set_camera(params);
+    Mat4f PV = Mat4f(projection)*Mat4f(view)*Mat4f(modelTras);
+    Mat4f VPV = Mat4f(viewport)*PV;
+    int *order;
+    ScreenRect *rect;
+    int n = visible_chunks(mesh, VPV, width, height, params.front_to_back, target.arena, order, rect);
+    const Shader shader(&mesh.material(), NULL, &shadow.buffer, light_dir,
+                        view, PV.invert_transpose(), shadow.transform*Mat4f(modelTras)*VPV.inverse());
+    if (params.msaa) target.msaa.resize(width, height, params.msaa, target.frame.get_bytespp());
+    const ImageView frame = target.frame.view();
+    stats_pass_begin("main", params.overdraw ? width : 0, params.overdraw ? height : 0);
+    {
+        TRACE_SCOPE("main_pass");
+        int k = 0;
+        mesh.stream(order, n, [&](const MeshChunk &chunk) {
+            const ScreenRect &chunk_rect = rect[order[k++]];
+            transform_chunk(chunk, VPV, target.screen_verts);
+            const Vec3f *verts = target.screen_verts.data();
+            for_bands(width, height, NULL, 0, [&](const ScreenRect *clip) {
+                if (clip && !clip->overlaps(chunk_rect)) return;
+                ChunkShader band_shader(shader, &chunk); // the varyings are per band
+                band_shader.uniform_screen_verts = verts;
+                Vec3f screen_coords[3];
+                STATS_VERTEX_TIMER(vertex_timer);
+                for_chunk_faces(chunk, verts, clip, [&](int i) {
+                    STATS_VERTICES(vertex_timer, for (int j=0; j<3; j++) screen_coords[j] = band_shader.vertex(i, j));
+                    if (params.msaa) triangle_msaa(screen_coords, band_shader, target.msaa, clip);
+                    else if (params.shading_rate>1) triangle_vrs(screen_coords, band_shader, frame, target.zbuffer, &target.rates, 0, clip);
+                    else triangle(screen_coords, band_shader, frame, target.zbuffer, clip);
+                });
+            });
+        });
+    }
+    if (params.msaa) {
+        TRACE_SCOPE("msaa_resolve");
+        STATS_TIMER(STAGE_RASTER);
+        JobSystem::instance().parallel_for(0, height, 16, [&](int y0, int y1) {
+            target.msaa.resolve_rows(frame, y0, y1-1);
+        });
+    }
+    stats_pass_end();
+    if (params.shading_rate>1 && params.adaptive_rate) target.rates.measure(frame, target.zbuffer, params.shading_rate);
+}
+
+RenderTargetPool &RenderTargetPool::instance() {
+    static RenderTargetPool pool;
+    return pool;
+}
+
+RenderTargetPool::RenderTargetPool() : mutex_(), free_(), capacity_(8) {
+    free_.reserve(capacity_);
+}
+
+RenderTargetPool::~RenderTargetPool() {
+    for (size_t i=0; i<free_.size(); i++) delete free_[i];
+}
+
+RenderTarget *RenderTargetPool::acquire(int w, int h) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!free_.empty()) {
+            size_t best = free_.size()-1; // the most recently released, unless one has the right size
+            for (size_t i=0; i<free_.size(); i++) {
+                if (free_[i]->width==w && free_[i]->height==h) best = i;
+            }
+            RenderTarget *t = free_[best];
+            free_.erase(free_.begin()+best);
+            return t;
+        }
+    }
+    return new RenderTarget();
+}
+
+void RenderTargetPool::release(RenderTarget *target) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if ((int)free_.size()>=capacity_) {
+        delete target;
+        return;
+    }
+    free_.push_back(target);
+}
+
+void RenderTargetPool::set_capacity(int n) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    capacity_ = std::max(0, n);
+    while ((int)free_.size()>capacity_) {
+        delete free_.front();
+        free_.erase(free_.begin());
+    }
+    free_.reserve(capacity_);
+}
@@ -0,0 +1,118 @@
+#ifndef __RENDERER_H__
+#define __RENDERER_H__
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "geometry.h"
+#include "tgaimage.h"
+#include "model.h"
+#include "pipeLine.h"
+#include "lights.h"
+#include "occlusion.h"
+#include "shadowmap.h"
+#include "arena.h"
+#include "meshstream.h"
+
+// One draw: a model placed in the world with its own material parameters.
+struct SceneObject {
+    Model *model;
+    Matrix transform;  // model to world
+    Vec3f tint;        // rgb factor on the diffuse texture
+    int shading_rate;  // 1, 2 or 4 for this draw (see triangle_vrs()), 0 for the render's
+
+    SceneObject() : model(NULL), transform(Matrix::identity()), tint(1,1,1), shading_rate(0) {}
+};
+
+struct RenderParams {
+    Vec3f eye;
+    Vec3f center;
+    Vec3f up;
+    Vec3f light_dir;
+    int width;
+    int height;
+    bool overdraw; // track overdraw for stats_write_overdraw()
+    int msaa;      // 4 or 8 samples per pixel in the main pass, 0 for none
+    std::vector<Light> lights; // point and spot lights besides light_dir
+    bool occlusion; // skip the objects of a scene hidden behind nearer ones
+    bool front_to_back; // main pass draws objects, and the face clusters of each, nearest first
+    int shading_rate;   // 2 or 4: main pass shades once per block of that many pixels squared, 1 for every pixel; not with msaa
+    bool adaptive_rate; // shading_rate per 16px tile, lower where the previous frame in the target has detail
+    ScreenRect window;  // the part of the width x height frame rendered, all of it when empty; the target is
+                        // sized to it, its pixel (0, 0) is the frame's (window.x0, window.y0)
+    DepthFormat depth_format;  // of the main pass zbuffer; msaa samples are float whatever it is
+    DepthFormat shadow_format; // of the shadow map
+
+    RenderParams() : eye(0,0,3), center(0,0,0), up(0,1,0), light_dir(1,1,1), width(800), height(800), overdraw(false), msaa(0), lights(),
+        occlusion(true), front_to_back(true), shading_rate(1), adaptive_rate(false), window(), depth_format(DEPTH_FLOAT),
+        shadow_format(DEPTH_FLOAT) {}
+};
+
+// Buffers of one render, kept between renders so that a steady stream of
+// same-sized frames does not reallocate. Not shared between threads.
+struct RenderTarget {
+    int width;
+    int height;
+    TGAImage frame;    // color, y up: flip_vertically() before writing it out
+    std::shared_ptr<const ShadowMap> shadow; // from the ShadowCache, image is the shadow pass visualization
+    DepthBuffer zbuffer;
+    std::vector<Vec3f> screen_verts;
+    MsaaBuffer msaa;   // main pass samples when RenderParams::msaa is set, resolved into frame
+    LightGrid lights;  // per-tile light lists of the last render with RenderParams::lights
+    OcclusionBuffer occlusion; // the occluders of the last render of a scene, in arena
+    ShadingRateMap rates; // of the last render with a shading rate above 1, and what --vrs auto measured in its frame
+    std::vector<ScreenRect> bounds; // per scene object, the pixels its triangles may have touched
+    FrameArena arena;  // scratch of the current frame, reset by render() and render_scene()
+
+    RenderTarget() : width(0), height(0), frame(), shadow(), zbuffer(), screen_verts(), msaa(), lights(), occlusion(), rates(), bounds(), arena() {}
+    // frame cleared, zbuffer reset to format for depths from zfar to znear
+    void resize(int w, int h, DepthFormat format, float zfar, float znear);
+};
+
+// Shadow pass then main pass into target (resized to params). The shadow map
+// comes from the ShadowCache when light, model and size did not change. With point or
+// spot lights a depth pre-pass comes first and its per-tile depth ranges cull
+// the lights. Objects of a scene hidden behind nearer ones (see OcclusionBuffer)
+// are skipped before their vertices are transformed. The main pass draws
+// objects and face clusters nearest first, so early-Z rejects more. With a
+// shading rate above 1 (per render, per tile or per object) it runs the
+// fragment shader once per pixel block instead of per pixel. The pipeline matrices are thread_local, so renders on different
+// threads do not interfere.
+void render(Model &model, const RenderParams &params, RenderTarget &target);
+void render_scene(const std::vector<SceneObject> &scene, const RenderParams &params, RenderTarget &target);
+// Redraws only the given rectangles of a frame render_scene() left in target,
+// the rest of the frame and zbuffer is kept, as is the zbuffer's depth range
+// (see scene_depth_range()). Without msaa and lights. Does not reset
+// target.arena, regions may live there.
+void render_regions(const std::vector<SceneObject> &scene, const RenderParams &params, RenderTarget &target,
+                    const ScreenRect *regions, int nregions);
+// render() of a mesh too large for memory: its chunks are streamed through
+// twice, for the shadow map (cached as render()'s) and the frame, skipping
+// those off screen and nearest first unless !params.front_to_back. Without
+// lights. target.screen_verts holds one chunk's vertices at a time.
+void render_stream(MeshStream &mesh, const RenderParams &params, RenderTarget &target);
+
+// Render targets kept for reuse, so that a service rendering requests of mixed
+// sizes does not reallocate frame buffers; acquire() prefers one of the size asked.
+class RenderTargetPool {
+public:
+    static RenderTargetPool &instance();
+    ~RenderTargetPool();
+    RenderTarget *acquire(int w, int h);
+    void release(RenderTarget *target); // keeps at most capacity targets
+    void set_capacity(int n);
+private:
+    RenderTargetPool();
+    std::mutex mutex_;
+    std::vector<RenderTarget *> free_;
+    int capacity_;
+};
+
+// world to screen coordinates of the main pass (sets the pipeline matrices)
+Mat4f camera_matrix(const RenderParams &params);
+// pixels of a width x height image the vertices of model, transformed by M, may cover
+ScreenRect project_bounds(Model &model, const Mat4f &M, int width, int height);
+// screen depths [zlo, zhi] of the bounding boxes of scene under world_to_screen,
+// the range fixed point depth buffers are made for
+void scene_depth_range(const std::vector<SceneObject> &scene, const Mat4f &world_to_screen, float &zlo, float &zhi);
+
+#endif //__RENDERER_H__
@@ -0,0 +1,236 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include "scene.h"
+#include "trace.h"
+
+SceneObject SceneNode::object() const {
+    SceneObject o;
+    o.model = model.get();
+    float a = rotate*MY_PI/180;
+    float c = std::cos(a)*scale, s = std::sin(a)*scale;
+    o.transform[0][0] = c;     o.transform[0][2] = s;
+    o.transform[1][1] = scale;
+    o.transform[2][0] = -s;    o.transform[2][2] = c;
+    for (int i=0; i<3; i++) o.transform[i][3] = pos[i];
+    o.tint = tint;
+    o.shading_rate = rate;
+    return o;
+}
+
+static bool parse_vec3(const std::string &s, Vec3f &v) {
+    return 3==sscanf(s.c_str(), "%f,%f,%f", &v.x, &v.y, &v.z);
+}
+
+bool apply_assignments(SceneNode &node, const std::string &assignments, AssetCache &assets, std::string &error) {
+    std::istringstream iss(assignments);
+    std::string word;
+    while (iss >> word) {
+        size_t eq = word.find('=');
+        std::string key = word.substr(0, eq);
+        std::string value = eq==std::string::npos ? "" : word.substr(eq+1);
+        bool ok = true;
+        if (key=="model") {
+            node.model = assets.get(value);
+            ok = (bool)node.model;
+        }
+        else if (key=="pos") ok = parse_vec3(value, node.pos);
+        else if (key=="tint") ok = parse_vec3(value, node.tint);
+        else if (key=="scale") ok = 1==sscanf(value.c_str(), "%f", &node.scale);
+        else if (key=="rotate") ok = 1==sscanf(value.c_str(), "%f", &node.rotate);
+        else if (key=="rate") ok = 1==sscanf(value.c_str(), "%d", &node.rate) && (node.rate==0 || node.rate==1 || node.rate==2 || node.rate==4);
+        else ok = false;
+        if (!ok) {
+            error = "bad argument '" + word + "'";
+            return false;
+        }
+    }
+    return true;
+}
+
+bool load_scene(const char *filename, AssetCache &assets, SceneScript &script) {
+    std::ifstream in(filename);
+    if (!in) {
+        std::cerr << "can't open scene " << filename << std::endl;
+        return false;
+    }
+    std::vector<SceneEdit> edits;
+    std::string line, error;
+    int lineno = 0;
+    while (std::getline(in, line)) {
+        lineno++;
+        std::istringstream iss(line);
+        std::string cmd;
+        if (!(iss >> cmd) || cmd[0]=='#') continue;
+        std::string rest;
+        std::getline(iss, rest);
+        bool ok = true;
+        if (cmd=="object") {
+            if (!script.frames.empty() || !edits.empty()) {
+                error = "objects must come before the first frame";
+                ok = false;
+            } else {
+                SceneNode node;
+                ok = apply_assignments(node, rest, assets, error);
+                if (ok && !node.model) {
+                    error = "object without a model";
+                    ok = false;
+                }
+                if (ok) script.nodes.push_back(node);
+            }
+        } else if (cmd=="set") {
+            SceneEdit e;
+            std::istringstream args(rest);
+            ok = (bool)(args >> e.node) && e.node>=0 && e.node<(int)script.nodes.size();
+            if (!ok) error = "no such object";
+            std::getline(args, e.assignments);
+            if (ok) edits.push_back(e);
+        } else if (cmd=="frame") {
+            script.frames.push_back(edits);
+            edits.clear();
+        } else {
+            error = "unknown command '" + cmd + "'";
+            ok = false;
+        }
+        if (!ok) {
+            std::cerr << filename << ":" << lineno << ": " << error << std::endl;
+            return false;
+        }
+    }
+    if (!edits.empty() || script.frames.empty()) script.frames.push_back(edits);
+    if (script.nodes.empty()) {
+        std::cerr << filename << ": no objects" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+IncrementalRenderer::IncrementalRenderer() : valid_(false), prev_(), prev_versions_(), prev_params_(),
+    tiles_x_(0), tiles_y_(0), dirty_tiles_(0), dirty_() {
+}
+
+void IncrementalRenderer::mark(const ScreenRect &r) {
+    if (r.empty()) return;
+    // one pixel of slack for rounding differences between the two projections
+    int x0 = std::max(0, r.x0-1)/TILE, y0 = std::max(0, r.y0-1)/TILE;
+    int x1 = std::min(tiles_x_*TILE-1, r.x1+1)/TILE, y1 = std::min(tiles_y_*TILE-1, r.y1+1)/TILE;
+    for (int y=y0; y<=y1; y++) {
+        for (int x=x0; x<=x1; x++) dirty_[x+y*tiles_x_] = 1;
+    }
+}
+
+static bool same_view(const RenderParams &a, const RenderParams &b) {
+    for (int i=0; i<3; i++) {
+        if (a.eye[i]!=b.eye[i] || a.center[i]!=b.center[i] || a.up[i]!=b.up[i] || a.light_dir[i]!=b.light_dir[i]) return false;
+    }
+    return a.width==b.width && a.height==b.height && a.overdraw==b.overdraw
+        && a.depth_format==b.depth_format && a.shadow_format==b.shadow_format;
+}
+
+static bool same_transform(const Matrix &a, const Matrix &b) {
+    for (int i=0; i<4; i++) for (int j=0; j<4; j++) if (a[i][j]!=b[i][j]) return false;
+    return true;
+}
+
+void IncrementalRenderer::render(const std::vector<SceneObject> &scene, const RenderParams &params, RenderTarget &target) {
+    const int width = params.width, height = params.height;
+    target.arena.reset();
+    uint64_t *versions = target.arena.alloc<uint64_t>(scene.size());
+    for (size_t k=0; k<scene.size(); k++) versions[k] = scene[k].model->geometry_version();
+    bool full = !valid_ || !same_view(params, prev_params_) || scene.size()!=prev_.size() || params.msaa || !params.lights.empty()
+             || target.width!=width || target.height!=height || !target.shadow;
+    if (!full && (params.depth_format==DEPTH_UNORM16 || params.depth_format==DEPTH_UNORM24)) {
+        float zlo, zhi; // fixed point depth clamps what moved out of the range of the last full render
+        scene_depth_range(scene, camera_matrix(params), zlo, zhi);
+        full = zlo<target.zbuffer.zfar || zhi>target.zbuffer.znear;
+    }
+    tiles_x_ = (width+TILE-1)/TILE;
+    tiles_y_ = (height+TILE-1)/TILE;
+    dirty_.assign(tiles_x_*tiles_y_, 0);
+    if (!full) {
+        TRACE_SCOPE("dirty_regions");
+        Mat4f camera = camera_matrix(params);
+        const ShadowMap &shadow = *target.shadow;
+        ScreenRect *shadow_rects = target.arena.alloc<ScreenRect>(2*scene.size()); // shadow map texels that change
+        int nshadow_rects = 0;
+        for (size_t k=0; k<scene.size(); k++) {
+            const SceneObject &now = scene[k], &was = prev_[k];
+            bool moved = now.model!=was.model || versions[k]!=prev_versions_[k] || !same_transform(now.transform, was.transform);
+            bool tinted = now.tint.x!=was.tint.x || now.tint.y!=was.tint.y || now.tint.z!=was.tint.z;
+            bool rerated = now.shading_rate!=was.shading_rate;
+            if (!moved && !tinted && !rerated) continue;
+            mark(target.bounds[k]);
+            if (!moved) continue;
+            mark(project_bounds(*now.model, camera*Mat4f(now.transform), width, height));
+            shadow_rects[nshadow_rects++] = project_bounds(*was.model, shadow.transform*Mat4f(was.transform), shadow.width, shadow.height);
+            shadow_rects[nshadow_rects++] = project_bounds(*now.model, shadow.transform*Mat4f(now.transform), shadow.width, shadow.height);
+        }
+        if (nshadow_rects) {
+            // visible surfaces looking up a texel of the shadow map that changes
+            Mat4f screen_to_shadow = shadow.transform*camera.inverse();
+            const float lowest = -std::numeric_limits<float>::max();
+            for (int y=0; y<height; y++) {
+                for (int x=0; x<width; x++) {
+                    if (dirty_[x/TILE + (y/TILE)*tiles_x_]) continue;
+                    float z = target.zbuffer.depth(x+y*width);
+                    if (z==lowest) continue;
+                    Vec3f p = screen_to_shadow.transform_point(Vec3f(x, y, z));
+                    int sx = int(p.x), sy = int(p.y);
+                    for (int r=0; r<nshadow_rects; r++) {
+                        const ScreenRect &s = shadow_rects[r];
+                        if (sx>=s.x0-1 && sx<=s.x1+1 && sy>=s.y0-1 && sy<=s.y1+1) {
+                            dirty_[x/TILE + (y/TILE)*tiles_x_] = 1;
+                            break;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    dirty_tiles_ = 0;
+    if (!full) {
+        // runs of dirty tiles per tile row, merged with the run of the row above when they line up
+        ScreenRect *regions = target.arena.alloc<ScreenRect>(tiles());
+        int nregions = 0;
+        int *prev_row = target.arena.alloc<int>(tiles_x_), *row = target.arena.alloc<int>(tiles_x_);
+        int nprev_row = 0;
+        for (int ty=0; ty<tiles_y_; ty++) {
+            int nrow = 0;
+            for (int tx=0; tx<tiles_x_; tx++) {
+                if (!dirty_[tx+ty*tiles_x_]) continue;
+                int start = tx;
+                while (tx+1<tiles_x_ && dirty_[tx+1+ty*tiles_x_]) tx++;
+                dirty_tiles_ += tx-start+1;
+                ScreenRect r(start*TILE, ty*TILE, std::min(width, (tx+1)*TILE)-1, std::min(height, (ty+1)*TILE)-1);
+                bool merged = false;
+                for (int i=0; i<nprev_row && !merged; i++) {
+                    ScreenRect &above = regions[prev_row[i]];
+                    if (above.x0==r.x0 && above.x1==r.x1 && above.y1+1==r.y0) {
+                        above.y1 = r.y1;
+                        row[nrow++] = prev_row[i];
+                        merged = true;
+                    }
+                }
+                if (!merged) {
+                    row[nrow++] = nregions;
+                    regions[nregions++] = r;
+                }
+            }
+            std::swap(prev_row, row);
+            nprev_row = nrow;
+        }
+        if (dirty_tiles_) render_regions(scene, params, target, regions, nregions);
+    } else {
+        dirty_tiles_ = tiles();
+        render_scene(scene, params, target);
+    }
+    valid_ = true;
+    prev_ = scene;
+    prev_versions_.assign(versions, versions+scene.size());
+    prev_params_ = params;
+}
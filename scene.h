@@ -0,0 +1,61 @@
+#ifndef __SCENE_H__
+#define __SCENE_H__
+#include <memory>
+#include <string>
+#include <vector>
+#include "renderer.h"
+#include "server.h"
+
+// A scene script: "object" lines place models, each "frame" line renders the
+// scene as it stands, "set" lines in between edit one object for the next frame.
+//   object model=obj/african_head.obj pos=0,0,0 scale=1 rotate=0 tint=1,1,1
+//   frame
+//   set 0 tint=1,.5,.5
+//   frame
+struct SceneNode {
+    std::shared_ptr<Model> model;
+    Vec3f pos;
+    float scale;
+    float rotate;  // degrees around y
+    Vec3f tint;
+    int rate;      // shading rate, 0 for the render's
+    SceneNode() : model(), pos(0,0,0), scale(1), rotate(0), tint(1,1,1), rate(0) {}
+    SceneObject object() const;
+};
+
+struct SceneEdit {
+    int node;
+    std::string assignments;
+};
+
+struct SceneScript {
+    std::vector<SceneNode> nodes;                 // as of the first frame
+    std::vector<std::vector<SceneEdit> > frames;  // edits applied before each frame
+};
+
+bool load_scene(const char *filename, AssetCache &assets, SceneScript &script);
+// "key=value ..." onto node, models come from assets
+bool apply_assignments(SceneNode &node, const std::string &assignments, AssetCache &assets, std::string &error);
+
+// Keeps the previous frame and the screen bounds of every object. When only
+// objects changed, redraws just the tiles under their old and new bounds and
+// under the shadows they moved; a change of camera, light or size, msaa or
+// extra lights take a full render.
+class IncrementalRenderer {
+public:
+    static const int TILE = 32; // pixels
+    IncrementalRenderer();
+    void render(const std::vector<SceneObject> &scene, const RenderParams &params, RenderTarget &target);
+    int dirty_tiles() const { return dirty_tiles_; } // redrawn by the last render
+    int tiles() const { return tiles_x_*tiles_y_; }
+private:
+    void mark(const ScreenRect &r);
+    bool valid_;
+    std::vector<SceneObject> prev_;
+    std::vector<uint64_t> prev_versions_;
+    RenderParams prev_params_;
+    int tiles_x_, tiles_y_, dirty_tiles_;
+    std::vector<unsigned char> dirty_;
+};
+
+#endif //__SCENE_H__
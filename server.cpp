@@ -0,0 +1,267 @@
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "server.h"
+#include "trace.h"
+
+std::shared_ptr<Model> AssetCache::get(const std::string &path) {
+    std::promise<std::shared_ptr<Model> > loaded;
+    std::shared_future<std::shared_ptr<Model> > model;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::map<std::string, std::shared_future<std::shared_ptr<Model> > >::iterator it = models_.find(path);
+        if (it==models_.end()) {
+            models_[path] = loaded.get_future().share();
+        } else {
+            model = it->second;
+        }
+    }
+    if (model.valid()) return model.get(); // loaded, or being loaded by another request
+
+    std::shared_ptr<Model> m(new Model(path.c_str()));
+    if (!m->nfaces()) {
+        m.reset();
+        std::lock_guard<std::mutex> lock(mutex_);
+        models_.erase(path); // let a later request retry
+    }
+    loaded.set_value(m);
+    return m;
+}
+
+void AssetCache::evict(const std::string &path) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    models_.erase(path);
+}
+
+static bool parse_vec3(const std::string &s, Vec3f &v) {
+    return 3==sscanf(s.c_str(), "%f,%f,%f", &v.x, &v.y, &v.z);
+}
+
+bool parse_request(const std::string &line, RenderRequest &req, std::string &error) {
+    std::istringstream iss(line);
+    std::string word;
+    iss >> word;
+    if (word!="render") {
+        error = "unknown command '" + word + "'";
+        return false;
+    }
+    while (iss >> word) {
+        size_t eq = word.find('=');
+        std::string key = word.substr(0, eq);
+        std::string value = eq==std::string::npos ? "" : word.substr(eq+1);
+        bool ok = true;
+        if (key=="model") req.model = value;
+        else if (key=="eye") ok = parse_vec3(value, req.params.eye);
+        else if (key=="center") ok = parse_vec3(value, req.params.center);
+        else if (key=="up") ok = parse_vec3(value, req.params.up);
+        else if (key=="light") ok = parse_vec3(value, req.params.light_dir);
+        else if (key=="size") ok = 2==sscanf(value.c_str(), "%dx%d", &req.params.width, &req.params.height)
+                                   && req.params.width>0 && req.params.height>0 && req.params.width<=16384 && req.params.height<=16384;
+        else if (key=="msaa") ok = 1==sscanf(value.c_str(), "%d", &req.params.msaa)
+                                   && (req.params.msaa==0 || req.params.msaa==4 || req.params.msaa==8);
+        else if (key=="rate") ok = 1==sscanf(value.c_str(), "%d", &req.params.shading_rate) // no adaptive: pooled targets hold other requests' frames
+                                   && (req.params.shading_rate==1 || req.params.shading_rate==2 || req.params.shading_rate==4);
+        else if (key=="format") ok = parse_image_format(value.c_str(), req.format);
+        else ok = false;
+        if (!ok) {
+            error = "bad argument '" + word + "'";
+            return false;
+        }
+    }
+    if (req.model.empty()) {
+        error = "no model";
+        return false;
+    }
+    return true;
+}
+
+std::string handle_request(AssetCache &assets, const std::string &line) {
+    TRACE_SCOPE("request");
+    RenderRequest req;
+    std::string error;
+    if (!parse_request(line, req, error)) return "error " + error + "\n";
+    std::shared_ptr<Model> model = assets.get(req.model);
+    if (!model) return "error can't load " + req.model + "\n";
+    RenderTarget *target = RenderTargetPool::instance().acquire(req.params.width, req.params.height); // buffers are reused between requests
+    render(*model, req.params, *target);
+    target->frame.flip_vertically(); // to place the origin in the bottom left corner of the image
+    std::vector<unsigned char> image;
+    bool ok = encode_image(target->frame.view(), req.format, image);
+    RenderTargetPool::instance().release(target);
+    if (!ok) return "error can't encode the image\n";
+    std::string bytes(image.begin(), image.end());
+    char status[32];
+    snprintf(status, sizeof(status), "ok %zu\n", bytes.size());
+    return status + bytes;
+}
+
+// fixed set of render threads fed from one queue
+class WorkerPool {
+public:
+    WorkerPool(int n) : tasks_(), stop_(false) {
+        if (n<=0) n = std::max(1u, std::thread::hardware_concurrency());
+        for (int i=0; i<n; i++) threads_.push_back(std::thread(&WorkerPool::run, this));
+        std::cerr << "serving with " << n << " render threads" << std::endl;
+    }
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        for (size_t i=0; i<threads_.size(); i++) threads_[i].join();
+    }
+    std::future<std::string> submit(std::function<std::string()> f) {
+        std::shared_ptr<std::packaged_task<std::string()> > task(new std::packaged_task<std::string()>(f));
+        std::future<std::string> result = task->get_future();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            tasks_.push_back([task] { (*task)(); });
+        }
+        cv_.notify_one();
+        return result;
+    }
+private:
+    void run() {
+        trace_thread_name("render_worker");
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (;;) {
+            cv_.wait(lock, [this] { return stop_ || !tasks_.empty(); });
+            if (tasks_.empty()) return;
+            std::function<void()> task = tasks_.front();
+            tasks_.pop_front();
+            lock.unlock();
+            task();
+            lock.lock();
+        }
+    }
+    std::deque<std::function<void()> > tasks_;
+    std::vector<std::thread> threads_;
+    bool stop_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+};
+
+int serve_stdin(int nthreads) {
+    AssetCache assets;
+    WorkerPool pool(nthreads);
+    std::deque<std::future<std::string> > pending; // responses in request order
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool done = false;
+    std::thread writer([&] {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            cv.wait(lock, [&] { return done || !pending.empty(); });
+            if (pending.empty()) return;
+            std::future<std::string> f = std::move(pending.front());
+            pending.pop_front();
+            lock.unlock();
+            std::string response = f.get();
+            fwrite(response.data(), 1, response.size(), stdout);
+            fflush(stdout);
+            lock.lock();
+        }
+    });
+    std::string line;
+    while (std::getline(std::cin, line)) {
+        if (line.empty()) continue;
+        if (line=="quit") break;
+        std::future<std::string> f = pool.submit([&assets, line] { return handle_request(assets, line); });
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pending.push_back(std::move(f));
+        }
+        cv.notify_one();
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        done = true;
+    }
+    cv.notify_one();
+    writer.join();
+    return 0;
+}
+
+static bool send_all(int fd, const std::string &s) {
+    size_t sent = 0;
+    while (sent<s.size()) {
+        ssize_t n = send(fd, s.data()+sent, s.size()-sent, MSG_NOSIGNAL);
+        if (n<0 && errno==EINTR) continue;
+        if (n<=0) return false;
+        sent += n;
+    }
+    return true;
+}
+
+static void serve_connection(int fd, AssetCache &assets, WorkerPool &pool) {
+    std::string buffer;
+    char chunk[4096];
+    for (;;) {
+        size_t eol = buffer.find('\n');
+        if (eol==std::string::npos) {
+            ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+            if (n<0 && errno==EINTR) continue;
+            if (n<=0) break;
+            buffer.append(chunk, n);
+            continue;
+        }
+        std::string line = buffer.substr(0, eol);
+        buffer.erase(0, eol+1);
+        if (!line.empty() && line[line.size()-1]=='\r') line.erase(line.size()-1);
+        if (line.empty()) continue;
+        if (line=="quit") break;
+        // the connection thread only does I/O, rendering is bounded by the pool size
+        std::string response = pool.submit([&assets, line] { return handle_request(assets, line); }).get();
+        if (!send_all(fd, response)) break;
+    }
+    close(fd);
+}
+
+int serve_unix(const char *path, int nthreads) {
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path)>=sizeof(addr.sun_path)) {
+        std::cerr << "socket path too long: " << path << std::endl;
+        return 1;
+    }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd<0) {
+        std::cerr << "can't create socket: " << strerror(errno) << std::endl;
+        return 1;
+    }
+    unlink(path);
+    if (bind(fd, (sockaddr *)&addr, sizeof(addr))<0 || listen(fd, 64)<0) {
+        std::cerr << "can't listen on " << path << ": " << strerror(errno) << std::endl;
+        close(fd);
+        return 1;
+    }
+    AssetCache assets;
+    WorkerPool pool(nthreads);
+    std::cerr << "listening on " << path << std::endl;
+    for (;;) {
+        int client = accept(fd, NULL, NULL);
+        if (client<0) {
+            if (errno==EINTR) continue;
+            std::cerr << "accept failed: " << strerror(errno) << std::endl;
+            break;
+        }
+        std::thread(serve_connection, client, std::ref(assets), std::ref(pool)).detach();
+    }
+    close(fd);
+    unlink(path);
+    return 1;
+}
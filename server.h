@@ -0,0 +1,45 @@
+#ifndef __SERVER_H__
+#define __SERVER_H__
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include "imageencode.h"
+#include "model.h"
+#include "renderer.h"
+
+// Models stay loaded for the lifetime of the process, keyed by path. Concurrent
+// requests for a model that is still loading wait for the same load.
+class AssetCache {
+public:
+    std::shared_ptr<Model> get(const std::string &path); // NULL if the model can't be loaded
+    void evict(const std::string &path); // the model goes once its last user lets go of it
+private:
+    std::mutex mutex_;
+    std::map<std::string, std::shared_future<std::shared_ptr<Model> > > models_;
+};
+
+// One request line, e.g.
+//   render model=obj/african_head.obj eye=1,1,3 center=0,0,0 up=0,1,0 light=1,1,1 size=800x800 format=tga
+// Every key is optional; format is tga (RLE), tga-raw, qoi or png.
+struct RenderRequest {
+    std::string model;
+    RenderParams params;
+    ImageFormat format;
+    RenderRequest() : model("obj/african_head.obj"), params(), format(IMAGE_TGA) {}
+};
+
+bool parse_request(const std::string &line, RenderRequest &req, std::string &error);
+
+// Answers "render ..." with "ok <nbytes>\n" followed by the encoded image, and
+// anything else with "error <message>\n". "quit" ends the session.
+std::string handle_request(AssetCache &assets, const std::string &line);
+
+// Headless server: requests are rendered on nthreads workers (0: one per core).
+// serve_stdin answers in request order on stdout; serve_unix listens on a Unix
+// domain socket and serves each connection independently.
+int serve_stdin(int nthreads);
+int serve_unix(const char *path, int nthreads);
+
+#endif //__SERVER_H__
@@ -0,0 +1,74 @@
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include "shadowmap.h"
+
+ShadowKey::ShadowKey() : geometry(0), width(0), height(0), format(DEPTH_FLOAT) {
+    std::fill(light, light+3, 0.f);
+    std::fill(center, center+3, 0.f);
+    std::fill(up, up+3, 0.f);
+}
+
+bool ShadowKey::operator==(const ShadowKey &k) const {
+    return geometry==k.geometry && width==k.width && height==k.height && format==k.format
+        && std::equal(light, light+3, k.light) && std::equal(center, center+3, k.center)
+        && std::equal(up, up+3, k.up);
+}
+
+ShadowCache &ShadowCache::instance() {
+    static ShadowCache cache;
+    return cache;
+}
+
+ShadowCache::ShadowCache() : mutex_(), entries_(), capacity_(4), clock_(0), hits_(0), builds_(0) {
+}
+
+static size_t least_recent(const std::vector<ShadowCache::Entry> &entries) {
+    size_t victim = 0;
+    for (size_t i=1; i<entries.size(); i++) if (entries[i].last_use<entries[victim].last_use) victim = i;
+    return victim;
+}
+
+std::shared_ptr<const ShadowMap> ShadowCache::get(const ShadowKey &key, const std::function<void(ShadowMap &)> &build) {
+    std::unique_ptr<std::promise<std::shared_ptr<const ShadowMap> > > built; // only on a miss, a promise allocates
+    std::shared_future<std::shared_ptr<const ShadowMap> > cached;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (size_t i=0; i<entries_.size() && !cached.valid(); i++) {
+            if (entries_[i].key==key) {
+                entries_[i].last_use = ++clock_;
+                cached = entries_[i].map;
+                hits_++;
+            }
+        }
+        if (!cached.valid()) {
+            builds_++;
+            built.reset(new std::promise<std::shared_ptr<const ShadowMap> >());
+            if (capacity_>0) {
+                if ((int)entries_.size()>=capacity_) entries_.erase(entries_.begin()+least_recent(entries_));
+                Entry e;
+                e.key = key;
+                e.map = built->get_future().share();
+                e.last_use = ++clock_;
+                entries_.push_back(e);
+            }
+        }
+    }
+    if (cached.valid()) return cached.get(); // built, or being built by another render
+
+    std::shared_ptr<ShadowMap> map(new ShadowMap());
+    build(*map);
+    built->set_value(map);
+    return map;
+}
+
+void ShadowCache::set_capacity(int n) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    capacity_ = std::max(0, n);
+    while ((int)entries_.size()>capacity_) entries_.erase(entries_.begin()+least_recent(entries_));
+}
+
+void ShadowCache::report(std::ostream &out) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    out << "shadow cache: " << builds_ << " shadow maps built, " << hits_ << " reused, " << entries_.size() << " cached" << std::endl;
+}
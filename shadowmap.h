@@ -0,0 +1,59 @@
+#ifndef __SHADOWMAP_H__
+#define __SHADOWMAP_H__
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <vector>
+#include "geometry.h"
+#include "tgaimage.h"
+#include "pipeLine.h"
+
+// Everything a shadow pass depends on. Two renders with equal keys produce the
+// same shadow map, whatever the camera does.
+struct ShadowKey {
+    uint64_t geometry;    // hash of the geometry versions and transforms of the casters
+    float light[3], center[3], up[3];
+    int width, height;
+    DepthFormat format;   // of the buffer
+
+    ShadowKey();
+    bool operator==(const ShadowKey &k) const;
+};
+
+// The result of a shadow pass; immutable once built, shared between renders.
+struct ShadowMap {
+    int width, height;
+    Mat4f transform;             // world to shadow buffer screen coordinates
+    DepthBuffer buffer;          // depth, larger is nearer the light
+    TGAImage image;              // depth visualization, y up like the frame
+    ShadowMap() : width(0), height(0), transform(), buffer(), image() {}
+};
+
+// Process-wide cache of the last few shadow maps, so that camera-only changes
+// (orbits, server requests on the same model and light) skip the shadow pass.
+// Concurrent renders missing on the same key wait for one build.
+class ShadowCache {
+public:
+    static ShadowCache &instance();
+    std::shared_ptr<const ShadowMap> get(const ShadowKey &key, const std::function<void(ShadowMap &)> &build);
+    void set_capacity(int n); // entries kept, 0 rebuilds every time
+    void report(std::ostream &out);
+
+    struct Entry {
+        ShadowKey key;
+        std::shared_future<std::shared_ptr<const ShadowMap> > map;
+        uint64_t last_use;
+    };
+private:
+    ShadowCache();
+    std::mutex mutex_;
+    std::vector<Entry> entries_;
+    int capacity_;
+    uint64_t clock_;
+    uint64_t hits_, builds_;
+};
+
+#endif //__SHADOWMAP_H__
@@ -0,0 +1,190 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+#include "stats.h"
+#include "tgaimage.h"
+
+#ifdef RENDER_STATS
+
+RenderStats g_stats;
+std::atomic<bool> g_stats_enabled(false);
+unsigned int *g_overdraw = NULL;
+int g_overdraw_width = 0;
+
+static const char *stage_names[STAGE_COUNT] = {"vertex", "raster", "fragment", "output"};
+
+struct PassRecord {
+    std::string name;
+    uint64_t counters[10];
+    uint64_t stage_ns[STAGE_COUNT];
+    uint64_t wall_ns;
+};
+
+static std::vector<PassRecord> passes;
+static std::string pass_name;
+static std::chrono::steady_clock::time_point pass_start;
+static std::vector<unsigned int> overdraw;
+static int overdraw_w = 0, overdraw_h = 0;
+static uint64_t output_base_ns = 0;  // output stage time already attributed to a pass
+static uint64_t frame_output_ns = 0; // output stage time spent outside of passes
+static uint64_t frame_alloc_base = 0; // stats_allocations() when the frame started
+static uint64_t frame_alloc_bytes_base = 0;
+
+// Every operator new is counted, on whichever thread it runs (job workers,
+// the image writer). The array and nothrow forms of the standard library end
+// up in these two; the deletes, sized ones included, are all defined here so
+// that whatever these malloc() is free()d.
+static std::atomic<uint64_t> allocations(0);
+static std::atomic<uint64_t> allocated_bytes(0);
+
+void *operator new(std::size_t n) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    allocated_bytes.fetch_add(n, std::memory_order_relaxed);
+    if (void *p = malloc(n ? n : 1)) return p;
+    throw std::bad_alloc();
+}
+
+void *operator new(std::size_t n, std::align_val_t al) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    allocated_bytes.fetch_add(n, std::memory_order_relaxed);
+    size_t a = std::max<size_t>((size_t)al, sizeof(void *));
+    void *p = NULL;
+    if (posix_memalign(&p, a, n ? n : 1)) throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
+void operator delete(void *p, std::align_val_t) noexcept {
+    free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept {
+    free(p);
+}
+
+void operator delete(void *p, std::size_t, std::align_val_t) noexcept {
+    free(p);
+}
+
+uint64_t stats_allocations() {
+    return allocations.load(std::memory_order_relaxed);
+}
+
+static void reset_counters() {
+    std::atomic<uint64_t> *c[10] = {&g_stats.tris_submitted, &g_stats.tris_culled, &g_stats.tris_rasterized,
+        &g_stats.pixels_tested, &g_stats.depth_rejected, &g_stats.fragments_shaded, &g_stats.pixels_written, &g_stats.light_evaluations,
+        &g_stats.objects_culled, &g_stats.depth_bytes};
+    for (int i=0; i<10; i++) c[i]->store(0);
+    for (int i=0; i<STAGE_COUNT; i++) g_stats.stage_ns[i].store(0);
+}
+
+bool stats_available() {
+    return true;
+}
+
+void stats_enable(bool on) {
+    g_stats_enabled.store(on);
+    frame_alloc_base = allocations.load(std::memory_order_relaxed);
+    frame_alloc_bytes_base = allocated_bytes.load(std::memory_order_relaxed);
+}
+
+static void collect_frame_output() {
+    frame_output_ns += g_stats.stage_ns[STAGE_OUTPUT] - output_base_ns;
+    output_base_ns = g_stats.stage_ns[STAGE_OUTPUT];
+}
+
+void stats_pass_begin(const char *name, int overdraw_width, int overdraw_height) {
+    if (!stats_enabled()) return;
+    collect_frame_output();
+    reset_counters();
+    output_base_ns = 0;
+    pass_name = name;
+    if (overdraw_width>0 && overdraw_height>0) {
+        overdraw.assign(overdraw_width*overdraw_height, 0);
+        overdraw_w = overdraw_width;
+        overdraw_h = overdraw_height;
+        g_overdraw = overdraw.data();
+        g_overdraw_width = overdraw_width;
+    }
+    pass_start = std::chrono::steady_clock::now();
+}
+
+void stats_pass_end() {
+    if (!stats_enabled()) return;
+    PassRecord r;
+    r.name = pass_name;
+    r.wall_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now()-pass_start).count();
+    r.counters[0] = g_stats.tris_submitted;
+    r.counters[1] = g_stats.tris_culled;
+    r.counters[2] = g_stats.tris_rasterized;
+    r.counters[3] = g_stats.pixels_tested;
+    r.counters[4] = g_stats.depth_rejected;
+    r.counters[5] = g_stats.fragments_shaded;
+    r.counters[6] = g_stats.pixels_written;
+    r.counters[7] = g_stats.light_evaluations;
+    r.counters[8] = g_stats.objects_culled;
+    r.counters[9] = g_stats.depth_bytes;
+    for (int i=0; i<STAGE_COUNT; i++) r.stage_ns[i] = g_stats.stage_ns[i];
+    passes.push_back(r);
+    output_base_ns = r.stage_ns[STAGE_OUTPUT];
+    g_overdraw = NULL;
+}
+
+void stats_frame_end(std::ostream &out, int frame) {
+    if (!stats_enabled()) return;
+    static const char *counter_names[10] = {"triangles_submitted", "triangles_culled", "triangles_rasterized",
+        "pixels_tested", "depth_rejected", "fragments_shaded", "pixels_written", "light_evaluations", "objects_culled", "depth_bytes"};
+    out << "{\"frame\":" << frame << ",\"passes\":[";
+    for (size_t p=0; p<passes.size(); p++) {
+        const PassRecord &r = passes[p];
+        out << (p ? "," : "") << "{\"name\":\"" << r.name << "\"";
+        for (int i=0; i<10; i++) out << ",\"" << counter_names[i] << "\":" << r.counters[i];
+        out << ",\"time_ms\":{\"wall\":" << r.wall_ns*1e-6;
+        for (int i=0; i<STAGE_COUNT; i++) out << ",\"" << stage_names[i] << "\":" << r.stage_ns[i]*1e-6;
+        out << "}}";
+    }
+    collect_frame_output();
+    out << "],\"output_ms\":" << frame_output_ns*1e-6 << ",\"allocations\":" << stats_allocations()-frame_alloc_base
+        << ",\"allocated_bytes\":" << allocated_bytes.load(std::memory_order_relaxed)-frame_alloc_bytes_base << "}" << std::endl;
+    passes.clear();
+    frame_output_ns = 0;
+    frame_alloc_base = stats_allocations(); // the JSON line above is not part of the next frame
+    frame_alloc_bytes_base = allocated_bytes.load(std::memory_order_relaxed);
+}
+
+bool stats_write_overdraw(const char *filename) {
+    if (overdraw.empty()) return false;
+    unsigned int maxcount = 1;
+    for (size_t i=0; i<overdraw.size(); i++) maxcount = std::max(maxcount, overdraw[i]);
+    TGAImage heat(overdraw_w, overdraw_h, TGAImage::RGB);
+    for (int y=0; y<overdraw_h; y++) {
+        for (int x=0; x<overdraw_w; x++) {
+            unsigned int n = overdraw[x+y*overdraw_w];
+            if (!n) continue;
+            float t = (n-1)/float(std::max(1u, maxcount-1)); // 1 fragment -> blue, max -> red
+            heat.set(x, y, TGAColor(255*t, 255*(1.f-std::abs(2.f*t-1.f)), 255*(1.f-t)));
+        }
+    }
+    heat.flip_vertically(); // same orientation as framebuffer.tga
+    std::cerr << "overdraw: max " << maxcount << " shaded fragments per pixel" << std::endl;
+    return heat.write_tga_file(filename);
+}
+
+#else
+
+bool stats_available() { return false; }
+void stats_enable(bool) {}
+void stats_pass_begin(const char *, int, int) {}
+void stats_pass_end() {}
+void stats_frame_end(std::ostream &, int) {}
+bool stats_write_overdraw(const char *) { return false; }
+uint64_t stats_allocations() { return 0; }
+
+#endif
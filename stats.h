@@ -0,0 +1,151 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+
+// Per-stage pipeline statistics. Everything below compiles to nothing unless
+// RENDER_STATS is defined (see STATS in the Makefile); when it is, collection
+// is still switched on at runtime with stats_enable().
+
+enum StatStage { STAGE_VERTEX, STAGE_RASTER, STAGE_FRAGMENT, STAGE_OUTPUT, STAGE_COUNT };
+
+struct RenderStats {
+    std::atomic<uint64_t> tris_submitted;
+    std::atomic<uint64_t> tris_culled;
+    std::atomic<uint64_t> tris_rasterized;
+    std::atomic<uint64_t> pixels_tested;
+    std::atomic<uint64_t> depth_rejected;
+    std::atomic<uint64_t> fragments_shaded;
+    std::atomic<uint64_t> pixels_written;
+    std::atomic<uint64_t> light_evaluations; // point and spot lights evaluated by fragments
+    std::atomic<uint64_t> objects_culled;    // scene objects skipped as hidden or off screen
+    std::atomic<uint64_t> depth_bytes;       // depth buffer bytes read and written
+    std::atomic<uint64_t> stage_ns[STAGE_COUNT];
+};
+
+// counters gathered locally by triangle() and flushed once per triangle
+struct RasterCounters {
+    uint64_t tested, rejected, shaded, written;
+    uint64_t depth_bytes;
+    RasterCounters() : tested(0), rejected(0), shaded(0), written(0), depth_bytes(0) {}
+};
+
+#ifdef RENDER_STATS
+
+extern RenderStats g_stats;
+extern std::atomic<bool> g_stats_enabled;
+
+inline bool stats_enabled() {
+    return g_stats_enabled.load(std::memory_order_relaxed);
+}
+extern unsigned int *g_overdraw;   // shaded fragments per pixel of the current pass, or NULL
+extern int g_overdraw_width;
+
+struct StageTimer {
+    StatStage stage;
+    std::chrono::steady_clock::time_point start;
+    explicit StageTimer(StatStage s) : stage(s), start() { if (stats_enabled()) start = std::chrono::steady_clock::now(); }
+    ~StageTimer() {
+        if (!stats_enabled()) return;
+        uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now()-start).count();
+        g_stats.stage_ns[stage].fetch_add(ns, std::memory_order_relaxed);
+    }
+};
+
+// Times a triangle() call and splits it between the stages: of its fragment
+// shader calls one in FRAGMENT_SAMPLE per thread is timed and counts
+// FRAGMENT_SAMPLE times towards STAGE_FRAGMENT, the rest of the call (setup,
+// traversal, depth test) goes to STAGE_RASTER. The clock is read per sample,
+// not per fragment; either stage may be off for a single triangle, the sums
+// over a pass are not.
+struct RasterTimer {
+    static const unsigned FRAGMENT_SAMPLE = 16;
+    std::chrono::steady_clock::time_point start;
+    uint64_t fragment_ns;
+    RasterTimer() : start(), fragment_ns(0) { if (stats_enabled()) start = std::chrono::steady_clock::now(); }
+    template <typename F> bool shade(const F &fragment) {
+        static thread_local unsigned calls = 0;
+        if (!stats_enabled() || calls++%FRAGMENT_SAMPLE) return fragment();
+        std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+        bool discard = fragment();
+        fragment_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now()-t0).count();
+        return discard;
+    }
+    ~RasterTimer() {
+        if (!stats_enabled()) return;
+        uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now()-start).count();
+        uint64_t fragment = fragment_ns*FRAGMENT_SAMPLE;
+        g_stats.stage_ns[STAGE_FRAGMENT].fetch_add(fragment, std::memory_order_relaxed);
+        g_stats.stage_ns[STAGE_RASTER].fetch_add(ns-fragment, std::memory_order_relaxed); // wraps below 0, the sum does not
+    }
+};
+
+// Times the vertex() calls of the faces one band draws: one face in
+// FACE_SAMPLE per timer is timed and counts FACE_SAMPLE times; the sum goes
+// to STAGE_VERTEX once, when the band's timer goes out of scope.
+struct VertexTimer {
+    static const unsigned FACE_SAMPLE = 16;
+    unsigned faces;
+    uint64_t ns;
+    VertexTimer() : faces(0), ns(0) {}
+    template <typename F> void time(const F &vertices) {
+        if (!stats_enabled() || faces++%FACE_SAMPLE) {
+            vertices();
+            return;
+        }
+        std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+        vertices();
+        ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now()-t0).count();
+    }
+    ~VertexTimer() {
+        if (ns) g_stats.stage_ns[STAGE_VERTEX].fetch_add(ns*FACE_SAMPLE, std::memory_order_relaxed);
+    }
+};
+
+inline void stats_flush(const RasterCounters &c) {
+    if (!stats_enabled()) return;
+    g_stats.pixels_tested   .fetch_add(c.tested,   std::memory_order_relaxed);
+    g_stats.depth_rejected  .fetch_add(c.rejected, std::memory_order_relaxed);
+    g_stats.fragments_shaded.fetch_add(c.shaded,   std::memory_order_relaxed);
+    g_stats.pixels_written  .fetch_add(c.written,  std::memory_order_relaxed);
+    g_stats.depth_bytes     .fetch_add(c.depth_bytes, std::memory_order_relaxed);
+}
+
+#define STATS_CONCAT_(a, b) a##b
+#define STATS_CONCAT(a, b) STATS_CONCAT_(a, b)
+#define STATS_ADD(field, n) do { if (stats_enabled()) g_stats.field.fetch_add((n), std::memory_order_relaxed); } while (0)
+#define STATS_TIMER(stage) StageTimer STATS_CONCAT(stats_timer_, __LINE__)(stage)
+#define STATS_RASTER_TIMER(timer) RasterTimer timer
+#define STATS_SHADE(timer, call) (timer).shade([&]() { return (call); })
+#define STATS_VERTEX_TIMER(timer) VertexTimer timer
+#define STATS_VERTICES(timer, statement) (timer).time([&]() { statement; })
+#define STATS_FLUSH(counters) stats_flush(counters)
+#define STATS_OVERDRAW(x, y) do { if (g_overdraw) g_overdraw[(x)+(y)*g_overdraw_width]++; } while (0)
+
+#else
+
+#define STATS_ADD(field, n) ((void)0)
+#define STATS_TIMER(stage) ((void)0)
+#define STATS_RASTER_TIMER(timer) ((void)0)
+#define STATS_SHADE(timer, call) (call)
+#define STATS_VERTEX_TIMER(timer) ((void)0)
+#define STATS_VERTICES(timer, statement) do { statement; } while (0)
+#define STATS_FLUSH(counters) ((void)(counters))
+#define STATS_OVERDRAW(x, y) ((void)0)
+
+#endif
+
+// runtime control; these are no-ops (and stats_available() is false) without RENDER_STATS
+bool stats_available();
+void stats_enable(bool on);
+void stats_pass_begin(const char *name, int overdraw_width=0, int overdraw_height=0); // a non-zero size tracks overdraw
+void stats_pass_end();
+void stats_frame_end(std::ostream &out, int frame); // one JSON object per line, then resets the frame
+bool stats_write_overdraw(const char *filename);  // heatmap of the last pass that tracked overdraw
+// heap allocations (operator new) made so far by all threads; stats_frame_end()
+// reports those of each frame, and their bytes. Always 0 without RENDER_STATS.
+uint64_t stats_allocations();
+
+#endif //__STATS_H__
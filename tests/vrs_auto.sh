@@ -0,0 +1,33 @@
+#!/bin/sh
+# --vrs auto takes the rates of a frame from the one drawn before it into the
+# same target, not from whatever buffer the image writer handed back. A still
+# scene must settle on the same rates: its last frames shade the same number
+# of fragments, fewer than at full rate, into the same image.
+set -e
+root=$(cd "$(dirname "$0")/.." && pwd)
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cd "$dir"
+ln -s "$root/obj" obj
+printf 'object model=obj/african_head.obj\nframe\nframe\nframe\nframe\nframe\n' > still.txt
+
+shaded() { # fragments_shaded of the main pass, one frame per line
+    grep -o '"name":"main"[^}]*' "$1" | sed 's/.*"fragments_shaded":\([0-9]*\).*/\1/'
+}
+
+for jobs in 1 4; do
+    mkdir $jobs
+    (cd $jobs && ln -s ../obj obj && "$root/main" --scene ../still.txt --vrs auto --jobs $jobs --stats stats.json >/dev/null 2>&1)
+    shaded $jobs/stats.json > $jobs/shaded.txt
+    first=$(sed -n 1p $jobs/shaded.txt)
+    last=$(sed -n 5p $jobs/shaded.txt)
+    if [ "$(sed -n 4p $jobs/shaded.txt)" != "$last" ] || ! cmp -s $jobs/framebuffer_003.tga $jobs/framebuffer_004.tga; then
+        echo "vrs auto, --jobs $jobs: the rates of a still frame did not settle, shaded $(tr '\n' ' ' < $jobs/shaded.txt)"
+        exit 1
+    fi
+    if [ "$last" -ge "$first" ]; then
+        echo "vrs auto, --jobs $jobs: $last fragments shaded against $first at full rate"
+        exit 1
+    fi
+    echo "vrs auto, --jobs $jobs: ok, $first fragments shaded at full rate, then $last"
+done
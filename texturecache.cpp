@@ -0,0 +1,216 @@
+#include <cmath>
+#include <iostream>
+#include "jobs.h"
+#include "texturecache.h"
+#include "trace.h"
+
+struct TextureEntry {
+    std::string path;
+    std::atomic<int> refs;       // live Texture handles
+    std::atomic<bool> ready;     // image holds the decoded file (or the load failed)
+    std::mutex decode_mutex;
+    TGAImage image;
+    VirtualTexture *vt;
+    size_t bytes;
+    uint64_t last_use;
+
+    TextureEntry(const std::string &p) : path(p), refs(0), ready(false), decode_mutex(), image(), vt(NULL), bytes(0), last_use(0) {}
+    ~TextureEntry() { delete vt; }
+
+    void decode() {
+        std::lock_guard<std::mutex> lock(decode_mutex);
+        if (ready.load(std::memory_order_relaxed)) return;
+        TRACE_SCOPE("decode_texture");
+        bool ok;
+        // the status around the reader's own output, in the order Model printed it before textures were cached
+        std::cerr << "texture file " << path << " loading ";
+        if (path.size()>5 && !path.compare(path.size()-5, 5, ".vtex")) {
+            vt = new VirtualTexture();
+            ok = vt->open(path.c_str(), VirtualTexture::cache_size());
+            if (!ok) {
+                delete vt;
+                vt = NULL;
+            }
+            bytes = ok ? vt->cache_bytes() : 0;
+        } else {
+            ok = image.read_tga_file(path.c_str());
+            bytes = ok ? (size_t)image.get_width()*image.get_height()*image.get_bytespp() : 0;
+        }
+        std::cerr << (ok ? "ok" : "failed") << std::endl;
+        if (ok && !vt) image.flip_vertically();
+        ready.store(true, std::memory_order_release);
+        TextureCache::instance().decoded(this);
+    }
+};
+
+Texture::Texture() : entry_(NULL) {
+}
+
+Texture::Texture(TextureEntry *e) : entry_(e) {
+    if (entry_) entry_->refs++;
+}
+
+Texture::Texture(const Texture &t) : entry_(t.entry_) {
+    if (entry_) entry_->refs++;
+}
+
+Texture & Texture::operator =(const Texture &t) {
+    if (entry_!=t.entry_) {
+        Texture tmp(t);
+        std::swap(entry_, tmp.entry_);
+    }
+    return *this;
+}
+
+Texture::~Texture() {
+    if (!entry_) return;
+    for (int refs=entry_->refs.load(); refs>1; ) { // not the last: trim() can't take the entry, no lock
+        if (entry_->refs.compare_exchange_weak(refs, refs-1)) return;
+    }
+    // possibly the last: under the cache lock, so that trim() sees no unused entry still being touched here
+    TextureCache &cache = TextureCache::instance();
+    std::lock_guard<std::mutex> lock(cache.mutex_);
+    entry_->last_use = ++cache.clock_;
+    entry_->refs--;
+}
+
+bool Texture::valid() const {
+    return entry_!=NULL;
+}
+
+TGAImage &Texture::image() {
+    static TGAImage empty;
+    if (!entry_) return empty;
+    if (!entry_->ready.load(std::memory_order_acquire)) entry_->decode();
+    return entry_->image;
+}
+
+TGAColor Texture::get(Vec2f uvf, float uv_lod) {
+    TGAImage &img = image();
+    if (entry_ && entry_->vt) {
+        VirtualTexture *vt = entry_->vt;
+        float lod = uv_lod + .5f*std::log2((float)vt->get_width()*vt->get_height()); // texels per pixel of level 0
+        return vt->sample(uvf, lod);
+    }
+    ImageView view = img.view();
+    int u = uvf[0]*view.width, v = uvf[1]*view.height;
+    if (view.empty() || u<0 || v<0 || u>=view.width || v>=view.height) return TGAColor();
+    return view.get(u, v);
+}
+
+int Texture::get_width() {
+    TGAImage &img = image();
+    return entry_ && entry_->vt ? entry_->vt->get_width() : img.get_width();
+}
+
+int Texture::get_height() {
+    TGAImage &img = image();
+    return entry_ && entry_->vt ? entry_->vt->get_height() : img.get_height();
+}
+
+VirtualTexture *Texture::virtual_texture() {
+    image();
+    return entry_ ? entry_->vt : NULL;
+}
+
+TextureCache &TextureCache::instance() {
+    static TextureCache cache;
+    return cache;
+}
+
+TextureCache::TextureCache() : mutex_(), entries_(), prefetching_(0), prefetched_(), budget_(0), resident_(0), prefetch_(false), clock_(0),
+    hits_(0), misses_(0), decodes_(0), evictions_(0) {
+    JobSystem::instance(); // constructed first so that it outlives the cache
+}
+
+TextureCache::~TextureCache() {
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        prefetched_.wait(lock, [this] { return !prefetching_; });
+    }
+    for (std::map<std::string, TextureEntry *>::iterator it=entries_.begin(); it!=entries_.end(); ++it) delete it->second;
+}
+
+Texture TextureCache::acquire(const std::string &path) {
+    Texture t;
+    bool prefetch;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::map<std::string, TextureEntry *>::iterator it = entries_.find(path);
+        TextureEntry *e;
+        if (it!=entries_.end()) {
+            e = it->second;
+            hits_++;
+        } else {
+            e = new TextureEntry(path);
+            entries_[path] = e;
+            misses_++;
+        }
+        t = Texture(e); // referenced under the lock so that trim() can't evict it in between
+        e->last_use = ++clock_;
+        prefetch = prefetch_ && !e->ready.load(std::memory_order_acquire);
+    }
+    if (prefetch) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            prefetching_++;
+        }
+        JobSystem::instance().run([t, this]() mutable {
+            t.image();
+            t = Texture(); // before the cache may go away
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!--prefetching_) prefetched_.notify_all();
+        });
+    }
+    return t;
+}
+
+void TextureCache::set_budget(size_t bytes) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        budget_ = bytes;
+    }
+    trim();
+}
+
+void TextureCache::set_prefetch(bool on) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    prefetch_ = on;
+}
+
+void TextureCache::decoded(TextureEntry *e) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        resident_ += e->bytes;
+        decodes_++;
+    }
+    trim();
+}
+
+void TextureCache::trim() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    while (budget_ && resident_>budget_) {
+        std::map<std::string, TextureEntry *>::iterator victim = entries_.end();
+        for (std::map<std::string, TextureEntry *>::iterator it=entries_.begin(); it!=entries_.end(); ++it) {
+            TextureEntry *e = it->second;
+            if (e->refs.load()==0 && e->ready.load() && (victim==entries_.end() || e->last_use<victim->second->last_use)) victim = it;
+        }
+        if (victim==entries_.end()) break; // everything left is in use
+        resident_ -= victim->second->bytes;
+        delete victim->second;
+        entries_.erase(victim);
+        evictions_++;
+    }
+}
+
+size_t TextureCache::resident_bytes() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return resident_;
+}
+
+void TextureCache::report(std::ostream &out) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    out << "texture cache: " << entries_.size() << " textures, " << resident_/(1024.*1024.) << " MB decoded";
+    if (budget_) out << " (budget " << budget_/(1024.*1024.) << " MB)";
+    out << ", " << hits_ << " hits, " << misses_ << " misses, " << decodes_ << " decodes, " << evictions_ << " evictions" << std::endl;
+}
@@ -0,0 +1,69 @@
+#ifndef __TEXTURECACHE_H__
+#define __TEXTURECACHE_H__
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "geometry.h"
+#include "tgaimage.h"
+#include "vtexture.h"
+
+struct TextureEntry;
+
+// Reference-counted handle to a texture in the TextureCache. The file is only
+// decoded the first time it is sampled. A .vtex path is opened as a
+// VirtualTexture instead: image() is then empty and get() pages tiles in.
+class Texture {
+public:
+    Texture();
+    Texture(const Texture &t);
+    Texture & operator =(const Texture &t);
+    ~Texture();
+    bool valid() const;
+    TGAImage &image(); // decodes on first use; an empty image if the file can't be read
+    // nearest texel, uv in [0,1]; uv_lod is log2 of the uv extent one pixel covers,
+    // it picks the mip level of virtual textures and is ignored otherwise
+    TGAColor get(Vec2f uv, float uv_lod=-1e9f);
+    int get_width();
+    int get_height();
+    VirtualTexture *virtual_texture(); // NULL unless this is a .vtex
+private:
+    friend class TextureCache;
+    explicit Texture(TextureEntry *e);
+    TextureEntry *entry_;
+};
+
+// Process-wide texture cache keyed by path. Textures still referenced by a
+// handle stay resident; unreferenced ones are kept for the next acquire() until
+// the decoded bytes exceed the budget, then evicted least recently used first.
+class TextureCache {
+public:
+    static TextureCache &instance();
+    ~TextureCache();
+    Texture acquire(const std::string &path);
+    void set_budget(size_t bytes);   // 0: unlimited
+    void set_prefetch(bool on);      // decode as a job as soon as acquired
+    void trim();                     // apply the budget now
+    size_t resident_bytes();
+    void report(std::ostream &out);
+private:
+    friend class Texture;
+    friend struct TextureEntry;
+    TextureCache();
+    void decoded(TextureEntry *e);
+
+    std::mutex mutex_;
+    std::map<std::string, TextureEntry *> entries_;
+    int prefetching_;                // decode jobs not finished yet
+    std::condition_variable prefetched_;
+    size_t budget_;
+    size_t resident_;
+    bool prefetch_;
+    uint64_t clock_;
+    uint64_t hits_, misses_, decodes_, evictions_;
+};
+
+#endif //__TEXTURECACHE_H__
@@ -1,45 +1,101 @@
 #include <iostream>
+#include <utility>
 #include <fstream>
 #include <string.h>
+#include <stdlib.h>
 #include <time.h>
 #include <math.h>
+#include <algorithm>
+#include <vector>
 #include "tgaimage.h"
+#include "trace.h"
 
-TGAImage::TGAImage() : data(NULL), width(0), height(0), bytespp(0) {
+static void delete_array(unsigned char *p) {
+    delete [] p;
 }
 
-TGAImage::TGAImage(int w, int h, int bpp) : data(NULL), width(w), height(h), bytespp(bpp) {
+static void free_aligned(unsigned char *p) {
+    free(p);
+}
+
+TGAImage::TGAImage() : data(NULL), width(0), height(0), bytespp(0), release(NULL) {
+}
+
+TGAImage::TGAImage(int w, int h, int bpp) : data(NULL), width(w), height(h), bytespp(bpp), release(delete_array) {
     unsigned long nbytes = width*height*bytespp;
     data = new unsigned char[nbytes];
     memset(data, 0, nbytes);
 }
 
-TGAImage::TGAImage(const TGAImage &img) : data(NULL), width(img.width), height(img.height), bytespp(img.bytespp) {
+TGAImage::TGAImage(int w, int h, int bpp, unsigned char *pixels, Release r) : data(pixels), width(w), height(h), bytespp(bpp), release(r) {
+}
+
+TGAImage::TGAImage(const TGAImage &img) : data(NULL), width(img.width), height(img.height), bytespp(img.bytespp), release(delete_array) {
     unsigned long nbytes = width*height*bytespp;
     data = new unsigned char[nbytes];
     memcpy(data, img.data, nbytes);
 }
 
+TGAImage::TGAImage(TGAImage &&img) noexcept : data(img.data), width(img.width), height(img.height), bytespp(img.bytespp), release(img.release) {
+    img.data = NULL;
+    img.width = img.height = img.bytespp = 0;
+    img.release = NULL;
+}
+
+TGAImage TGAImage::aligned(int w, int h, int bpp, size_t alignment) {
+    size_t nbytes = (size_t)w*h*bpp;
+    void *p = NULL;
+    if (posix_memalign(&p, std::max(alignment, sizeof(void *)), nbytes ? nbytes : 1)) {
+        std::cerr << "can't allocate a " << w << "x" << h << " image\n";
+        return TGAImage();
+    }
+    memset(p, 0, nbytes);
+    return TGAImage(w, h, bpp, (unsigned char *)p, free_aligned);
+}
+
+void TGAImage::free_data() {
+    if (data && release) release(data);
+    data = NULL;
+    release = NULL;
+}
+
 TGAImage::~TGAImage() {
-    if (data) delete [] data;
+    free_data();
 }
 
 TGAImage & TGAImage::operator =(const TGAImage &img) {
     if (this != &img) {
-        if (data) delete [] data;
+        free_data();
         width  = img.width;
         height = img.height;
         bytespp = img.bytespp;
         unsigned long nbytes = width*height*bytespp;
         data = new unsigned char[nbytes];
+        release = delete_array;
         memcpy(data, img.data, nbytes);
     }
     return *this;
 }
 
+TGAImage & TGAImage::operator =(TGAImage &&img) noexcept {
+    if (this != &img) {
+        free_data();
+        swap(img);
+    }
+    return *this;
+}
+
+void TGAImage::swap(TGAImage &img) {
+    std::swap(data, img.data);
+    std::swap(width, img.width);
+    std::swap(height, img.height);
+    std::swap(bytespp, img.bytespp);
+    std::swap(release, img.release);
+}
+
 bool TGAImage::read_tga_file(const char *filename) {
-    if (data) delete [] data;
-    data = NULL;
+    TRACE_SCOPE("read_tga_file");
+    free_data();
     std::ifstream in;
     in.open (filename, std::ios::binary);
     if (!in.is_open()) {
@@ -64,6 +120,7 @@ bool TGAImage::read_tga_file(const char *filename) {
     }
     unsigned long nbytes = bytespp*width*height;
     data = new unsigned char[nbytes];
+    release = delete_array;
     if (3==header.datatypecode || 2==header.datatypecode) {
         in.read((char *)data, nbytes);
         if (!in.good()) {
@@ -143,16 +200,25 @@ bool TGAImage::load_rle_data(std::ifstream &in) {
 }
 
 bool TGAImage::write_tga_file(const char *filename, bool rle) {
-    unsigned char developer_area_ref[4] = {0, 0, 0, 0};
-    unsigned char extension_area_ref[4] = {0, 0, 0, 0};
-    unsigned char footer[18] = {'T','R','U','E','V','I','S','I','O','N','-','X','F','I','L','E','.','\0'};
+    TRACE_SCOPE("write_tga_file");
+    static thread_local char buffer[1<<16]; // the filebuf would allocate its own on every open
     std::ofstream out;
+    out.rdbuf()->pubsetbuf(buffer, sizeof(buffer));
     out.open (filename, std::ios::binary);
     if (!out.is_open()) {
         std::cerr << "can't open file " << filename << "\n";
         out.close();
         return false;
     }
+    bool ok = write_tga(out, rle);
+    out.close();
+    return ok;
+}
+
+bool TGAImage::write_tga(std::ostream &out, bool rle) {
+    unsigned char developer_area_ref[4] = {0, 0, 0, 0};
+    unsigned char extension_area_ref[4] = {0, 0, 0, 0};
+    unsigned char footer[18] = {'T','R','U','E','V','I','S','I','O','N','-','X','F','I','L','E','.','\0'};
     TGA_Header header;
     memset((void *)&header, 0, sizeof(header));
     header.bitsperpixel = bytespp<<3;
@@ -162,7 +228,6 @@ bool TGAImage::write_tga_file(const char *filename, bool rle) {
     header.imagedescriptor = 0x20; // top-left origin
     out.write((char *)&header, sizeof(header));
     if (!out.good()) {
-        out.close();
         std::cerr << "can't dump the tga file\n";
         return false;
     }
@@ -170,12 +235,10 @@ bool TGAImage::write_tga_file(const char *filename, bool rle) {
         out.write((char *)data, width*height*bytespp);
         if (!out.good()) {
             std::cerr << "can't unload raw data\n";
-            out.close();
             return false;
         }
     } else {
         if (!unload_rle_data(out)) {
-            out.close();
             std::cerr << "can't unload rle data\n";
             return false;
         }
@@ -183,64 +246,60 @@ bool TGAImage::write_tga_file(const char *filename, bool rle) {
     out.write((char *)developer_area_ref, sizeof(developer_area_ref));
     if (!out.good()) {
         std::cerr << "can't dump the tga file\n";
-        out.close();
         return false;
     }
     out.write((char *)extension_area_ref, sizeof(extension_area_ref));
     if (!out.good()) {
         std::cerr << "can't dump the tga file\n";
-        out.close();
         return false;
     }
     out.write((char *)footer, sizeof(footer));
     if (!out.good()) {
         std::cerr << "can't dump the tga file\n";
-        out.close();
         return false;
     }
-    out.close();
     return true;
 }
 
-// TODO: it is not necessary to break a raw chunk for two equal pixels (for the matter of the resulting size)
-bool TGAImage::unload_rle_data(std::ofstream &out) {
-    const unsigned char max_chunk_length = 128;
-    unsigned long npixels = width*height;
-    unsigned long curpix = 0;
-    while (curpix<npixels) {
-        unsigned long chunkstart = curpix*bytespp;
-        unsigned long curbyte = curpix*bytespp;
-        unsigned char run_length = 1;
-        bool raw = true;
-        while (curpix+run_length<npixels && run_length<max_chunk_length) {
-            bool succ_eq = true;
-            for (int t=0; succ_eq && t<bytespp; t++) {
-                succ_eq = (data[curbyte+t]==data[curbyte+t+bytespp]);
-            }
-            curbyte += bytespp;
-            if (1==run_length) {
-                raw = !succ_eq;
-            }
-            if (raw && succ_eq) {
-                run_length--;
-                break;
-            }
-            if (!raw && !succ_eq) {
-                break;
-            }
-            run_length++;
-        }
-        curpix += run_length;
-        out.put(raw?run_length-1:run_length+127);
-        if (!out.good()) {
-            std::cerr << "can't dump the tga file\n";
-            return false;
-        }
-        out.write((char *)(data+chunkstart), (raw?run_length*bytespp:bytespp));
-        if (!out.good()) {
-            std::cerr << "can't dump the tga file\n";
-            return false;
+// A raw packet is only cut for a run that is shorter as a packet of its own
+// plus the header of the raw packet that resumes after it, i.e.
+// (n-1)*bytespp > 2: from 2 equal pixels in color images, 4 in grayscale ones.
+// Packets run across scanlines, as they always did here. They go to a buffer
+// that is written at once.
+bool TGAImage::unload_rle_data(std::ostream &out) {
+    const int max_chunk_length = 128;
+    const int min_run = 2/bytespp + 2;
+    const long npixels = (long)width*height;
+    static thread_local std::vector<unsigned char> packets; // keeps its capacity, steady state writes do not allocate
+    packets.resize(npixels*bytespp + (npixels+max_chunk_length-1)/max_chunk_length); // the worst case: all raw
+    unsigned char *p = packets.data();
+    // equal pixels starting at i, up to limit
+    auto run = [this](long i, long limit) {
+        const unsigned char *pixel = data + i*bytespp;
+        long n = 1;
+        while (n<limit && !memcmp(pixel, pixel+n*bytespp, bytespp)) n++;
+        return n;
+    };
+    long i = 0;
+    while (i<npixels) {
+        long n = run(i, std::min((long)max_chunk_length, npixels-i));
+        if (n>=min_run) {
+            *p++ = n+127;
+            memcpy(p, data+i*bytespp, bytespp);
+            p += bytespp;
+            i += n;
+            continue;
         }
+        long start = i;
+        while (i<npixels && i-start<max_chunk_length && run(i, std::min((long)min_run, npixels-i))<min_run) i++;
+        *p++ = i-start-1;
+        memcpy(p, data+start*bytespp, (i-start)*bytespp);
+        p += (i-start)*bytespp;
+    }
+    out.write((char *)packets.data(), p-packets.data());
+    if (!out.good()) {
+        std::cerr << "can't dump the tga file\n";
+        return false;
     }
     return true;
 }
@@ -297,16 +356,12 @@ bool TGAImage::flip_horizontally() {
 bool TGAImage::flip_vertically() {
     if (!data) return false;
     unsigned long bytes_per_line = width*bytespp;
-    unsigned char *line = new unsigned char[bytes_per_line];
     int half = height>>1;
-    for (int j=0; j<half; j++) {
-        unsigned long l1 = j*bytes_per_line;
-        unsigned long l2 = (height-1-j)*bytes_per_line;
-        memmove((void *)line,      (void *)(data+l1), bytes_per_line);
-        memmove((void *)(data+l1), (void *)(data+l2), bytes_per_line);
-        memmove((void *)(data+l2), (void *)line,      bytes_per_line);
+    for (int j=0; j<half; j++) { // swapped in place, no scanline buffer
+        unsigned char *l1 = data + j*bytes_per_line;
+        unsigned char *l2 = data + (height-1-j)*bytes_per_line;
+        std::swap_ranges(l1, l1+bytes_per_line, l2);
     }
-    delete [] line;
     return true;
 }
 
@@ -348,8 +403,9 @@ bool TGAImage::scale(int w, int h) {
             nscanline += nlinebytes;
         }
     }
-    delete [] data;
+    free_data();
     data = tdata;
+    release = delete_array;
     width = w;
     height = h;
     return true;
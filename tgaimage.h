@@ -1,6 +1,8 @@
 #ifndef __IMAGE_H__
 #define __IMAGE_H__
 
+#include <cstddef>
+#include <cstring>
 #include <fstream>
 
 #pragma pack(push,1)
@@ -63,15 +65,40 @@ struct TGAColor {
 };
 
 
+// Pixels someone else owns: a TGAImage, a rectangle of one, or any buffer
+// with rows stride bytes apart. Copying a view copies no pixels, so
+// samplers, encoders and the rasterizer take one by value; it must not
+// outlive the buffer. No bounds checks.
+struct ImageView {
+    unsigned char *data;
+    int width, height, bytespp;
+    ptrdiff_t stride;   // bytes from one row to the next
+
+    ImageView() : data(NULL), width(0), height(0), bytespp(0), stride(0) {}
+    ImageView(unsigned char *p, int w, int h, int bpp, ptrdiff_t row_bytes=0)
+        : data(p), width(w), height(h), bytespp(bpp), stride(row_bytes ? row_bytes : (ptrdiff_t)w*bpp) {}
+    bool empty() const { return !data || width<=0 || height<=0; }
+    bool contiguous() const { return stride==(ptrdiff_t)width*bytespp; }
+    unsigned char *row(int y) const { return data + y*stride; }
+    unsigned char *pixel(int x, int y) const { return data + y*stride + x*bytespp; }
+    TGAColor get(int x, int y) const { return TGAColor(pixel(x, y), bytespp); }
+    void set(int x, int y, const TGAColor &c) const { memcpy(pixel(x, y), c.bgra, bytespp); }
+    ImageView sub(int x, int y, int w, int h) const { return ImageView(pixel(x, y), w, h, bytespp, stride); }
+};
+
 class TGAImage {
+public:
+    typedef void (*Release)(unsigned char *); // frees an adopted buffer
 protected:
     unsigned char* data;
     int width;
     int height;
     int bytespp;
+    Release release;  // of data, NULL when the image does not own it
 
     bool   load_rle_data(std::ifstream &in);
-    bool unload_rle_data(std::ofstream &out);
+    bool unload_rle_data(std::ostream &out);
+    void free_data();
 public:
     enum Format {
         GRAYSCALE=1, RGB=3, RGBA=4
@@ -79,9 +106,18 @@ public:
 
     TGAImage();
     TGAImage(int w, int h, int bpp);
-    TGAImage(const TGAImage &img);
+    // The w*h*bpp bytes at pixels, not copied. With release the image owns
+    // them and calls it when done with them; without, the caller keeps them
+    // alive as long as the image and its size does not change.
+    TGAImage(int w, int h, int bpp, unsigned char *pixels, Release release=NULL);
+    TGAImage(const TGAImage &img);  // copies the pixels into a buffer of its own
+    TGAImage(TGAImage &&img) noexcept;
+    // zeroed pixels whose buffer, and every row if the row size is a multiple
+    // of alignment, start on a multiple of it (a power of two)
+    static TGAImage aligned(int w, int h, int bpp, size_t alignment=64);
     bool read_tga_file(const char *filename);
     bool write_tga_file(const char *filename, bool rle=true);
+    bool write_tga(std::ostream &out, bool rle=true);
     bool flip_horizontally();
     bool flip_vertically();
     bool scale(int w, int h);
@@ -90,10 +126,14 @@ public:
     bool set(int x, int y, const TGAColor &c);
     ~TGAImage();
     TGAImage & operator =(const TGAImage &img);
+    TGAImage & operator =(TGAImage &&img) noexcept;
+    void swap(TGAImage &img);
     int get_width();
     int get_height();
     int get_bytespp();
     unsigned char *buffer();
+    bool owns_buffer() const { return data && release; }
+    ImageView view() { return ImageView(data, width, height, bytespp); }
     void clear();
 };
 
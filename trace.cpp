@@ -0,0 +1,128 @@
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "trace.h"
+
+std::atomic<bool> g_trace_enabled(false);
+
+// The owning thread sets busy around each write and records nothing once
+// frozen; trace_write() freezes a ring, then waits for busy to clear before
+// reading it. Both sides store, then load the other's flag, sequentially
+// consistent: either the writer sees frozen or the reader sees it busy.
+struct TraceBuffer {
+    std::vector<TraceEvent> events; // ring: once full the oldest events are overwritten
+    uint64_t count;
+    int tid;
+    const char *thread_name;
+    std::atomic<bool> busy, frozen;
+    TraceBuffer(int capacity, int id) : events(capacity), count(0), tid(id), thread_name(NULL), busy(false), frozen(false) {}
+};
+
+static std::mutex trace_mutex;
+static std::vector<std::unique_ptr<TraceBuffer> > trace_buffers; // outlive their threads
+static std::string trace_filename;
+static int trace_capacity = 0;
+static const std::chrono::steady_clock::time_point trace_epoch = std::chrono::steady_clock::now();
+static thread_local TraceBuffer *local_buffer = NULL;
+
+static TraceBuffer *thread_buffer() {
+    if (!local_buffer) {
+        std::lock_guard<std::mutex> lock(trace_mutex);
+        trace_buffers.emplace_back(new TraceBuffer(trace_capacity, (int)trace_buffers.size()));
+        local_buffer = trace_buffers.back().get();
+    }
+    return local_buffer;
+}
+
+uint64_t trace_now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now()-trace_epoch).count();
+}
+
+void trace_record(const char *name, const char *arg, uint64_t start_ns, uint64_t dur_ns) {
+    TraceBuffer *buf = thread_buffer();
+    buf->busy.store(true);
+    if (!buf->frozen.load()) {
+        TraceEvent &e = buf->events[buf->count++ % buf->events.size()];
+        e.name = name;
+        e.arg = arg;
+        e.start_ns = start_ns;
+        e.dur_ns = dur_ns;
+    }
+    buf->busy.store(false, std::memory_order_release);
+}
+
+bool trace_available() {
+#ifdef RENDER_TRACE
+    return true;
+#else
+    return false;
+#endif
+}
+
+static void trace_atexit() {
+    trace_write();
+}
+
+void trace_start(const char *filename, int events_per_thread) {
+    if (!trace_available() || trace_enabled()) return;
+    trace_filename = filename;
+    trace_capacity = events_per_thread;
+    g_trace_enabled = true;
+    std::atexit(trace_atexit);
+    trace_thread_name("main");
+}
+
+void trace_thread_name(const char *name) {
+    if (!trace_enabled()) return;
+    TraceBuffer *buf = thread_buffer();
+    buf->busy.store(true);
+    if (!buf->frozen.load()) buf->thread_name = name;
+    buf->busy.store(false, std::memory_order_release);
+}
+
+bool trace_write() {
+    if (!g_trace_enabled.exchange(false)) return false; // events recorded from now on are dropped
+    std::lock_guard<std::mutex> lock(trace_mutex);
+    for (size_t t=0; t<trace_buffers.size(); t++) { // and those being recorded finish first
+        trace_buffers[t]->frozen.store(true);
+        while (trace_buffers[t]->busy.load(std::memory_order_acquire)) std::this_thread::yield();
+    }
+    std::ofstream out(trace_filename.c_str());
+    if (!out.is_open()) {
+        std::cerr << "can't open file " << trace_filename << "\n";
+        return false;
+    }
+    out << std::fixed << std::setprecision(3) << "{\"traceEvents\":[\n";
+    bool first = true;
+    uint64_t dropped = 0;
+    for (size_t t=0; t<trace_buffers.size(); t++) {
+        const TraceBuffer &buf = *trace_buffers[t];
+        if (buf.thread_name) {
+            out << (first ? "" : ",\n") << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":" << buf.tid
+                << ",\"args\":{\"name\":\"" << buf.thread_name << "\"}}";
+            first = false;
+        }
+        uint64_t size = buf.events.size();
+        uint64_t begin = buf.count>size ? buf.count-size : 0;
+        dropped += begin;
+        for (uint64_t i=begin; i<buf.count; i++) {
+            const TraceEvent &e = buf.events[i % size];
+            out << (first ? "" : ",\n") << "{\"ph\":\"X\",\"name\":\"" << e.name << "\",\"pid\":1,\"tid\":" << buf.tid
+                << ",\"ts\":" << e.start_ns/1000.0 << ",\"dur\":" << e.dur_ns/1000.0;
+            if (e.arg) out << ",\"args\":{\"detail\":\"" << e.arg << "\"}";
+            out << "}";
+            first = false;
+        }
+    }
+    out << "\n],\"displayTimeUnit\":\"ms\"}\n";
+    std::cerr << "trace written to " << trace_filename;
+    if (dropped) std::cerr << " (" << dropped << " oldest events overwritten)";
+    std::cerr << std::endl;
+    return out.good();
+}
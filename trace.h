@@ -0,0 +1,54 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+// Scoped timeline instrumentation written as Chrome/Perfetto trace-event JSON
+// (open the file in chrome://tracing or ui.perfetto.dev).
+// TRACE_SCOPE records one complete event into a ring buffer owned by the calling
+// thread; nothing is shared between threads until trace_write(), which stops
+// each thread's recording before it reads that thread's ring. Names and args
+// must be string literals (or otherwise outlive the trace). Compiled out unless
+// RENDER_TRACE is defined, and a single branch when compiled in but not started.
+
+struct TraceEvent {
+    const char *name;
+    const char *arg;
+    uint64_t start_ns;
+    uint64_t dur_ns;
+};
+
+extern std::atomic<bool> g_trace_enabled;
+
+inline bool trace_enabled() {
+    return g_trace_enabled.load(std::memory_order_relaxed);
+}
+
+uint64_t trace_now_ns();
+void trace_record(const char *name, const char *arg, uint64_t start_ns, uint64_t dur_ns);
+
+struct TraceScope {
+    const char *name;
+    const char *arg;
+    uint64_t start;
+    TraceScope(const char *n, const char *a=NULL) : name(n), arg(a), start(trace_enabled() ? trace_now_ns() : 0) {}
+    ~TraceScope() { if (trace_enabled()) trace_record(name, arg, start, trace_now_ns()-start); }
+};
+
+#ifdef RENDER_TRACE
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(name)
+#define TRACE_SCOPE_ARG(name, arg) TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(name, arg)
+#else
+#define TRACE_SCOPE(name) ((void)0)
+#define TRACE_SCOPE_ARG(name, arg) ((void)0)
+#endif
+
+bool trace_available();
+void trace_start(const char *filename, int events_per_thread=1<<16); // the file is written at exit
+void trace_thread_name(const char *name);                            // labels the calling thread
+bool trace_write();                                                   // called at exit, safe to call early
+
+#endif //__TRACE_H__
@@ -0,0 +1,347 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <utility>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "vtexture.h"
+#include "trace.h"
+
+static const size_t page_size = 4096;
+
+static bool async_loading = false;
+static size_t default_cache_bytes = 64<<20;
+
+static std::atomic<uint32_t> frame_clock(1);
+static std::mutex frames_mutex;
+
+// The running frames by epoch, a fixed table so that starting a frame does not
+// allocate. When every entry is taken a frame joins the oldest one: running
+// under an older epoch only keeps slots from being reused longer.
+struct RunningFrame {
+    uint32_t epoch;
+    int count; // 0: a free entry
+};
+static const int MAX_RUNNING_FRAMES = 64;
+static RunningFrame running_frames[MAX_RUNNING_FRAMES];
+
+VirtualTexture::Frame::Frame() {
+    std::lock_guard<std::mutex> lock(frames_mutex);
+    epoch = frame_clock.fetch_add(1)+1;
+    running = -1;
+    for (int i=0; i<MAX_RUNNING_FRAMES && running<0; i++) {
+        if (!running_frames[i].count) running = i;
+    }
+    if (running<0) {
+        running = 0;
+        for (int i=1; i<MAX_RUNNING_FRAMES; i++) {
+            if (running_frames[i].epoch<running_frames[running].epoch) running = i;
+        }
+        epoch = running_frames[running].epoch;
+    }
+    running_frames[running].epoch = epoch;
+    running_frames[running].count++;
+}
+
+VirtualTexture::Frame::~Frame() {
+    std::lock_guard<std::mutex> lock(frames_mutex);
+    running_frames[running].count--;
+}
+
+// slots used at or after this stamp may still be read; with no frame running
+// it is the current clock, so samples outside frames keep their slots too
+static uint32_t oldest_frame() {
+    std::lock_guard<std::mutex> lock(frames_mutex);
+    uint32_t oldest = frame_clock.load();
+    for (int i=0; i<MAX_RUNNING_FRAMES; i++) {
+        if (running_frames[i].count) oldest = std::min(oldest, running_frames[i].epoch);
+    }
+    return oldest;
+}
+
+bool vtex_build(const char *tga_filename, const char *vtex_filename, int tile_size) {
+    TGAImage level;
+    if (!level.read_tga_file(tga_filename)) return false;
+    level.flip_vertically(); // same orientation as Model::load_texture
+    int bpp = level.get_bytespp();
+    int nlevels = 1;
+    for (int w=level.get_width(), h=level.get_height(); w>tile_size || h>tile_size; w=std::max(1, w/2), h=std::max(1, h/2)) nlevels++;
+
+    std::ofstream out(vtex_filename, std::ios::binary);
+    if (!out.is_open()) {
+        std::cerr << "can't open file " << vtex_filename << "\n";
+        return false;
+    }
+    VTexHeader header;
+    memcpy(header.magic, "VTEX", 4);
+    header.version = 1;
+    header.width = level.get_width();
+    header.height = level.get_height();
+    header.bytespp = bpp;
+    header.tile_size = tile_size;
+    header.nlevels = nlevels;
+    out.write((char *)&header, sizeof(header));
+    for (int l=0, w=header.width, h=header.height; l<nlevels; l++, w=std::max(1, w/2), h=std::max(1, h/2)) {
+        int dims[4] = {w, h, (w+tile_size-1)/tile_size, (h+tile_size-1)/tile_size};
+        out.write((char *)dims, sizeof(dims));
+    }
+    size_t pos = sizeof(header) + nlevels*4*sizeof(int);
+    std::vector<char> pad((page_size - pos%page_size)%page_size, 0);
+    out.write(pad.data(), pad.size());
+
+    std::vector<unsigned char> tile(tile_size*tile_size*bpp);
+    for (int l=0; l<nlevels; l++) {
+        int w = level.get_width(), h = level.get_height();
+        const unsigned char *src = level.buffer();
+        for (int ty=0; ty<(h+tile_size-1)/tile_size; ty++) {
+            for (int tx=0; tx<(w+tile_size-1)/tile_size; tx++) {
+                for (int y=0; y<tile_size; y++) {
+                    for (int x=0; x<tile_size; x++) { // edge tiles are padded by clamping
+                        int sx = std::min(w-1, tx*tile_size+x), sy = std::min(h-1, ty*tile_size+y);
+                        memcpy(&tile[(x+y*tile_size)*bpp], src+(sx+sy*w)*bpp, bpp);
+                    }
+                }
+                out.write((char *)tile.data(), tile.size());
+            }
+        }
+        if (l+1==nlevels) break;
+        // 2x2 box filter down to the next level
+        int nw = std::max(1, w/2), nh = std::max(1, h/2);
+        TGAImage next(nw, nh, bpp);
+        unsigned char *dst = next.buffer();
+        for (int y=0; y<nh; y++) {
+            for (int x=0; x<nw; x++) {
+                for (int c=0; c<bpp; c++) {
+                    int x0 = std::min(w-1, 2*x), x1 = std::min(w-1, 2*x+1), y0 = std::min(h-1, 2*y), y1 = std::min(h-1, 2*y+1);
+                    int sum = src[(x0+y0*w)*bpp+c] + src[(x1+y0*w)*bpp+c] + src[(x0+y1*w)*bpp+c] + src[(x1+y1*w)*bpp+c];
+                    dst[(x+y*nw)*bpp+c] = (sum+2)/4;
+                }
+            }
+        }
+        level = std::move(next);
+    }
+    if (!out.good()) {
+        std::cerr << "can't dump the vtex file\n";
+        return false;
+    }
+    return true;
+}
+
+VirtualTexture::VirtualTexture() : fd_(-1), map_(NULL), map_size_(0), data_offset_(0), width_(0), height_(0), bytespp_(0), tile_size_(0),
+    tile_bytes_(0), levels_(), slot_of_tile_(), touched_(), requested_(), tile_of_slot_(), slot_use_(), slots_(), fallbacks_(0),
+    loads_(0), evictions_(0), deferred_(0), full_since_(0), mutex_(), cv_(), queue_(), stop_(false), loader_() {
+}
+
+VirtualTexture::~VirtualTexture() {
+    if (loader_.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        loader_.join();
+    }
+    if (map_) munmap((void *)map_, map_size_);
+    if (fd_>=0) close(fd_);
+}
+
+void VirtualTexture::set_async(bool on) {
+    async_loading = on;
+}
+
+void VirtualTexture::set_cache_size(size_t bytes) {
+    default_cache_bytes = bytes;
+}
+
+size_t VirtualTexture::cache_size() {
+    return default_cache_bytes;
+}
+
+bool VirtualTexture::open(const char *filename, size_t cache_bytes) {
+    fd_ = ::open(filename, O_RDONLY);
+    if (fd_<0) return false;
+    struct stat st;
+    if (fstat(fd_, &st)<0 || (size_t)st.st_size<sizeof(VTexHeader)) return false;
+    map_size_ = st.st_size;
+    void *map = mmap(NULL, map_size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+    if (map==MAP_FAILED) {
+        std::cerr << "can't map " << filename << "\n";
+        return false;
+    }
+    map_ = (const unsigned char *)map;
+    VTexHeader header;
+    memcpy(&header, map_, sizeof(header));
+    if (memcmp(header.magic, "VTEX", 4) || header.version!=1 || header.nlevels<1 || header.tile_size<1 ||
+        (header.bytespp!=TGAImage::GRAYSCALE && header.bytespp!=TGAImage::RGB && header.bytespp!=TGAImage::RGBA) ||
+        sizeof(header)+header.nlevels*4*sizeof(int)>map_size_) {
+        std::cerr << "bad vtex file " << filename << "\n";
+        return false;
+    }
+    width_ = header.width;
+    height_ = header.height;
+    bytespp_ = header.bytespp;
+    tile_size_ = header.tile_size;
+    tile_bytes_ = (size_t)tile_size_*tile_size_*bytespp_;
+    int ntiles = 0;
+    const int *dims = (const int *)(map_+sizeof(header));
+    for (int l=0; l<header.nlevels; l++, dims+=4) {
+        Level lv = {dims[0], dims[1], dims[2], dims[3], ntiles};
+        levels_.push_back(lv);
+        ntiles += lv.tiles_x*lv.tiles_y;
+    }
+    size_t pos = sizeof(header) + header.nlevels*4*sizeof(int);
+    data_offset_ = pos + (page_size - pos%page_size)%page_size;
+    if (data_offset_ + ntiles*tile_bytes_ > map_size_) {
+        std::cerr << "truncated vtex file " << filename << "\n";
+        return false;
+    }
+    madvise((void *)map_, map_size_, MADV_RANDOM); // no read-ahead, only sampled tiles get paged in
+
+    int nslots = std::max<int>(8, cache_bytes/tile_bytes_);
+    slot_of_tile_ = std::vector<std::atomic<int> >(ntiles);
+    touched_ = std::vector<std::atomic<uint32_t> >(ntiles);
+    requested_.assign(ntiles, 0);
+    for (int i=0; i<ntiles; i++) {
+        slot_of_tile_[i].store(-1);
+        touched_[i].store(0);
+    }
+    tile_of_slot_.assign(nslots, -1);
+    slot_use_ = std::vector<std::atomic<uint32_t> >(nslots);
+    for (int i=0; i<nslots; i++) slot_use_[i].store(0);
+    slots_.assign(nslots*tile_bytes_, 0);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    const Level &last = levels_.back();
+    for (int i=0; i<last.tiles_x*last.tiles_y; i++) {
+        if (!load(last.first_tile+i)) break;
+        slot_use_[slot_of_tile_[last.first_tile+i]].store(UINT32_MAX); // pinned as the last-resort fallback
+    }
+    loader_ = std::thread(&VirtualTexture::run, this);
+    std::cerr << "virtual texture " << filename << " " << width_ << "x" << height_ << "/" << bytespp_*8 << ", "
+              << levels_.size() << " levels, " << ntiles << " tiles, " << (nslots*tile_bytes_+1023)/1024 << " KB tile cache" << std::endl;
+    return true;
+}
+
+size_t VirtualTexture::cache_bytes() const {
+    return slots_.size();
+}
+
+TGAColor VirtualTexture::sample(Vec2f uv, float lod) {
+    int want = std::max(0, std::min((int)levels_.size()-1, (int)std::floor(lod)));
+    for (int l=want; l<(int)levels_.size(); l++) {
+        const Level &lv = levels_[l];
+        int x = std::max(0, std::min(lv.width-1,  (int)(uv.x*lv.width)));
+        int y = std::max(0, std::min(lv.height-1, (int)(uv.y*lv.height)));
+        int tile = lv.first_tile + (y/tile_size_)*lv.tiles_x + x/tile_size_;
+        if (l==want && !touched_[tile].load(std::memory_order_relaxed)) touched_[tile].store(1, std::memory_order_relaxed);
+        int slot = slot_of_tile_[tile].load(std::memory_order_acquire);
+        if (slot<0 && l==want) {
+            request(tile);
+            slot = slot_of_tile_[tile].load(std::memory_order_acquire);
+        }
+        if (slot<0) {
+            fallbacks_.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+        // stamp the slot, then check it still holds the tile: load() unmaps a
+        // tile before it looks at the stamp, so either it sees this use and
+        // keeps the slot, or the check below sees the tile gone
+        const uint32_t now = frame_clock.load(std::memory_order_relaxed);
+        uint32_t use = slot_use_[slot].load();
+        while (use<now && !slot_use_[slot].compare_exchange_weak(use, now)) {}
+        if (slot_of_tile_[tile].load()!=slot) {
+            l--; // evicted under us, look again
+            continue;
+        }
+        int tx = x%tile_size_, ty = y%tile_size_;
+        return TGAColor(&slots_[slot*tile_bytes_ + (tx+ty*tile_size_)*bytespp_], bytespp_);
+    }
+    return TGAColor();
+}
+
+void VirtualTexture::request(int tile) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (slot_of_tile_[tile].load()>=0) return;
+    if (!async_loading) {
+        load(tile);
+    } else if (!requested_[tile]) {
+        requested_[tile] = 1;
+        queue_.push_back(tile);
+        cv_.notify_all();
+    }
+}
+
+bool VirtualTexture::load(int tile) {
+    TRACE_SCOPE("load_tile");
+    requested_[tile] = 0;
+    const uint32_t oldest = oldest_frame();
+    if (oldest==full_since_) { // still the same frames, still no slot to take
+        deferred_++;
+        return false;
+    }
+    int slot = -1;
+    while (slot<0) {
+        for (size_t s=0; s<tile_of_slot_.size(); s++) {
+            if (tile_of_slot_[s]<0) { slot = s; break; }
+            uint32_t use = slot_use_[s].load(); // pinned slots are never older
+            if (use<oldest && (slot<0 || use<slot_use_[slot].load())) slot = s;
+        }
+        if (slot<0) { // the running frames may read every slot, try again on a later miss
+            deferred_++;
+            full_since_ = oldest;
+            return false;
+        }
+        const int old = tile_of_slot_[slot];
+        if (old<0) break;
+        slot_of_tile_[old].store(-1);
+        if (slot_use_[slot].load()>=oldest) { // sampled since the scan, keep it
+            slot_of_tile_[old].store(slot);
+            slot = -1;
+            continue;
+        }
+        evictions_++;
+    }
+    size_t offset = data_offset_ + tile*tile_bytes_;
+    memcpy(&slots_[slot*tile_bytes_], map_+offset, tile_bytes_);
+    if (0==offset%page_size && 0==tile_bytes_%page_size) {
+        madvise((void *)(map_+offset), tile_bytes_, MADV_DONTNEED); // the copy is all we keep resident
+    }
+    tile_of_slot_[slot] = tile;
+    slot_use_[slot].store(frame_clock.load());
+    loads_++;
+    slot_of_tile_[tile].store(slot, std::memory_order_release);
+    return true;
+}
+
+void VirtualTexture::run() {
+    trace_thread_name("vtex_loader");
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+        cv_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+        if (stop_) return;
+        int tile = queue_.front();
+        queue_.pop_front();
+        if (slot_of_tile_[tile].load()<0) load(tile);
+        if (queue_.empty()) cv_.notify_all();
+    }
+}
+
+void VirtualTexture::wait_idle() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this] { return queue_.empty(); });
+}
+
+void VirtualTexture::report(std::ostream &out) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    out << "virtual texture: " << loads_ << " tile loads, " << evictions_ << " evictions, " << deferred_ << " deferred loads, " << fallbacks_.load() << " fallback samples; touched tiles per level:";
+    for (size_t l=0; l<levels_.size(); l++) {
+        int n = levels_[l].tiles_x*levels_[l].tiles_y, touched = 0;
+        for (int i=0; i<n; i++) touched += touched_[levels_[l].first_tile+i].load()!=0;
+        out << " " << touched << "/" << n;
+    }
+    out << std::endl;
+}
@@ -0,0 +1,93 @@
+#ifndef __VTEXTURE_H__
+#define __VTEXTURE_H__
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "geometry.h"
+#include "tgaimage.h"
+
+// Virtual texturing for textures larger than memory. A .vtex file holds the
+// texture and its mip chain pre-split into fixed-size tiles; it is mmapped and
+// only the tiles a render actually samples are copied into a bounded LRU tile
+// cache. While a tile is missing the sampler falls back to the finest resident
+// mip, and the coarsest level (a single tile) is always resident.
+//
+// Sampling takes no lock. A slot is stamped with the frame clock when sampled
+// and is not given to another tile while any frame that was running at that
+// time still runs; a load that finds no such slot is dropped and asked for
+// again by later samples, which fall back meanwhile.
+
+#pragma pack(push,1)
+struct VTexHeader {
+    char magic[4];       // "VTEX"
+    int version;
+    int width, height;   // of level 0
+    int bytespp;
+    int tile_size;
+    int nlevels;
+};
+#pragma pack(pop)
+
+// offline conversion, the texture is oriented like Model::load_texture leaves it
+bool vtex_build(const char *tga_filename, const char *vtex_filename, int tile_size=128);
+
+class VirtualTexture {
+public:
+    VirtualTexture();
+    ~VirtualTexture();
+    bool open(const char *filename, size_t cache_bytes);
+    TGAColor sample(Vec2f uv, float lod=0); // nearest texel of mip level lod
+    int get_width()  const { return width_; }
+    int get_height() const { return height_; }
+    size_t cache_bytes() const;
+    void wait_idle();                 // until every requested tile is loaded
+    void report(std::ostream &out);   // tiles touched per level, loads, fallbacks
+    static void set_async(bool on);   // async: misses are loaded in the background (default: in place)
+    static void set_cache_size(size_t bytes); // tile cache of every texture opened afterwards
+    static size_t cache_size();
+
+    // renders that sample virtual textures run inside a frame (one per render_*() call)
+    struct Frame {
+        Frame();  // never allocates
+        ~Frame();
+        uint32_t epoch;
+        int running; // its entry among the running frames
+    };
+private:
+    struct Level {
+        int width, height, tiles_x, tiles_y;
+        int first_tile;
+    };
+    void request(int tile);
+    bool load(int tile); // called with mutex_ held, false: every slot is still in use
+    void run();
+
+    int fd_;
+    const unsigned char *map_;
+    size_t map_size_;
+    size_t data_offset_;
+    int width_, height_, bytespp_, tile_size_;
+    size_t tile_bytes_;
+    std::vector<Level> levels_;
+    std::vector<std::atomic<int> > slot_of_tile_; // -1: not resident
+    std::vector<std::atomic<uint32_t> > touched_; // sampled at least once
+    std::vector<unsigned char> requested_;
+    std::vector<int> tile_of_slot_;
+    std::vector<std::atomic<uint32_t> > slot_use_; // frame clock of the last use, UINT32_MAX: pinned
+    std::vector<unsigned char> slots_;            // the tile cache memory
+    std::atomic<uint64_t> fallbacks_;
+    uint64_t loads_, evictions_, deferred_;
+    uint32_t full_since_; // oldest frame when the last load found every slot in use
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<int> queue_;
+    bool stop_;
+    std::thread loader_;
+};
+
+#endif //__VTEXTURE_H__